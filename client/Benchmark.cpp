@@ -0,0 +1,882 @@
+/**
+   ssltests
+   Benchmark.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Benchmark.h"
+
+#include <algorithm>
+#include <string.h>
+
+#include <poll.h>
+#include <sys/resource.h>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+Benchmark::Benchmark(string h, int p) {
+	host = h;
+	port = p;
+
+	verifyPeer = CLIENT_VERIFY;
+	verifyCache = NULL;
+	serverName = "";
+	certFile = "";
+	keyFile = "";
+	minVersion = CLIENT_MIN_VERSION;
+	maxVersion = CLIENT_MAX_VERSION;
+
+	pattern.resize(BENCH_PATTERN_SIZE + BENCH_CHUNK_SIZE);
+	unsigned int x = 1;
+	for(int i = 0; i < BENCH_PATTERN_SIZE; i++) {
+		x = x * 1103515245 + 12345;
+		pattern[i] = (char)(x >> 16);
+	}
+	copy(pattern.begin(), pattern.begin() + BENCH_CHUNK_SIZE, pattern.begin() + BENCH_PATTERN_SIZE);
+}
+
+/**
+ * Run Protocols
+ * For each protocol version this OpenSSL knows, time a series of full handshakes, then push bytes through one
+ * connection and time the echo. Versions the server refuses are reported and skipped
+ *
+ * @param handshakes Connections per version for the latency numbers
+ * @param bytes Bytes echoed per version for the throughput number (0 = skip)
+ * @return True if at least one version completed
+ */
+bool Benchmark::runProtocols(int handshakes, long long bytes) {
+	int versions[] = { TLS1_VERSION, TLS1_1_VERSION, TLS1_2_VERSION, TLS1_3_VERSION };
+	bool any = false;
+
+	printf("Benchmark: %i handshakes and %lli bytes echoed per protocol version against %s:%i\n", handshakes, bytes, host.c_str(), port);
+	for(unsigned int v = 0; v < sizeof(versions) / sizeof(versions[0]); v++) {
+		const char* name = tls_version_name(versions[v]);
+		vector<long> lat;
+		string cipher;
+
+		for(int i = 0; i < handshakes; i++) {
+			SSLClient cl;
+			long us = 0;
+			if(!connectClient(&cl, versions[v], versions[v], &us))
+				break;
+			lat.push_back(us);
+			cipher = SSL_get_cipher_name(cl.getSSL());
+		}
+		if(lat.empty()) {
+			printf("%-7s not supported by this client or the server\n", name);
+			continue;
+		}
+
+		printf("%-7s %s\n", name, cipher.c_str());
+		printLatency("  handshake", lat);
+		any = true;
+
+		if(bytes <= 0)
+			continue;
+		SSLClient cl;
+		long us = 0;
+		double secs = 0;
+		if(!connectClient(&cl, versions[v], versions[v], &us) || !echoBulk(cl.getSSL(), bytes, BENCH_CHUNK_SIZE, &secs)) {
+			printf("  bulk echo failed\n");
+			continue;
+		}
+		printf("  bulk echo: %.1f MB/s each way (%.2f s)\n", bytes / secs / (1024 * 1024), secs);
+	}
+
+	return any;
+}
+
+/**
+ * Run Early Data
+ * Time the first request of a connection (connect to complete echo) over TLS 1.3 three ways: a full handshake,
+ * a resumed handshake with the request sent afterwards, and a resumed handshake carrying the request as early
+ * data. The server must run with -earlydata for the last case to save its round trip
+ *
+ * @param requests Connections per case
+ * @param size Request bytes, must fit the server's early data limit
+ * @return True if every request was answered
+ */
+bool Benchmark::runEarlyData(int requests, int size) {
+	const char* names[] = { "full handshake", "resumed", "resumed + 0-RTT" };
+	vector<char> req(size, 'r');
+	bool ok = true;
+
+	printf("Benchmark: first request latency, %i requests of %i bytes per case against %s:%i (TLS 1.3)\n", requests, size, host.c_str(), port);
+	for(int mode = 0; mode < 3; mode++) {
+		vector<long> lat;
+		int early = 0;
+		long us = 0;
+		bool wasEarly = false;
+		SSL_SESSION* sess = NULL;
+
+		// Prime a session for the resumed cases
+		if((mode > 0) && !timeFirstRequest(NULL, false, req, &us, &sess, &wasEarly)) {
+			printf("%-16s could not prime a session\n", names[mode]);
+			ok = false;
+			continue;
+		}
+
+		for(int i = 0; i < requests; i++) {
+			SSL_SESSION* next = NULL;
+			if(!timeFirstRequest(sess, mode == 2, req, &us, (mode > 0) ? &next : NULL, &wasEarly)) {
+				ok = false;
+				break;
+			}
+			lat.push_back(us);
+			if(wasEarly)
+				early++;
+
+			// Stateless tickets could be reused, but each new connection hands out a fresh one anyway
+			if(next) {
+				SSL_SESSION_free(sess);
+				sess = next;
+			}
+		}
+		if(sess)
+			SSL_SESSION_free(sess);
+
+		printf("%-16s early data accepted %i/%u\n", names[mode], early, (unsigned int)lat.size());
+		printLatency("  first request", lat);
+	}
+
+	return ok;
+}
+
+/**
+ * Time First Request
+ * Connect, send req and wait for its echo
+ *
+ * @param resume Session to resume, NULL for a full handshake
+ * @param idempotent Allow req to go out as early data
+ * @param us Connect to complete echo
+ * @param next If not NULL, receives the connection's session for the next resumption (caller frees)
+ * @param early Whether req went out as accepted early data
+ */
+bool Benchmark::timeFirstRequest(SSL_SESSION* resume, bool idempotent, const vector<char>& req, long* us, SSL_SESSION** next, bool* early) {
+	SSLClient cl;
+	vector<char> resp(req.size());
+
+	configureClient(&cl);
+	cl.setVersionRange(TLS1_3_VERSION, TLS1_3_VERSION);
+	cl.setSession(resume);
+	cl.setEarlyData(&req[0], req.size(), idempotent);
+	if(!cl.initSocket(host, port))
+		return false;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	if(!cl.attemptConnect() || !readFully(cl.getSSL(), &resp[0], resp.size()))
+		return false;
+	*us = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+	*early = cl.earlyDataAccepted();
+	if(next)
+		*next = cl.getSession();
+	return true;
+}
+
+/**
+ * Read Fully
+ * Read until exactly len bytes have arrived, waiting in poll() in between
+ */
+bool Benchmark::readFully(SSL* ssl, char* buf, int len) {
+	int got = 0;
+	while(got < len) {
+		int r = SSL_read(ssl, buf + got, len - got);
+		if(r > 0) {
+			got += r;
+			continue;
+		}
+		struct pollfd pfd = { SSL_get_fd(ssl), POLLIN, 0 };
+		int err = SSL_get_error(ssl, r);
+		if(err == SSL_ERROR_WANT_WRITE)
+			pfd.events = POLLOUT;
+		else if(err != SSL_ERROR_WANT_READ)
+			return false;
+		poll(&pfd, 1, 100);
+	}
+	return true;
+}
+
+/**
+ * Run kTLS
+ * Echo bytes over TLS 1.2 and 1.3 with user space record encryption and with kernel TLS requested, reporting
+ * throughput and this process's CPU time per GB moved (each byte is sent and received once). Start the server
+ * with -ktls for its side to offload too, and run it under time(1) to see its CPU
+ *
+ * @param bytes Bytes echoed per run
+ * @return True if every run completed
+ */
+bool Benchmark::runKtls(long long bytes) {
+	int versions[] = { TLS1_2_VERSION, TLS1_3_VERSION };
+	bool ok = true;
+
+	printf("Benchmark: %lli bytes echoed per run against %s:%i\n", bytes, host.c_str(), port);
+	for(unsigned int v = 0; v < sizeof(versions) / sizeof(versions[0]); v++) {
+		for(int useKtls = 0; useKtls < 2; useKtls++) {
+			SSLClient cl;
+			long us = 0;
+			double secs = 0;
+			cl.setKtls(useKtls != 0);
+			if(!connectClient(&cl, versions[v], versions[v], &us)) {
+				printf("%-7s %-10s could not connect\n", tls_version_name(versions[v]), useKtls ? "kTLS" : "user space");
+				ok = false;
+				continue;
+			}
+
+			double cpu = cpuSeconds();
+			bool done = echoBulk(cl.getSSL(), bytes, BENCH_CHUNK_SIZE, &secs);
+			cpu = cpuSeconds() - cpu;
+			if(!done) {
+				printf("%-7s %-10s echo failed\n", tls_version_name(versions[v]), useKtls ? "kTLS" : "user space");
+				ok = false;
+				continue;
+			}
+
+			double gb = (2.0 * bytes) / (1024.0 * 1024 * 1024);
+			printf("%-7s %-10s %s: %.1f MB/s each way, client CPU %.2f s/GB (kTLS send %s, receive %s)\n",
+				tls_version_name(versions[v]), useKtls ? "kTLS" : "user space", SSL_get_cipher_name(cl.getSSL()),
+				bytes / secs / (1024 * 1024), cpu / gb, cl.isKtlsSend() ? "on" : "off", cl.isKtlsRecv() ? "on" : "off");
+		}
+	}
+
+	return ok;
+}
+
+/**
+ * Run Verify
+ * Time server certificate verification and the whole handshake over full handshakes, first verifying every
+ * chain from scratch and then through a verify cache shared by all the connections
+ *
+ * @param connects Connections per case
+ * @return True if every connection was verified
+ */
+bool Benchmark::runVerify(int connects) {
+	VerifyCache cache(VERIFY_CACHE_SIZE, VERIFY_CACHE_TTL);
+	bool ok = true;
+
+	printf("Benchmark: %i full handshakes per case against %s:%i, verifying against %s\n", connects, host.c_str(), port, CLIENT_CERTFILE);
+	for(int cached = 0; cached < 2; cached++) {
+		vector<long> verifyLat, handshakeLat;
+		int hits = 0;
+
+		for(int i = 0; i < connects; i++) {
+			SSLClient cl;
+			long us = 0;
+			configureClient(&cl);
+			cl.setVerify(true, cached ? &cache : NULL);
+			cl.setVersionRange(CLIENT_MIN_VERSION, CLIENT_MAX_VERSION);
+			if(!cl.initSocket(host, port)) {
+				ok = false;
+				break;
+			}
+			boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+			if(!cl.attemptConnect()) {
+				ok = false;
+				break;
+			}
+			us = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+			handshakeLat.push_back(us);
+			verifyLat.push_back(cl.getVerifyUs());
+			if(cl.wasVerifyCached())
+				hits++;
+		}
+
+		printf("%s: %i/%u answered from the cache\n", cached ? "verify cache" : "full verification", hits, (unsigned int)verifyLat.size());
+		printLatency("  verify", verifyLat);
+		printLatency("  handshake", handshakeLat);
+	}
+	cache.printStats();
+
+	return ok;
+}
+
+/**
+ * Run Handshakes
+ * Connect, handshake and close as fast as possible from parallel workers, first with full handshakes and then
+ * resuming a session each worker primed beforehand. Reports handshakes per second, client CPU per handshake and
+ * the handshake latency of each case. Run the server with -quiet, and under time(1) to see its CPU
+ *
+ * @param workers Threads connecting in parallel
+ * @param seconds Duration of each case
+ * @return True if both cases completed handshakes
+ */
+bool Benchmark::runHandshakes(int workers, int seconds) {
+	const char* names[] = { "full", "resumed" };
+	bool ok = true;
+
+	workers = max(1, workers);
+	printf("Benchmark: handshakes for %i s per case from %i workers against %s:%i\n", seconds, workers, host.c_str(), port);
+	for(int resume = 0; resume < 2; resume++) {
+		vector<HandshakeStats> stats(workers);
+		boost::thread_group group;
+
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		boost::posix_time::ptime end = start + boost::posix_time::seconds(seconds);
+		double cpu = cpuSeconds();
+		for(int i = 0; i < workers; i++)
+			group.create_thread(boost::bind(&Benchmark::handshakeWorker, this, resume != 0, end, &stats[i]));
+		group.join_all();
+		double secs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+		cpu = cpuSeconds() - cpu;
+
+		vector<long> lat;
+		unsigned long resumed = 0, failures = 0;
+		for(int i = 0; i < workers; i++) {
+			lat.insert(lat.end(), stats[i].latency.begin(), stats[i].latency.end());
+			resumed += stats[i].resumed;
+			failures += stats[i].failures;
+		}
+		if(lat.empty()) {
+			printf("%-8s no handshake completed, %lu failed\n", names[resume], failures);
+			ok = false;
+			continue;
+		}
+
+		printf("%-8s %u handshakes, %.0f/s, %lu failed", names[resume], (unsigned int)lat.size(), lat.size() / secs, failures);
+		if(resume)
+			printf(", %lu/%u resumed", resumed, (unsigned int)lat.size());
+		printf("\n  client CPU %.0f us per handshake (%.0f%% of one core)\n", (cpu * 1000000.0) / lat.size(), (100.0 * cpu) / secs);
+		printLatency("  handshake", lat);
+	}
+
+	return ok;
+}
+
+/**
+ * Handshake Worker
+ * Loop of connect, handshake, close until end. A resuming worker first primes a session with a full handshake
+ * and a one byte echo (TLS 1.3 sends the ticket after the handshake), then offers it on every connection
+ */
+void Benchmark::handshakeWorker(bool resume, boost::posix_time::ptime end, HandshakeStats* stats) {
+	SSL_SESSION* sess = NULL;
+	stats->resumed = 0;
+	stats->failures = 0;
+
+	if(resume) {
+		SSLClient cl;
+		long us = 0;
+		char b = 'h';
+		if(!connectClient(&cl, minVersion, maxVersion, &us) || (SSL_write(cl.getSSL(), &b, 1) != 1) ||
+			!readFully(cl.getSSL(), &b, 1) || !(sess = cl.getSession())) {
+			stats->failures++;
+			return;
+		}
+	}
+
+	while(boost::posix_time::microsec_clock::universal_time() < end) {
+		SSLClient cl;
+		long us = 0;
+		cl.setSession(sess);
+		if(!connectClient(&cl, minVersion, maxVersion, &us)) {
+			stats->failures++;
+			continue;
+		}
+		stats->latency.push_back(us);
+		if(SSL_session_reused(cl.getSSL()))
+			stats->resumed++;
+	}
+
+	if(sess)
+		SSL_SESSION_free(sess);
+}
+
+/**
+ * Run Bulk
+ * Echo bytes over parallel connections for each cipher suite and record size below, reporting throughput and
+ * client CPU cycles per byte (each byte is encrypted and decrypted once on this side). The payload is checked as
+ * it comes back, so a path that corrupts data fails instead of looking fast. Suites the client or the server
+ * lacks are reported and skipped. Run the server with -quiet
+ *
+ * @param bytes Bytes echoed per run, split over the connections
+ * @param connections Connections echoing at once, one thread each
+ * @return True if every negotiated run echoed its payload intact
+ */
+bool Benchmark::runBulk(long long bytes, int connections) {
+	const char* suites[] = { "TLS_AES_128_GCM_SHA256", "TLS_AES_256_GCM_SHA384", "TLS_CHACHA20_POLY1305_SHA256",
+		"ECDHE-RSA-AES128-GCM-SHA256", "ECDHE-RSA-AES256-GCM-SHA384", "ECDHE-RSA-CHACHA20-POLY1305", "AES128-SHA256", "AES128-SHA" };
+	int records[] = { 1024, 4096, BENCH_CHUNK_SIZE };
+	bool ok = true;
+
+	connections = max(1, connections);
+	long long perConnection = bytes / connections;
+	printf("Benchmark: %lli bytes echoed per run over %i connections against %s:%i\n", perConnection * connections, connections, host.c_str(), port);
+	printf("%-30s %7s %10s %12s\n", "cipher", "record", "MB/s", "cycles/byte");
+	for(unsigned int s = 0; s < sizeof(suites) / sizeof(suites[0]); s++) {
+		bool tls13 = (strncmp(suites[s], "TLS_", 4) == 0);
+
+		for(unsigned int r = 0; r < sizeof(records) / sizeof(records[0]); r++) {
+			vector<SSLClient*> clients;
+			bool connected = true;
+			for(int c = 0; (c < connections) && connected; c++) {
+				SSLClient* cl = new SSLClient();
+				long us = 0;
+				clients.push_back(cl);
+				cl->setCiphers(suites[s]);
+				connected = connectClient(cl, tls13 ? TLS1_3_VERSION : CLIENT_MIN_VERSION, tls13 ? TLS1_3_VERSION : TLS1_2_VERSION, &us);
+			}
+			if(!connected) {
+				printf("%-30s not supported by this client or the server\n", suites[s]);
+				for(unsigned int c = 0; c < clients.size(); c++)
+					delete clients[c];
+				break;
+			}
+
+			vector<int> done(connections, 0);
+			boost::thread_group group;
+			boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+			unsigned long long tsc = cycleCounter();
+			double cpu = cpuSeconds();
+			for(int c = 0; c < connections; c++)
+				group.create_thread(boost::bind(&Benchmark::bulkWorker, this, clients[c]->getSSL(), perConnection, records[r], &done[c]));
+			group.join_all();
+			double secs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+			tsc = cycleCounter() - tsc;
+			cpu = cpuSeconds() - cpu;
+
+			string cipher = SSL_get_cipher_name(clients[0]->getSSL());
+			for(unsigned int c = 0; c < clients.size(); c++)
+				delete clients[c];
+			if(count(done.begin(), done.end(), 0) > 0) {
+				printf("%-30s %7i echo failed\n", cipher.c_str(), records[r]);
+				ok = false;
+				continue;
+			}
+
+			// CPU seconds to cycles at the rate the cycle counter ran over the same wall time
+			char cycles[32] = "n/a";
+			if(tsc > 0)
+				snprintf(cycles, sizeof(cycles), "%.2f", (cpu * (tsc / secs)) / (perConnection * connections));
+			printf("%-30s %7i %10.1f %12s\n", cipher.c_str(), records[r], (perConnection * connections) / secs / (1024 * 1024), cycles);
+		}
+	}
+
+	return ok;
+}
+
+/**
+ * Bulk Worker
+ * One connection's share of runBulk()
+ */
+void Benchmark::bulkWorker(SSL* ssl, long long bytes, int chunk, int* done) {
+	double secs = 0;
+	*done = echoBulk(ssl, bytes, chunk, &secs) ? 1 : 0;
+}
+
+/**
+ * Run Pool
+ * Time small requests (connection to complete echo) made from parallel workers, first opening a new connection
+ * for every request and then taking connections from a ConnectionPool warmed with one per worker
+ *
+ * @param requests Requests per case, split over the workers
+ * @param workers Threads making requests at once
+ * @return True if every request was answered
+ */
+bool Benchmark::runPool(int requests, int workers) {
+	const char* names[] = { "new connection", "pooled" };
+	bool ok = true;
+
+	workers = max(1, workers);
+	printf("Benchmark: %i requests of %i bytes per case from %i workers against %s:%i\n", requests, BENCH_REQUEST_SIZE, workers, host.c_str(), port);
+	for(int pooled = 0; pooled < 2; pooled++) {
+		ConnectionPool* pool = NULL;
+		if(pooled) {
+			pool = new ConnectionPool(workers, workers, POOL_IDLE_TIMEOUT);
+			pool->setVerify(verifyPeer, verifyCache, serverName);
+			pool->setVersionRange(minVersion, maxVersion);
+			if(!certFile.empty())
+				pool->setClientCert(certFile, keyFile);
+			if(!pool->warm(host, port))
+				printf("%-14s could not warm every connection\n", names[pooled]);
+			pool->start();
+		}
+
+		vector<vector<long> > lat(workers);
+		vector<int> failures(workers, 0);
+		boost::thread_group group;
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		for(int i = 0; i < workers; i++)
+			group.create_thread(boost::bind(&Benchmark::poolWorker, this, pool, requests / workers, &lat[i], &failures[i]));
+		group.join_all();
+		double secs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+
+		vector<long> all;
+		int failed = 0;
+		for(int i = 0; i < workers; i++) {
+			all.insert(all.end(), lat[i].begin(), lat[i].end());
+			failed += failures[i];
+		}
+		if(failed)
+			ok = false;
+		printf("%-14s %u requests, %.0f/s, %i failed\n", names[pooled], (unsigned int)all.size(), all.size() / secs, failed);
+		printLatency("  request", all);
+		if(pool) {
+			pool->printStats();
+			delete pool;
+		}
+	}
+
+	return ok;
+}
+
+/**
+ * Pool Worker
+ * One worker's requests for runPool(), through pool or over a new connection each when pool is NULL
+ */
+void Benchmark::poolWorker(ConnectionPool* pool, int requests, vector<long>* latency, int* failures) {
+	vector<char> resp(BENCH_REQUEST_SIZE);
+
+	for(int i = 0; i < requests; i++) {
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		SSLClient* cl = NULL;
+		if(pool) {
+			cl = pool->checkout(host, port);
+		} else {
+			long us = 0;
+			cl = new SSLClient();
+			if(!connectClient(cl, minVersion, maxVersion, &us)) {
+				delete cl;
+				cl = NULL;
+			}
+		}
+
+		bool done = cl && (cl->writeData(&pattern[0], BENCH_REQUEST_SIZE) == BENCH_REQUEST_SIZE) &&
+			readFully(cl->getSSL(), &resp[0], resp.size()) && (memcmp(&resp[0], &pattern[0], resp.size()) == 0);
+		if(done)
+			latency->push_back((boost::posix_time::microsec_clock::universal_time() - start).total_microseconds());
+		else
+			(*failures)++;
+
+		if(pool)
+			pool->checkin(cl, done);
+		else
+			delete cl;
+	}
+}
+
+/**
+ * Run Context
+ * Time connects made from parallel workers, each with a client of its own, three ways: every client building its
+ * own context (trust store and certificates read from disk each time), all clients sharing one ClientContext
+ * with its session store off, and sharing one that hands every connect the session another worker last got. Each
+ * connect carries one request, so TLS 1.3 tickets have arrived before the client goes away
+ *
+ * @param connects Connects per case, split over the workers
+ * @param workers Threads connecting at once
+ * @return True if every connect and request succeeded
+ */
+bool Benchmark::runContext(int connects, int workers) {
+	const char* names[] = { "per client", "shared", "shared+resume" };
+	bool ok = true;
+
+	workers = max(1, workers);
+	printf("Benchmark: %i connects per case from %i workers against %s:%i\n", connects, workers, host.c_str(), port);
+	for(int c = 0; c < 3; c++) {
+		ClientContext* ctx = NULL;
+		if(c > 0) {
+			ctx = new ClientContext();
+			ctx->setVerify(verifyPeer, verifyCache);
+			ctx->setVersionRange(minVersion, maxVersion);
+			if(!certFile.empty())
+				ctx->setClientCert(certFile, keyFile);
+			ctx->setSessionStore(c == 2);
+			if(!ctx->init()) {
+				ctx->release();
+				return false;
+			}
+		}
+
+		vector<HandshakeStats> stats(workers);
+		for(int i = 0; i < workers; i++) {
+			stats[i].resumed = 0;
+			stats[i].failures = 0;
+		}
+		boost::thread_group group;
+		double cpu = cpuSeconds();
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		for(int i = 0; i < workers; i++)
+			group.create_thread(boost::bind(&Benchmark::contextWorker, this, ctx, connects / workers, &stats[i]));
+		group.join_all();
+		double secs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+		cpu = cpuSeconds() - cpu;
+
+		vector<long> all;
+		unsigned long resumed = 0, failures = 0;
+		for(int i = 0; i < workers; i++) {
+			all.insert(all.end(), stats[i].latency.begin(), stats[i].latency.end());
+			resumed += stats[i].resumed;
+			failures += stats[i].failures;
+		}
+		if(failures)
+			ok = false;
+		printf("%-14s %u connects, %.0f/s, %lu resumed, %lu failed, %.0f us client CPU each\n", names[c],
+			(unsigned int)all.size(), all.size() / secs, resumed, failures, all.empty() ? 0.0 : (1000000.0 * cpu) / all.size());
+		printLatency("  connect", all);
+		if(ctx) {
+			if(c == 2)
+				ctx->printStats();
+			ctx->release();
+		}
+	}
+
+	return ok;
+}
+
+/**
+ * Context Worker
+ * One worker's connects for runContext(), through ctx or with a context per client when ctx is NULL
+ */
+void Benchmark::contextWorker(ClientContext* ctx, int connects, HandshakeStats* stats) {
+	vector<char> resp(BENCH_REQUEST_SIZE);
+
+	for(int i = 0; i < connects; i++) {
+		SSLClient* cl = new SSLClient();
+		configureClient(cl);
+		cl->setVersionRange(minVersion, maxVersion);
+		cl->setContext(ctx);
+
+		// Context setup is part of the cost being compared
+		boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+		bool done = cl->initSocket(host, port) && cl->attemptConnect();
+		long us = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+		done = done && (cl->writeData(&pattern[0], BENCH_REQUEST_SIZE) == BENCH_REQUEST_SIZE) &&
+			readFully(cl->getSSL(), &resp[0], resp.size()) && (memcmp(&resp[0], &pattern[0], resp.size()) == 0);
+		if(done) {
+			stats->latency.push_back(us);
+			if(SSL_session_reused(cl->getSSL()))
+				stats->resumed++;
+		} else {
+			stats->failures++;
+		}
+		delete cl;
+	}
+}
+
+/**
+ * Run Mux
+ * Request/response over one connection carrying 1, 10 and then 100 streams at once. Every request gets a stream
+ * of its own: BENCH_REQUEST_SIZE bytes with FIN, done when the echo and the server's FIN are back. As soon as a
+ * stream finishes the next request opens another, so the connection always has that many in flight
+ *
+ * @param seconds Length of each case
+ * @return True if every case negotiated streams and got every echo back intact
+ */
+bool Benchmark::runMux(int seconds) {
+	const int concurrency[] = { 1, 10, 100 };
+	bool ok = true;
+
+	printf("Benchmark: %i byte requests on multiplexed streams for %i s per case against %s:%i\n", BENCH_REQUEST_SIZE, seconds, host.c_str(), port);
+	for(unsigned int c = 0; c < sizeof(concurrency) / sizeof(concurrency[0]); c++) {
+		int streams = concurrency[c];
+		long us = 0;
+		SSLClient* cl = new SSLClient();
+		cl->setAlpn(MUX_ALPN);
+		if(!connectClient(cl, minVersion, maxVersion, &us)) {
+			printf("%3i streams: could not connect\n", streams);
+			delete cl;
+			return false;
+		}
+		if(cl->getAlpnSelected() != MUX_ALPN) {
+			printf("Benchmark: server did not select %s, it needs ALPN and a build with multiplexed streams\n", MUX_ALPN);
+			delete cl;
+			return false;
+		}
+
+		MuxClient mux(cl);
+		vector<unsigned int> id(streams, 0);
+		vector<unsigned int> got(streams, 0);
+		vector<boost::posix_time::ptime> start(streams);
+		vector<long> latency;
+		vector<char> buf(BENCH_REQUEST_SIZE);
+		int errors = 0;
+
+		boost::posix_time::ptime begin = boost::posix_time::microsec_clock::universal_time();
+		boost::posix_time::ptime end = begin + boost::posix_time::seconds(seconds);
+		while(boost::posix_time::microsec_clock::universal_time() < end) {
+			for(int i = 0; i < streams; i++) {
+				if(id[i])
+					continue;
+				id[i] = mux.openStream();
+				got[i] = 0;
+				start[i] = boost::posix_time::microsec_clock::universal_time();
+				if(mux.write(id[i], &pattern[0], BENCH_REQUEST_SIZE, true) != BENCH_REQUEST_SIZE)
+					errors++;
+			}
+
+			if(!mux.service(CLIENT_POLL_MS)) {
+				errors++;
+				break;
+			}
+
+			for(int i = 0; i < streams; i++) {
+				int r;
+				while((r = mux.read(id[i], &buf[0], buf.size())) > 0) {
+					if((got[i] + r > BENCH_REQUEST_SIZE) || (memcmp(&buf[0], &pattern[got[i]], r) != 0))
+						errors++;
+					got[i] += r;
+				}
+				if(!mux.finished(id[i]))
+					continue;
+				if((r < 0) || (got[i] != BENCH_REQUEST_SIZE))
+					errors++;
+				else
+					latency.push_back((boost::posix_time::microsec_clock::universal_time() - start[i]).total_microseconds());
+				mux.closeStream(id[i]);
+				id[i] = 0;
+			}
+		}
+		double secs = (boost::posix_time::microsec_clock::universal_time() - begin).total_microseconds() / 1000000.0;
+
+		if(errors)
+			ok = false;
+		printf("%3i streams: %u requests, %.0f/s, %i errors\n", streams, (unsigned int)latency.size(), latency.size() / secs, errors);
+		printLatency("  request", latency);
+		delete cl;
+	}
+
+	return ok;
+}
+
+/**
+ * Configure Client
+ * Quiet client with the run's verification settings
+ */
+void Benchmark::configureClient(SSLClient* cl) {
+	cl->setVerbose(false);
+	cl->setVerify(verifyPeer, verifyCache);
+	if(!serverName.empty())
+		cl->setServerName(serverName);
+	if(!certFile.empty())
+		cl->setClientCert(certFile, keyFile);
+}
+
+/**
+ * Connect Client
+ * Connect a fresh quiet client pinned to [minV, maxV] and time its handshake
+ */
+bool Benchmark::connectClient(SSLClient* cl, int minV, int maxV, long* handshakeUs) {
+	configureClient(cl);
+	cl->setVersionRange(minV, maxV);
+	if(!cl->initSocket(host, port))
+		return false;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	if(!cl->attemptConnect())
+		return false;
+	*handshakeUs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+	return true;
+}
+
+/**
+ * Echo Bulk
+ * Stream the pattern to the echo server in chunk sized writes while draining the echo, until all of it came back.
+ * Every echoed byte is compared against what was sent. Waits in poll() when neither direction can move, so the
+ * CPU time of a run is the TLS work and not spinning
+ *
+ * @param chunk Bytes per SSL_write, at most BENCH_CHUNK_SIZE
+ * @param secs Time from the first write to the last echoed byte
+ */
+bool Benchmark::echoBulk(SSL* ssl, long long bytes, int chunk, double* secs) {
+	vector<char> in(BENCH_CHUNK_SIZE);
+	long long sent = 0, received = 0;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	while(received < bytes) {
+		struct pollfd pfd = { SSL_get_fd(ssl), POLLIN, 0 };
+		bool moved = false;
+
+		if(sent < bytes) {
+			// A retried write passes the same pointer and length again, sent hasn't moved
+			int len = (int)min((long long)chunk, bytes - sent);
+			int r = SSL_write(ssl, &pattern[sent % BENCH_PATTERN_SIZE], len);
+			if(r > 0) {
+				sent += r;
+				moved = true;
+			} else {
+				int err = SSL_get_error(ssl, r);
+				if(err == SSL_ERROR_WANT_WRITE)
+					pfd.events |= POLLOUT;
+				else if(err != SSL_ERROR_WANT_READ)
+					return false;
+			}
+		}
+
+		int r = SSL_read(ssl, &in[0], (int)min((long long)in.size(), bytes - received));
+		if(r > 0) {
+			if(memcmp(&in[0], &pattern[received % BENCH_PATTERN_SIZE], r) != 0) {
+				printf("Benchmark: echoed payload corrupted between bytes %lli and %lli\n", received, received + r);
+				return false;
+			}
+			received += r;
+			moved = true;
+		} else {
+			int err = SSL_get_error(ssl, r);
+			if(err == SSL_ERROR_WANT_WRITE)
+				pfd.events |= POLLOUT;
+			else if(err != SSL_ERROR_WANT_READ)
+				return false;
+		}
+
+		if(!moved)
+			poll(&pfd, 1, 100);
+	}
+	*secs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+
+	return true;
+}
+
+/**
+ * CPU Seconds
+ * User plus system time used by this process so far
+ */
+double Benchmark::cpuSeconds() {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000000.0;
+}
+
+/**
+ * Cycle Counter
+ * The CPU's time stamp counter, 0 where there is none
+ */
+unsigned long long Benchmark::cycleCounter() {
+#if defined(__i386__) || defined(__x86_64__)
+	unsigned int lo, hi;
+	__asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((unsigned long long)hi << 32) | lo;
+#else
+	return 0;
+#endif
+}
+
+/**
+ * Print Latency
+ * One line summary of a latency sample in microseconds. Sorts us
+ */
+void Benchmark::printLatency(const char* label, vector<long>& us) {
+	if(us.empty())
+		return;
+
+	sort(us.begin(), us.end());
+	long long total = 0;
+	for(unsigned int i = 0; i < us.size(); i++)
+		total += us[i];
+
+	printf("%s: n=%u avg %lli us, p50 %li us, p99 %li us, max %li us\n", label, (unsigned int)us.size(),
+		total / (long long)us.size(), us[us.size() / 2], us[(us.size() * 99) / 100], us.back());
+}
@@ -0,0 +1,115 @@
+/**
+   ssltests
+   Benchmark.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _benchmark_h_
+#define _benchmark_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+#include "SSLClient.h"
+#include "ConnectionPool.h"
+#include "MuxClient.h"
+
+#define BENCH_CHUNK_SIZE 16384 // Bytes handed to each SSL_write in throughput runs (one full TLS record)
+#define BENCH_REQUEST_SIZE 64 // Bytes per request in request/response runs
+#define BENCH_PATTERN_SIZE 65521 // Period of the echoed payload, prime so it never lines up with the records
+
+using namespace std;
+
+/**
+ * Benchmark
+ * Client side measurements against the echo server. Each run uses fresh SSLClients with verbose output off, so
+ * the server should be started with -quiet as well.
+ */
+class Benchmark {
+private:
+	string host;
+	int port;
+
+	// Applied to every client a run creates
+	bool verifyPeer;
+	VerifyCache* verifyCache;
+	string serverName;
+	string certFile; // Client certificate for servers that verify their clients
+	string keyFile;
+	int minVersion;
+	int maxVersion;
+
+	// Payload of the throughput runs, BENCH_PATTERN_SIZE pseudo random bytes followed by the first BENCH_CHUNK_SIZE
+	// again, so any chunk starting inside the period is contiguous
+	vector<char> pattern;
+
+	// One handshake worker's results, see runHandshakes()
+	struct HandshakeStats {
+		vector<long> latency; // Connect to handshake complete, us
+		unsigned long resumed;
+		unsigned long failures;
+	};
+
+private:
+	void configureClient(SSLClient* cl);
+	bool connectClient(SSLClient* cl, int minV, int maxV, long* handshakeUs);
+	bool echoBulk(SSL* ssl, long long bytes, int chunk, double* secs);
+	void bulkWorker(SSL* ssl, long long bytes, int chunk, int* done);
+	void poolWorker(ConnectionPool* pool, int requests, vector<long>* latency, int* failures);
+	void contextWorker(ClientContext* ctx, int connects, HandshakeStats* stats);
+	bool readFully(SSL* ssl, char* buf, int len);
+	bool timeFirstRequest(SSL_SESSION* resume, bool idempotent, const vector<char>& req, long* us, SSL_SESSION** next, bool* early);
+	void handshakeWorker(bool resume, boost::posix_time::ptime end, HandshakeStats* stats);
+
+public:
+	Benchmark(string h, int p);
+
+	bool runProtocols(int handshakes, long long bytes);
+	bool runEarlyData(int requests, int size);
+	bool runKtls(long long bytes);
+	bool runVerify(int connects);
+	bool runHandshakes(int workers, int seconds);
+	bool runBulk(long long bytes, int connections);
+	bool runPool(int requests, int workers);
+	bool runMux(int seconds);
+	bool runContext(int connects, int workers);
+
+	void setVerify(bool enable, VerifyCache* cache, string name) {
+		verifyPeer = enable;
+		verifyCache = cache;
+		serverName = name;
+	}
+
+	void setClientCert(string cert, string key) {
+		certFile = cert;
+		keyFile = key;
+	}
+
+	// Used by runHandshakes(), the other runs pick their own versions
+	void setVersionRange(int minV, int maxV) {
+		minVersion = minV;
+		maxVersion = maxV;
+	}
+
+	static void printLatency(const char* label, vector<long>& us);
+	static double cpuSeconds();
+	static unsigned long long cycleCounter();
+};
+
+#endif
@@ -0,0 +1,265 @@
+/**
+   ssltests
+   ClientContext.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "ClientContext.h"
+#include "SSLClient.h"
+
+ClientContext::ClientContext() {
+	ctx = NULL;
+	verifyPeer = CLIENT_VERIFY;
+	verifyCache = NULL;
+	minVersion = CLIENT_MIN_VERSION;
+	maxVersion = CLIENT_MAX_VERSION;
+	certFile = "";
+	keyFile = "";
+	ciphers = "";
+	ktls = false;
+	storeSessions = true;
+	refs = 1;
+	stored = 0;
+	resumeOffers = 0;
+	resumeMisses = 0;
+}
+
+/**
+ * Client Context Destructor
+ * Only reached through the last release(), when no SSL of the context is left
+ */
+ClientContext::~ClientContext() {
+	for(SessionMap::iterator it = sessions.begin(); it != sessions.end(); it++) {
+		for(unsigned int i = 0; i < it->second.size(); i++)
+			SSL_SESSION_free(it->second[i]);
+	}
+	sessions.clear();
+
+	if(ctx)
+		SSL_CTX_free(ctx);
+}
+
+/**
+ * Init
+ * Build the SSL_CTX from the settings: version range, trust store, client certificate, verification, ciphers
+ *
+ * @return True if the context can be used
+ */
+bool ClientContext::init() {
+	if(ctx) {
+		printf("ClientContext: Already initialized\n");
+		return false;
+	}
+
+	// Create a CTX structure with the version flexible method, then narrow it to [minVersion, maxVersion]
+	ctx = SSL_CTX_new(tls_client_method());
+	if(!ctx) {
+		printf("ClientContext: Could not create the client context\n");
+		return false;
+	}
+
+	if(!tls_set_version_range(ctx, minVersion, maxVersion)) {
+		printf("ClientContext: No supported protocol version in the configured range\n");
+		return false;
+	}
+
+	// Load the trusted certificate
+	if(SSL_CTX_load_verify_locations(ctx, CLIENT_CERTFILE, NULL) <= 0) {
+		printf("ClientContext: Couldn't load verification cert file\n");
+		return false;
+	}
+
+	// Certificate for servers that verify their clients
+	if(!certFile.empty()) {
+		SSL_CTX_set_default_passwd_cb(ctx, SSLClient::passwordCallback);
+		if(SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) <= 0) {
+			printf("ClientContext: Couldn't load client certificate %s\n", certFile.c_str());
+			return false;
+		}
+		if(SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) <= 0) {
+			printf("ClientContext: Couldn't load client private key %s\n", keyFile.c_str());
+			return false;
+		}
+		if(!SSL_CTX_check_private_key(ctx)) {
+			printf("ClientContext: Client private key and certificate do NOT match\n");
+			return false;
+		}
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if(ktls)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	// Verify the server against the trusted certificate, through the verify cache if there is one
+	if(verifyPeer) {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		SSL_CTX_set_cert_verify_callback(ctx, SSLClient::verifyCallback, verifyCache);
+	} else {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	}
+
+	// Writes go out of the send queue, which moves and hands SSL_write() at most one record at a time
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	// The library's cipher suites (all of them if older versions were asked for) unless told otherwise. A TLS 1.3
+	// list replaces the 1.3 suites and keeps the rest
+	if(ciphers.compare(0, 4, "TLS_") == 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		if(SSL_CTX_set_ciphersuites(ctx, ciphers.c_str()) <= 0) {
+			printf("ClientContext: Could not select TLS 1.3 ciphersuites %s\n", ciphers.c_str());
+			return false;
+		}
+#else
+		printf("ClientContext: %s has no TLS 1.3 ciphersuites\n", OPENSSL_VERSION_TEXT);
+		return false;
+#endif
+	}
+	if(SSL_CTX_set_cipher_list(ctx, (ciphers.empty() || (ciphers.compare(0, 4, "TLS_") == 0)) ? tls_cipher_list(minVersion) : ciphers.c_str()) <= 0) {
+		printf("ClientContext: Could not select any ciphers\n");
+		return false;
+	}
+
+	// Sessions are handed to newSessionCallback() as they arrive (for TLS 1.3 that is after the handshake, on
+	// whichever thread reads the ticket) and kept here rather than in OpenSSL's cache
+	if(storeSessions) {
+		SSL_CTX_set_app_data(ctx, this);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, newSessionCallback);
+	}
+
+	return true;
+}
+
+/**
+ * Retain
+ * Take another reference, for a client about to use the context
+ */
+void ClientContext::retain() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	refs++;
+}
+
+/**
+ * Release
+ * Drop a reference, freeing the context with the last one. The caller must not touch it afterwards
+ */
+void ClientContext::release() {
+	mutex.lock();
+	bool last = (--refs == 0);
+	mutex.unlock();
+
+	if(last)
+		delete this;
+}
+
+/**
+ * Store Session
+ * Keep sess (takes the caller's reference) for the next connect to host:port under the server name name, dropping
+ * the oldest session once that server has CLIENT_CTX_SESSIONS
+ */
+void ClientContext::storeSession(const string& host, int port, const string& name, SSL_SESSION* sess) {
+	SSL_SESSION* dropped = NULL;
+
+	mutex.lock();
+	deque<SSL_SESSION*>& q = sessions[sessionKey(host, port, name)];
+	q.push_back(sess);
+	if(q.size() > CLIENT_CTX_SESSIONS) {
+		dropped = q.front();
+		q.pop_front();
+	}
+	stored++;
+	mutex.unlock();
+
+	if(dropped)
+		SSL_SESSION_free(dropped);
+}
+
+/**
+ * Take Session
+ * The newest session stored for host:port under the server name name. A TLS 1.3 ticket leaves the store, since servers may refuse one that
+ * is offered twice; older sessions stay for other connections to resume
+ *
+ * @return The session (caller frees), NULL if there is none
+ */
+SSL_SESSION* ClientContext::takeSession(const string& host, int port, const string& name) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+
+	SessionMap::iterator it = sessions.find(sessionKey(host, port, name));
+	if((it == sessions.end()) || it->second.empty()) {
+		resumeMisses++;
+		return NULL;
+	}
+
+	SSL_SESSION* sess = it->second.back();
+	resumeOffers++;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if(SSL_SESSION_get_protocol_version(sess) >= TLS1_3_VERSION) {
+		it->second.pop_back();
+		return sess;
+	}
+#endif
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_SESSION_up_ref(sess);
+#else
+	CRYPTO_add(&sess->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+	return sess;
+}
+
+/**
+ * Print Stats
+ * Dump the session store counters
+ */
+void ClientContext::printStats() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+
+	unsigned int held = 0;
+	for(SessionMap::iterator it = sessions.begin(); it != sessions.end(); it++)
+		held += it->second.size();
+	printf("ClientContext: %lu sessions stored, %u held for %u hosts, %lu connects offered one, %lu found none\n", stored,
+		held, (unsigned int)sessions.size(), resumeOffers, resumeMisses);
+}
+
+/**
+ * Session Key
+ * Store key of a server. The server name is part of it: virtual hosts behind one address issue sessions for their
+ * own certificate, and one must never be offered to another name
+ */
+string ClientContext::sessionKey(const string& host, int port, const string& name) {
+	char key[600];
+	snprintf(key, sizeof(key), "%s:%i/%s", host.c_str(), port, name.c_str());
+	return key;
+}
+
+/**
+ * New Session Callback
+ * OpenSSL hands over every session a server issues to a connection of the context
+ *
+ * @return 1 when the session's reference was kept, 0 to let OpenSSL drop it
+ */
+int ClientContext::newSessionCallback(SSL* ssl, SSL_SESSION* sess) {
+	ClientContext* c = (ClientContext*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	SSLClient* cl = (SSLClient*)SSL_get_app_data(ssl);
+	if(!c || !cl)
+		return 0;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if(!SSL_SESSION_is_resumable(sess))
+		return 0;
+#endif
+	c->storeSession(cl->getHost(), cl->getPort(), cl->getServerName(), sess);
+	return 1;
+}
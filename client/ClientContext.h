@@ -0,0 +1,131 @@
+/**
+   ssltests
+   ClientContext.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _clientcontext_h_
+#define _clientcontext_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <deque>
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include "../common/TlsVersion.h"
+#include "../common/VerifyCache.h"
+
+#define CLIENT_CTX_SESSIONS 4 // Sessions kept per host:port, TLS 1.3 servers hand out several single use tickets
+
+using namespace std;
+
+/**
+ * Client Context
+ * An SSL_CTX built once (trust store, client certificate, versions, ciphers) and shared by any number of
+ * SSLClients on any number of threads, so a connect costs an SSL_new() instead of re-reading certificate files.
+ * Reference counted: the creator holds the first reference and every client given the context with
+ * SSLClient::setContext() holds one more; the last release() frees it. Settings take effect on init() and are
+ * fixed after it.
+ *
+ * Sessions the servers issue to connections of this context are kept per host:port, so the next connection to
+ * the same server resumes no matter which client or thread made the last one. TLS 1.3 tickets are handed out
+ * once each, earlier sessions are reused until a newer one replaces them. Safe to share between threads.
+ */
+class ClientContext {
+private:
+	typedef boost::unordered_map<string, deque<SSL_SESSION*> > SessionMap;
+
+	SSL_CTX* ctx;
+
+	bool verifyPeer;
+	VerifyCache* verifyCache; // Shared, not owned
+	int minVersion;
+	int maxVersion;
+	string certFile;
+	string keyFile;
+	string ciphers;
+	bool ktls;
+	bool storeSessions;
+
+	boost::mutex mutex; // Guards everything below
+	int refs;
+	SessionMap sessions; // Newest at the back
+
+	// Statistics
+	unsigned long stored;
+	unsigned long resumeOffers; // Connects that were given a stored session
+	unsigned long resumeMisses; // Connects that found none
+
+private:
+	~ClientContext();
+
+	static string sessionKey(const string& host, int port, const string& name);
+	static int newSessionCallback(SSL* ssl, SSL_SESSION* sess);
+
+public:
+	ClientContext();
+
+	bool init();
+	void retain();
+	void release();
+	void storeSession(const string& host, int port, const string& name, SSL_SESSION* sess);
+	SSL_SESSION* takeSession(const string& host, int port, const string& name);
+	void printStats();
+
+	SSL_CTX* getCTX() {
+		return ctx;
+	}
+
+	bool isVerifyPeer() {
+		return verifyPeer;
+	}
+
+	void setVerify(bool enable, VerifyCache* cache) {
+		verifyPeer = enable;
+		verifyCache = cache;
+	}
+
+	void setVersionRange(int minV, int maxV) {
+		minVersion = minV;
+		maxVersion = maxV;
+	}
+
+	void setClientCert(string cert, string key) {
+		certFile = cert;
+		keyFile = key;
+	}
+
+	// TLS 1.3 suites if it starts with TLS_, empty for all
+	void setCiphers(string list) {
+		ciphers = list;
+	}
+
+	void setKtls(bool enable) {
+		ktls = enable;
+	}
+
+	// Keep the sessions servers issue and offer them on the next connect to the same host:port
+	void setSessionStore(bool enable) {
+		storeSessions = enable;
+	}
+};
+
+#endif
@@ -0,0 +1,362 @@
+/**
+   ssltests
+   ConnectionPool.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "ConnectionPool.h"
+
+#include <poll.h>
+#include <vector>
+
+#include <boost/bind.hpp>
+
+ConnectionPool::ConnectionPool(unsigned int minIdlePerHost, unsigned int maxIdlePerHost, int idleSecs) {
+	minIdle = minIdlePerHost;
+	maxIdle = (maxIdlePerHost > minIdlePerHost) ? maxIdlePerHost : minIdlePerHost;
+	idleTimeout = idleSecs;
+
+	verifyPeer = CLIENT_VERIFY;
+	verifyCache = NULL;
+	serverName = "";
+	minVersion = CLIENT_MIN_VERSION;
+	maxVersion = CLIENT_MAX_VERSION;
+	certFile = "";
+	keyFile = "";
+
+	running = false;
+	maintainThread = NULL;
+
+	hits = 0;
+	misses = 0;
+	evicted = 0;
+	unhealthy = 0;
+	connectFailures = 0;
+}
+
+ConnectionPool::~ConnectionPool() {
+	stop();
+
+	for(PoolMap::iterator it = pools.begin(); it != pools.end(); it++) {
+		HostPool* p = it->second;
+		for(unsigned int i = 0; i < p->idle.size(); i++)
+			delete p->idle[i].cl;
+		if(p->session)
+			SSL_SESSION_free(p->session);
+		delete p;
+	}
+	pools.clear();
+}
+
+/**
+ * Start
+ * Spawn the maintenance thread. Warm the hosts that matter with warm() first, later ones get their minimum on
+ * the first maintenance pass after their first checkout
+ *
+ * @return True if the pool is maintaining itself
+ */
+bool ConnectionPool::start() {
+	mutex.lock();
+	if(running) {
+		mutex.unlock();
+		return true;
+	}
+	running = true;
+	mutex.unlock();
+	maintainThread = new boost::thread(boost::bind(&ConnectionPool::maintainLoop, this));
+
+	return true;
+}
+
+/**
+ * Stop
+ * Stop maintaining. Idle connections stay open until the pool is destroyed
+ */
+void ConnectionPool::stop() {
+	mutex.lock();
+	if(!running) {
+		mutex.unlock();
+		return;
+	}
+	running = false;
+	stopCond.notify_all();
+	mutex.unlock();
+
+	maintainThread->join();
+	delete maintainThread;
+	maintainThread = NULL;
+}
+
+/**
+ * Warm
+ * Open connections to host:port until it has the warm minimum idle. Blocks while they connect
+ *
+ * @return True if the minimum is reached
+ */
+bool ConnectionPool::warm(string host, int port) {
+	mutex.lock();
+	HostPool* p = getPool(host, port);
+	unsigned int have = p->idle.size() + p->opening;
+	unsigned int need = (have < minIdle) ? minIdle - have : 0;
+	p->opening += need;
+	mutex.unlock();
+
+	bool ok = true;
+	for(unsigned int i = 0; i < need; i++) {
+		SSLClient* cl = openConnection(host, port);
+		boost::lock_guard<boost::mutex> lock(mutex);
+		p->opening--;
+		if(!cl) {
+			ok = false;
+			continue;
+		}
+		Idle e;
+		e.cl = cl;
+		e.since = time(NULL);
+		p->idle.push_back(e);
+	}
+
+	return ok;
+}
+
+/**
+ * Checkout
+ * A healthy connection to host:port for the caller's exclusive use until checkin(). Reuses the most recently
+ * returned idle connection, connects only if there is none
+ *
+ * @return The connection, NULL if none could be established
+ */
+SSLClient* ConnectionPool::checkout(string host, int port) {
+	while(true) {
+		SSLClient* cl = NULL;
+		mutex.lock();
+		HostPool* p = getPool(host, port);
+		if(!p->idle.empty()) {
+			cl = p->idle.back().cl;
+			p->idle.pop_back();
+		}
+		mutex.unlock();
+		if(!cl)
+			break;
+
+		// Checked out, so nobody else touches it during the health check
+		bool ok = healthy(cl);
+		mutex.lock();
+		if(ok)
+			hits++;
+		else
+			unhealthy++;
+		mutex.unlock();
+		if(ok)
+			return cl;
+		delete cl;
+	}
+
+	mutex.lock();
+	misses++;
+	mutex.unlock();
+	return openConnection(host, port);
+}
+
+/**
+ * Checkin
+ * Return a connection from checkout(). It goes back to the idle set if the caller says its exchange completed
+ * cleanly and it still looks healthy, otherwise (or if the host already has the most idle connections allowed)
+ * it is closed. Its session becomes the one new connections to the host resume
+ *
+ * @param cl Connection from checkout()
+ * @param reusable False if the caller abandoned an exchange half way and the stream is in an unknown state
+ */
+void ConnectionPool::checkin(SSLClient* cl, bool reusable) {
+	if(!cl)
+		return;
+
+	bool keep = reusable && healthy(cl);
+	SSL_SESSION* sess = keep ? cl->getSession() : NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if(sess && !SSL_SESSION_is_resumable(sess)) {
+		SSL_SESSION_free(sess);
+		sess = NULL;
+	}
+#endif
+
+	mutex.lock();
+	HostPool* p = getPool(cl->getHost(), cl->getPort());
+	if(sess) {
+		if(p->session)
+			SSL_SESSION_free(p->session);
+		p->session = sess;
+	}
+	if(keep && (p->idle.size() < maxIdle)) {
+		Idle e;
+		e.cl = cl;
+		e.since = time(NULL);
+		p->idle.push_back(e);
+		cl = NULL;
+	}
+	mutex.unlock();
+
+	if(cl)
+		delete cl;
+}
+
+/**
+ * Print Stats
+ * Dump checkout and eviction counters
+ */
+void ConnectionPool::printStats() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+
+	unsigned int idle = 0;
+	for(PoolMap::iterator it = pools.begin(); it != pools.end(); it++)
+		idle += it->second->idle.size();
+	unsigned long checkouts = hits + misses;
+	printf("ConnectionPool: %lu checkouts, %lu reused (%.1f%%), %lu connected, %lu connect failures\n", checkouts, hits,
+		checkouts ? (100.0 * hits) / checkouts : 0.0, misses, connectFailures);
+	printf("ConnectionPool: %lu evicted idle, %lu failed the health check, %u idle over %u hosts\n", evicted, unhealthy,
+		idle, (unsigned int)pools.size());
+}
+
+/**
+ * Get Pool
+ * The host:port's pool, created on first use. Call with mutex held
+ */
+ConnectionPool::HostPool* ConnectionPool::getPool(const string& host, int port) {
+	char key[300];
+	snprintf(key, sizeof(key), "%s:%i", host.c_str(), port);
+	PoolMap::iterator it = pools.find(key);
+	if(it != pools.end())
+		return it->second;
+
+	HostPool* p = new HostPool();
+	p->host = host;
+	p->port = port;
+	p->opening = 0;
+	p->session = NULL;
+	pools[key] = p;
+	return p;
+}
+
+/**
+ * Open Connection
+ * Connect a quiet client with the pool's settings, resuming the host's last session if there is one. Call
+ * without mutex held, it blocks for the handshake
+ *
+ * @return The connection, NULL on failure
+ */
+SSLClient* ConnectionPool::openConnection(const string& host, int port) {
+	SSLClient* cl = new SSLClient();
+	cl->setVerbose(false);
+	cl->setVerify(verifyPeer, verifyCache);
+	cl->setVersionRange(minVersion, maxVersion);
+	if(!serverName.empty())
+		cl->setServerName(serverName);
+	if(!certFile.empty())
+		cl->setClientCert(certFile, keyFile);
+
+	mutex.lock();
+	cl->setSession(getPool(host, port)->session);
+	mutex.unlock();
+
+	if(!cl->initSocket(host, port) || !cl->attemptConnect()) {
+		delete cl;
+		mutex.lock();
+		connectFailures++;
+		mutex.unlock();
+		return NULL;
+	}
+	return cl;
+}
+
+/**
+ * Maintain
+ * One maintenance pass: drop idle connections that died or sat unused past the timeout (oldest first, never
+ * below the warm minimum), then bring every host back up to the minimum
+ */
+void ConnectionPool::maintain() {
+	vector<SSLClient*> dead;
+	vector<pair<string, int> > hosts;
+	time_t now = time(NULL);
+
+	mutex.lock();
+	for(PoolMap::iterator it = pools.begin(); it != pools.end(); it++) {
+		HostPool* p = it->second;
+		for(deque<Idle>::iterator i = p->idle.begin(); i != p->idle.end();) {
+			if(healthy(i->cl)) {
+				i++;
+				continue;
+			}
+			dead.push_back(i->cl);
+			i = p->idle.erase(i);
+			unhealthy++;
+		}
+		while((p->idle.size() > minIdle) && (now - p->idle.front().since > idleTimeout)) {
+			dead.push_back(p->idle.front().cl);
+			p->idle.pop_front();
+			evicted++;
+		}
+		hosts.push_back(make_pair(p->host, p->port));
+	}
+	mutex.unlock();
+
+	for(unsigned int i = 0; i < dead.size(); i++)
+		delete dead[i];
+	for(unsigned int i = 0; i < hosts.size(); i++)
+		warm(hosts[i].first, hosts[i].second);
+}
+
+/**
+ * Maintain Loop
+ * Runs maintain() every POOL_MAINTAIN_INTERVAL ms until stop()
+ */
+void ConnectionPool::maintainLoop() {
+	while(true) {
+		{
+			boost::unique_lock<boost::mutex> lock(mutex);
+			boost::system_time wakeAt = boost::get_system_time() + boost::posix_time::milliseconds(POOL_MAINTAIN_INTERVAL);
+			while(running && (boost::get_system_time() < wakeAt))
+				stopCond.timed_wait(lock, wakeAt);
+			if(!running)
+				return;
+		}
+		maintain();
+	}
+}
+
+/**
+ * Healthy
+ * Cheap check that an idle connection can carry a new request: nothing should be readable on it. Readable data
+ * is fine if it is only TLS housekeeping (a session ticket) that SSL_peek() consumes without returning
+ * anything; a close, an error or unread application data fail it
+ */
+bool ConnectionPool::healthy(SSLClient* cl) {
+	if(!cl->isClientRunning() || !cl->getSSL() || (cl->getQueuedBytes() > 0))
+		return false;
+
+	struct pollfd pfd = { cl->getFd(), POLLIN, 0 };
+	int r = poll(&pfd, 1, 0);
+	if(r == 0)
+		return SSL_pending(cl->getSSL()) == 0;
+	if((r < 0) || (pfd.revents & (POLLERR | POLLNVAL)))
+		return false;
+
+	char b;
+	r = SSL_peek(cl->getSSL(), &b, 1);
+	if(r > 0)
+		return false;
+	bool ok = (SSL_get_error(cl->getSSL(), r) == SSL_ERROR_WANT_READ);
+	ERR_clear_error();
+	return ok;
+}
@@ -0,0 +1,130 @@
+/**
+   ssltests
+   ConnectionPool.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _connectionpool_h_
+#define _connectionpool_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <deque>
+#include <time.h>
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include "SSLClient.h"
+
+#define POOL_MIN_IDLE 2 // Warm connections kept open per host:port
+#define POOL_MAX_IDLE 32 // Idle connections kept per host:port, more are closed on checkin
+#define POOL_IDLE_TIMEOUT 60 // Seconds an idle connection above the warm minimum is kept
+#define POOL_MAINTAIN_INTERVAL 1000 // ms between maintenance passes (evict, health check, warm up)
+
+using namespace std;
+
+/**
+ * Connection Pool
+ * Keeps established TLS connections open per host:port and hands them out, so a request pays neither the TCP
+ * connect nor the handshake. checkout() takes the most recently returned connection (a hash lookup and a
+ * pop), after a health check that costs one poll() with no timeout: a connection the server closed, or one with
+ * unread data left over from an earlier request, is thrown away rather than handed out. Only when no idle
+ * connection is left does checkout() connect, resuming the host's last session where it can.
+ *
+ * A maintenance thread (start()) closes connections idle for longer than the timeout beyond the warm minimum,
+ * drops dead ones and opens new ones until every host has its minimum again. Safe to share between threads,
+ * a checked out connection belongs to its caller until checkin().
+ */
+class ConnectionPool {
+private:
+	struct Idle {
+		SSLClient* cl;
+		time_t since;
+	};
+
+	struct HostPool {
+		string host;
+		int port;
+		deque<Idle> idle; // Most recently checked in at the back
+		unsigned int opening; // Connections warm() is opening right now
+		SSL_SESSION* session; // Offered by new connections to resume instead of a full handshake
+	};
+	typedef boost::unordered_map<string, HostPool*> PoolMap;
+
+	unsigned int minIdle;
+	unsigned int maxIdle;
+	int idleTimeout;
+
+	// Applied to every connection
+	bool verifyPeer;
+	VerifyCache* verifyCache;
+	string serverName;
+	int minVersion;
+	int maxVersion;
+	string certFile;
+	string keyFile;
+
+	bool running;
+	boost::thread* maintainThread;
+	boost::mutex mutex; // Guards everything below
+	boost::condition_variable stopCond;
+	PoolMap pools;
+
+	// Statistics
+	unsigned long hits; // Checkouts served by an idle connection
+	unsigned long misses; // Checkouts that had to connect
+	unsigned long evicted;
+	unsigned long unhealthy;
+	unsigned long connectFailures;
+
+private:
+	HostPool* getPool(const string& host, int port);
+	SSLClient* openConnection(const string& host, int port);
+	void maintain();
+	void maintainLoop();
+
+	static bool healthy(SSLClient* cl);
+
+public:
+	ConnectionPool(unsigned int minIdlePerHost, unsigned int maxIdlePerHost, int idleSecs);
+	~ConnectionPool();
+
+	bool start();
+	void stop();
+	bool warm(string host, int port);
+	SSLClient* checkout(string host, int port);
+	void checkin(SSLClient* cl, bool reusable);
+	void printStats();
+
+	void setVerify(bool enable, VerifyCache* cache, string name) {
+		verifyPeer = enable;
+		verifyCache = cache;
+		serverName = name;
+	}
+
+	void setVersionRange(int minV, int maxV) {
+		minVersion = minV;
+		maxVersion = maxV;
+	}
+
+	void setClientCert(string cert, string key) {
+		certFile = cert;
+		keyFile = key;
+	}
+};
+
+#endif
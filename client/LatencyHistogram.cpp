@@ -0,0 +1,180 @@
+/**
+   ssltests
+   LatencyHistogram.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "LatencyHistogram.h"
+
+#include <math.h>
+
+// Sub buckets per power of two above the exact range
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+
+LatencyHistogram::LatencyHistogram() {
+	counts.assign(HISTOGRAM_HALF * (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 2), 0);
+	total = 0;
+	minValue = 0;
+	maxValue = 0;
+	sum = 0;
+}
+
+/**
+ * Record
+ * Count one value. Negative values count as 0, values past the tracked range as the largest tracked one
+ */
+void LatencyHistogram::record(long long value) {
+	if(value < 0)
+		value = 0;
+	if(value >= (1LL << HISTOGRAM_MAX_BITS))
+		value = (1LL << HISTOGRAM_MAX_BITS) - 1;
+
+	counts[indexOf(value)]++;
+	if(!total || (value < minValue))
+		minValue = value;
+	if(value > maxValue)
+		maxValue = value;
+	total++;
+	sum += value;
+}
+
+/**
+ * Add
+ * Merge another histogram's counts into this one
+ */
+void LatencyHistogram::add(const LatencyHistogram& other) {
+	if(!other.total)
+		return;
+	for(unsigned int i = 0; i < counts.size(); i++)
+		counts[i] += other.counts[i];
+	if(!total || (other.minValue < minValue))
+		minValue = other.minValue;
+	if(other.maxValue > maxValue)
+		maxValue = other.maxValue;
+	total += other.total;
+	sum += other.sum;
+}
+
+/**
+ * Value At Percentile
+ * Largest value that percentile percent of the recorded values are at or below, to the histogram's precision
+ *
+ * @param percentile 0 to 100
+ */
+long long LatencyHistogram::valueAtPercentile(double percentile) const {
+	if(!total)
+		return 0;
+	if(percentile <= 0)
+		return minValue;
+
+	unsigned long long target = (unsigned long long)ceil((percentile / 100.0) * total);
+	if(target < 1)
+		target = 1;
+	unsigned long long seen = 0;
+	for(unsigned int i = 0; i < counts.size(); i++) {
+		seen += counts[i];
+		if(seen >= target)
+			return (highestEquivalent(i) < maxValue) ? highestEquivalent(i) : maxValue;
+	}
+	return maxValue;
+}
+
+/**
+ * Write Distribution
+ * Percentile distribution in the text format of HdrHistogram's outputPercentileDistribution() (values in
+ * milliseconds), which its plotter and most latency tooling read. Lines get denser towards the tail
+ *
+ * @param path File to create or overwrite
+ * @return True if the file was written
+ */
+bool LatencyHistogram::writeDistribution(const char* path) const {
+	FILE* f = fopen(path, "w");
+	if(!f) {
+		printf("LatencyHistogram: Could not create %s\n", path);
+		return false;
+	}
+
+	fprintf(f, "%12s %14s %10s %14s\n\n", "Value", "Percentile", "TotalCount", "1/(1-Percentile)");
+	double percentile = 0;
+	while(total) {
+		long long value = valueAtPercentile(percentile);
+		unsigned long long below = 0;
+		for(unsigned int i = 0; (i < counts.size()) && (valueOf(i) <= value); i++)
+			below += counts[i];
+
+		if(below >= total) {
+			fprintf(f, "%12.3f %2.12f %10llu\n", maxValue / 1000.0, 1.0, total);
+			break;
+		}
+		fprintf(f, "%12.3f %2.12f %10llu %14.2f\n", value / 1000.0, percentile / 100.0, below, 1.0 / (1.0 - percentile / 100.0));
+
+		// HISTOGRAM_TICKS steps to halfway to 100%, as many again for the next half and so on
+		double halvings = floor(log(100.0 / (100.0 - percentile)) / log(2.0)) + 1;
+		percentile += 100.0 / (HISTOGRAM_TICKS * pow(2.0, halvings));
+	}
+
+	double variance = 0;
+	for(unsigned int i = 0; i < counts.size(); i++) {
+		if(counts[i]) {
+			double d = (valueOf(i) + highestEquivalent(i)) / 2.0 - mean();
+			variance += d * d * counts[i];
+		}
+	}
+	fprintf(f, "#[Mean    = %12.3f, StdDeviation   = %12.3f]\n", mean() / 1000.0, total ? sqrt(variance / total) / 1000.0 : 0.0);
+	fprintf(f, "#[Max     = %12.3f, Total count    = %12llu]\n", maxValue / 1000.0, total);
+	fprintf(f, "#[Buckets = %12i, SubBuckets     = %12i]\n", HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1, 1 << HISTOGRAM_SUB_BITS);
+
+	fclose(f);
+	return true;
+}
+
+/**
+ * Index Of
+ * Bucket counting value. Below 2^HISTOGRAM_SUB_BITS every value has its own, above that the top
+ * HISTOGRAM_SUB_BITS bits of the value pick one of HISTOGRAM_HALF buckets for its power of two
+ */
+int LatencyHistogram::indexOf(long long value) {
+	if(value < 2 * HISTOGRAM_HALF)
+		return (int)value;
+
+	int shift = 0;
+	while((value >> shift) >= 2 * HISTOGRAM_HALF)
+		shift++;
+	return HISTOGRAM_HALF * shift + (int)(value >> shift);
+}
+
+/**
+ * Value Of
+ * Smallest value counted by bucket index
+ */
+long long LatencyHistogram::valueOf(int index) {
+	if(index < 2 * HISTOGRAM_HALF)
+		return index;
+
+	int shift = index / HISTOGRAM_HALF - 1;
+	return (long long)(index % HISTOGRAM_HALF + HISTOGRAM_HALF) << shift;
+}
+
+/**
+ * Highest Equivalent
+ * Largest value counted by bucket index
+ */
+long long LatencyHistogram::highestEquivalent(int index) {
+	if(index < 2 * HISTOGRAM_HALF)
+		return index;
+
+	int shift = index / HISTOGRAM_HALF - 1;
+	return valueOf(index) + (1LL << shift) - 1;
+}
@@ -0,0 +1,75 @@
+/**
+   ssltests
+   LatencyHistogram.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _latencyhistogram_h_
+#define _latencyhistogram_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <vector>
+
+#define HISTOGRAM_SUB_BITS 8 // 2^8 linear sub buckets per power of two, values are kept to within 1/128 (0.8%)
+#define HISTOGRAM_MAX_BITS 40 // Largest value tracked is 2^40 us (about 12 days), bigger ones are clamped
+#define HISTOGRAM_TICKS 5 // Percentile lines per halving of the distance to 100% in the distribution log
+
+/**
+ * Latency Histogram
+ * HDR style histogram of microsecond latencies: exact below 2^HISTOGRAM_SUB_BITS, then a fixed number of linear
+ * sub buckets per power of two, so the relative error is the same from microseconds to minutes and recording is
+ * a couple of shifts and an increment. Fixed size no matter how many values go in. Not thread safe, give every
+ * thread its own and add() them together at the end.
+ */
+class LatencyHistogram {
+private:
+	std::vector<unsigned long long> counts;
+	unsigned long long total;
+	long long minValue;
+	long long maxValue;
+	double sum;
+
+private:
+	static int indexOf(long long value);
+	static long long valueOf(int index);
+	static long long highestEquivalent(int index);
+
+public:
+	LatencyHistogram();
+
+	void record(long long value);
+	void add(const LatencyHistogram& other);
+	long long valueAtPercentile(double percentile) const;
+	bool writeDistribution(const char* path) const;
+
+	unsigned long long count() const {
+		return total;
+	}
+
+	long long min() const {
+		return total ? minValue : 0;
+	}
+
+	long long max() const {
+		return maxValue;
+	}
+
+	double mean() const {
+		return total ? sum / total : 0;
+	}
+};
+
+#endif
@@ -0,0 +1,496 @@
+/**
+   ssltests
+   LoadGenerator.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "LoadGenerator.h"
+#include "Benchmark.h"
+
+#include <algorithm>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <boost/bind.hpp>
+
+LoadGenerator::LoadGenerator(string h, int p) {
+	host = h;
+	port = p;
+	memset(&addr, 0, sizeof(addr));
+	addrLen = 0;
+	ctx = NULL;
+
+	minVersion = CLIENT_MIN_VERSION;
+	maxVersion = CLIENT_MAX_VERSION;
+	verifyPeer = CLIENT_VERIFY;
+	serverName = "";
+	certFile = "";
+	keyFile = "";
+
+	msgSize = 0;
+	intervalUs = 0;
+	endUs = 0;
+	openLoop = false;
+	histogramLog = "";
+}
+
+LoadGenerator::~LoadGenerator() {
+	if(ctx)
+		SSL_CTX_free(ctx);
+}
+
+/**
+ * Run
+ * Hold the connections open for duration seconds exchanging messages, then print a summary
+ *
+ * @param connections Concurrent connections
+ * @param threads Event loop threads the connections are spread over
+ * @param size Bytes per message
+ * @param rate Messages per second across all connections (0 = each connection sends as soon as its echo is back,
+ * required in open loop mode)
+ * @param duration Seconds to run for
+ * @return True if at least one message made it through
+ */
+bool LoadGenerator::run(int connections, int threads, int size, double rate, int duration) {
+	if(connections < 1 || size < 1 || duration < 1)
+		return false;
+	if(openLoop && (rate <= 0)) {
+		printf("LoadGenerator: Open loop needs a message rate\n");
+		return false;
+	}
+	threads = max(1, min(threads, connections));
+
+	// Resolve once, every connection goes to the same address
+	char portStr[8];
+	sprintf(portStr, "%i", port);
+	struct addrinfo hints, *res = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(host.c_str(), portStr, &hints, &res) != 0 || !res) {
+		printf("LoadGenerator: Could not resolve %s\n", host.c_str());
+		return false;
+	}
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	addrLen = res->ai_addrlen;
+	freeaddrinfo(res);
+
+	if(!createContext())
+		return false;
+
+	msgSize = size;
+	message.assign(size, 'l');
+	intervalUs = (rate > 0) ? (long long)((1000000.0 * connections) / rate) : 0;
+
+	char pace[32];
+	if(rate > 0)
+		sprintf(pace, "%.0f msgs/s", rate);
+	else
+		sprintf(pace, "unpaced");
+	printf("Load: %i connections on %i threads against %s:%i, %i byte messages, %s%s, %i s\n", connections, threads,
+		host.c_str(), port, size, pace, openLoop ? " open loop" : "", duration);
+
+	// Connections are dealt out round robin, paced ones start staggered over one interval. Open loop connections
+	// connect straight away and stagger their schedules instead
+	long long start = nowUs();
+	endUs = start + duration * 1000000LL;
+	vector<Worker> workers(threads);
+	for(int i = 0; i < connections; i++) {
+		Conn c;
+		c.fd = -1;
+		c.ssl = NULL;
+		c.state = CONN_DOWN;
+		c.events = 0;
+		c.dueUs = start + (intervalUs * i) / connections;
+		c.nextUs = openLoop ? start : c.dueUs;
+		c.unsent = 0;
+		c.sent = 0;
+		c.received = 0;
+		workers[i % threads].conns.push_back(c);
+	}
+	for(int t = 0; t < threads; t++) {
+		workers[t].messages = 0;
+		workers[t].handshakes = 0;
+		workers[t].errors = 0;
+		workers[t].connectErrors = 0;
+		workers[t].dropped = 0;
+	}
+
+	double cpu = Benchmark::cpuSeconds();
+	boost::thread_group loops;
+	for(int t = 0; t < threads; t++)
+		loops.create_thread(boost::bind(&LoadGenerator::workerLoop, this, &workers[t]));
+	loops.join_all();
+	cpu = Benchmark::cpuSeconds() - cpu;
+	double secs = (nowUs() - start) / 1000000.0;
+
+	// Merge the workers' results
+	LatencyHistogram lat;
+	unsigned long messages = 0, handshakes = 0, errors = 0, connectErrors = 0, dropped = 0, unanswered = 0;
+	for(int t = 0; t < threads; t++) {
+		lat.add(workers[t].latency);
+		messages += workers[t].messages;
+		handshakes += workers[t].handshakes;
+		errors += workers[t].errors;
+		connectErrors += workers[t].connectErrors;
+		dropped += workers[t].dropped;
+		for(unsigned int i = 0; i < workers[t].conns.size(); i++)
+			unanswered += workers[t].conns[i].pending.size();
+	}
+
+	printf("  %lu messages, %.0f msgs/s, %.2f MB/s each way\n", messages, messages / secs, ((double)messages * size) / secs / (1024 * 1024));
+	printf("  %lu handshakes, %lu connections lost, %lu connect failures\n", handshakes, errors, connectErrors);
+	printf("  %lu messages lost with their connection, %lu still unanswered at the end\n", dropped, unanswered);
+	printf("  client CPU %.2f s (%.0f%% of one core)\n", cpu, (100.0 * cpu) / secs);
+	if(!lat.count())
+		return false;
+
+	printf("  latency%s: avg %.0f us, p50 %lli us, p90 %lli us, p99 %lli us, p99.9 %lli us, max %lli us\n",
+		openLoop ? " from schedule" : "", lat.mean(), lat.valueAtPercentile(50), lat.valueAtPercentile(90),
+		lat.valueAtPercentile(99), lat.valueAtPercentile(99.9), lat.max());
+	if(!histogramLog.empty() && lat.writeDistribution(histogramLog.c_str()))
+		printf("  latency distribution written to %s\n", histogramLog.c_str());
+
+	return true;
+}
+
+/**
+ * Create Context
+ * One client context shared by every connection of the run
+ */
+bool LoadGenerator::createContext() {
+	if(ctx)
+		SSL_CTX_free(ctx);
+	ctx = SSL_CTX_new(tls_client_method());
+	if(!ctx) {
+		printf("LoadGenerator: Could not create the client context\n");
+		return false;
+	}
+
+	if(!tls_set_version_range(ctx, minVersion, maxVersion)) {
+		printf("LoadGenerator: No supported protocol version in the configured range\n");
+		return false;
+	}
+
+	if(verifyPeer) {
+		if(SSL_CTX_load_verify_locations(ctx, CLIENT_CERTFILE, NULL) <= 0) {
+			printf("LoadGenerator: Couldn't load verification cert file\n");
+			return false;
+		}
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	} else {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	}
+
+	if(!certFile.empty()) {
+		SSL_CTX_set_default_passwd_cb(ctx, passwordCallback);
+		if((SSL_CTX_use_certificate_chain_file(ctx, certFile.c_str()) <= 0) ||
+			(SSL_CTX_use_PrivateKey_file(ctx, keyFile.c_str(), SSL_FILETYPE_PEM) <= 0)) {
+			printf("LoadGenerator: Couldn't load client certificate %s\n", certFile.c_str());
+			return false;
+		}
+	}
+
+	if(SSL_CTX_set_cipher_list(ctx, tls_cipher_list(minVersion)) <= 0) {
+		printf("LoadGenerator: Could not select any ciphers\n");
+		return false;
+	}
+
+	// Writes resume from wherever the socket buffer filled up
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	return true;
+}
+
+/**
+ * Worker Loop
+ * Event loop for one thread's connections until the run ends
+ */
+void LoadGenerator::workerLoop(Worker* w) {
+	vector<struct pollfd> fds;
+	vector<Conn*> polled;
+
+	long long now = nowUs();
+	while(now < endUs) {
+		// Sleep until a socket is ready or the next paced message or reconnect is due
+		long long wake = min(now + LOAD_POLL_MS * 1000LL, endUs);
+		fds.clear();
+		polled.clear();
+		for(unsigned int i = 0; i < w->conns.size(); i++) {
+			Conn* c = &w->conns[i];
+			if(timed(c))
+				wake = min(wake, c->nextUs);
+			if(c->state == CONN_DOWN)
+				continue;
+			struct pollfd p;
+			p.fd = c->fd;
+			p.events = c->events;
+			p.revents = 0;
+			fds.push_back(p);
+			polled.push_back(c);
+		}
+
+		int timeoutMs = (wake > now) ? (int)((wake - now + 999) / 1000) : 0;
+		if((poll(fds.empty() ? NULL : &fds[0], fds.size(), timeoutMs) < 0) && (errno != EINTR))
+			break;
+
+		now = nowUs();
+		for(unsigned int i = 0; i < fds.size(); i++) {
+			if(fds[i].revents)
+				service(w, polled[i], now);
+		}
+		for(unsigned int i = 0; i < w->conns.size(); i++) {
+			Conn* c = &w->conns[i];
+			if(timed(c) && (now >= c->nextUs))
+				service(w, c, now);
+		}
+	}
+
+	for(unsigned int i = 0; i < w->conns.size(); i++)
+		closeConnection(&w->conns[i]);
+}
+
+/**
+ * Open Connection
+ * Start a non-blocking connect, the handshake follows once the socket is writable
+ */
+bool LoadGenerator::openConnection(Conn* c) {
+	int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if(fd < 0)
+		return false;
+
+	int one = 1;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if((connect(fd, (struct sockaddr*)&addr, addrLen) < 0) && (errno != EINPROGRESS)) {
+		close(fd);
+		return false;
+	}
+
+	SSL* ssl = SSL_new(ctx);
+	if(!ssl) {
+		close(fd);
+		return false;
+	}
+	SSL_set_fd(ssl, fd);
+	SSL_set_connect_state(ssl);
+	if(!serverName.empty()) {
+		SSL_set_tlsext_host_name(ssl, serverName.c_str());
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		if(verifyPeer)
+			X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), serverName.c_str(), 0);
+#endif
+	}
+
+	c->fd = fd;
+	c->ssl = ssl;
+	c->state = CONN_CONNECTING;
+	c->events = POLLOUT;
+	c->unsent = 0;
+	c->sent = 0;
+	c->received = 0;
+	return true;
+}
+
+void LoadGenerator::closeConnection(Conn* c) {
+	if(c->ssl) {
+		if(c->state >= CONN_IDLE)
+			SSL_shutdown(c->ssl);
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+	}
+	if(c->fd >= 0) {
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+/**
+ * Fail Connection
+ * Count a connection that broke, drop it and schedule a reconnect
+ */
+void LoadGenerator::failConnection(Worker* w, Conn* c, long long now) {
+	if(c->state >= CONN_IDLE)
+		w->errors++;
+	else
+		w->connectErrors++;
+	w->dropped += c->pending.size();
+	c->pending.clear();
+	ERR_clear_error();
+	closeConnection(c);
+	c->state = CONN_DOWN;
+	c->nextUs = now + LOAD_RETRY_MS * 1000LL;
+}
+
+/**
+ * Service
+ * Move a connection along after its socket became ready or its timer expired
+ */
+void LoadGenerator::service(Worker* w, Conn* c, long long now) {
+	if(c->state == CONN_DOWN) {
+		if(!openConnection(c)) {
+			w->connectErrors++;
+			c->nextUs = now + LOAD_RETRY_MS * 1000LL;
+		}
+		return;
+	}
+
+	if(c->state == CONN_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if((getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err != 0)) {
+			failConnection(w, c, now);
+			return;
+		}
+		c->state = CONN_HANDSHAKING;
+	}
+
+	if(c->state == CONN_HANDSHAKING) {
+		int r = SSL_connect(c->ssl);
+		if(r != 1) {
+			c->events = wantEvents(c->ssl, r);
+			if(!c->events)
+				failConnection(w, c, now);
+			return;
+		}
+		w->handshakes++;
+		c->state = CONN_IDLE;
+		if(intervalUs == 0)
+			c->nextUs = now;
+	}
+
+	issue(c, now);
+	if(!pump(w, c, now))
+		failConnection(w, c, now);
+}
+
+/**
+ * Issue
+ * Queue the messages that are due on an established connection. Closed loop that is the next message once the
+ * last one is back and nextUs has come. Open loop it is every scheduled time up to now, stamped with the time it
+ * was scheduled for, including any that fell due while the connection was down or handshaking
+ */
+void LoadGenerator::issue(Conn* c, long long now) {
+	if(openLoop) {
+		while((c->dueUs <= now) && (c->dueUs < endUs)) {
+			c->pending.push_back(c->dueUs);
+			c->unsent += msgSize;
+			c->dueUs += intervalUs;
+		}
+		c->nextUs = c->dueUs;
+	} else if(c->pending.empty() && (now >= c->nextUs)) {
+		c->pending.push_back(now);
+		c->unsent += msgSize;
+	}
+	c->state = c->pending.empty() ? CONN_IDLE : CONN_BUSY;
+}
+
+/**
+ * Timed
+ * Whether the connection has a timer at nextUs for workerLoop() to wake up for
+ */
+bool LoadGenerator::timed(Conn* c) {
+	return (c->state == CONN_DOWN) || (c->state == CONN_IDLE) || (openLoop && (c->state == CONN_BUSY));
+}
+
+/**
+ * Pump
+ * Write what is left of the current message and drain the echo until the socket would block
+ *
+ * @return False if the connection broke
+ */
+bool LoadGenerator::pump(Worker* w, Conn* c, long long now) {
+	short events = POLLIN;
+
+	// Messages are identical, so the write position within one is all that matters
+	while(c->unsent > 0) {
+		int offset = (int)(c->sent % msgSize);
+		int r = SSL_write(c->ssl, &message[offset], (int)min((long long)(msgSize - offset), c->unsent));
+		if(r > 0) {
+			c->sent += r;
+			c->unsent -= r;
+			continue;
+		}
+		short want = wantEvents(c->ssl, r);
+		if(!want)
+			return false;
+		events |= want;
+		break;
+	}
+
+	char buf[LOAD_READ_SIZE];
+	bool completed = false;
+	while(true) {
+		int r = SSL_read(c->ssl, buf, sizeof(buf));
+		if(r > 0) {
+			c->received += r;
+			// The echo comes back in order, every msgSize bytes finish the oldest message
+			while(!c->pending.empty() && (c->received >= msgSize)) {
+				w->latency.record(now - c->pending.front());
+				w->messages++;
+				c->pending.pop_front();
+				c->received -= msgSize;
+				completed = true;
+			}
+			continue;
+		}
+		short want = wantEvents(c->ssl, r);
+		if(!want)
+			return false;
+		events |= want;
+		break;
+	}
+
+	// Whole echo back, paced closed loop connections keep to their schedule and catch up if they fell behind
+	if(completed && !openLoop)
+		c->nextUs = intervalUs ? max(c->nextUs + intervalUs, now) : now;
+	c->state = c->pending.empty() ? CONN_IDLE : CONN_BUSY;
+
+	c->events = events;
+	return true;
+}
+
+/**
+ * Want Events
+ * poll() events an SSL call that returned r is waiting for, 0 if it failed for good
+ */
+short LoadGenerator::wantEvents(SSL* ssl, int r) {
+	switch(SSL_get_error(ssl, r)) {
+		case SSL_ERROR_WANT_READ:
+			return POLLIN;
+		case SSL_ERROR_WANT_WRITE:
+			return POLLOUT;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Now Us
+ * Monotonic clock in microseconds, schedules mustn't jump with the wall clock
+ */
+long long LoadGenerator::nowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
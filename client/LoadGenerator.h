@@ -0,0 +1,163 @@
+/**
+   ssltests
+   LoadGenerator.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _loadgenerator_h_
+#define _loadgenerator_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <sys/socket.h>
+
+#include <boost/thread.hpp>
+
+#include <openssl/ssl.h>
+
+#include "SSLClient.h"
+#include "LatencyHistogram.h"
+
+#define LOAD_POLL_MS 100 // Longest an event loop sleeps in poll() before checking the clock
+#define LOAD_RETRY_MS 1000 // Wait before reconnecting after a connection failed
+#define LOAD_READ_SIZE 16384 // Bytes drained per SSL_read() (one full TLS record)
+
+using namespace std;
+
+/**
+ * Load Generator
+ * Holds many concurrent connections open against the echo server from a few threads. Each thread runs an event
+ * loop over its share of the connections: non-blocking sockets and SSL objects driven from poll(), so a thread
+ * serves hundreds of connections instead of one. Every connection sends a message, waits for the whole echo and
+ * records the round trip, then sends the next one, either straight away or paced so all connections together stay
+ * at the configured rate. Connections that fail are counted and reopened.
+ *
+ * That is a closed loop: a slow echo holds back the next message, so the queueing it causes never shows up in
+ * the numbers (coordinated omission). In open loop mode every connection instead issues messages on a fixed
+ * schedule whether or not earlier ones came back, pipelining them on the connection (the echo is in order), and
+ * each latency is measured from when its message was due rather than when it got written. A stall then costs
+ * every message scheduled behind it, as it would real clients.
+ */
+class LoadGenerator {
+private:
+	enum ConnState {
+		CONN_DOWN, // Waiting to reconnect at nextUs
+		CONN_CONNECTING, // TCP connect in progress
+		CONN_HANDSHAKING,
+		CONN_IDLE, // Established, no message outstanding. Next one goes out at nextUs
+		CONN_BUSY // Messages outstanding
+	};
+
+	struct Conn {
+		int fd;
+		SSL* ssl;
+		ConnState state;
+		short events; // poll() interest
+		long long nextUs; // Reconnect or next message (closed loop), next timer wakeup (open loop)
+		long long dueUs; // Open loop: when the next message is scheduled, kept across reconnects
+		deque<long long> pending; // Start time of each message issued and not fully echoed, oldest first
+		long long unsent; // Bytes issued but not written yet
+		long long sent; // Bytes written since connecting
+		long long received; // Bytes of the oldest pending message echoed so far
+	};
+
+	struct Worker {
+		vector<Conn> conns;
+		LatencyHistogram latency; // Round trip of each message, us
+		unsigned long messages;
+		unsigned long handshakes;
+		unsigned long errors; // Connections lost after the handshake
+		unsigned long connectErrors; // Connections that never got through the handshake
+		unsigned long dropped; // Messages outstanding on connections that broke
+	};
+
+	string host;
+	int port;
+	struct sockaddr_storage addr;
+	socklen_t addrLen;
+	SSL_CTX* ctx;
+
+	// Connection settings
+	int minVersion;
+	int maxVersion;
+	bool verifyPeer;
+	string serverName;
+	string certFile;
+	string keyFile;
+
+	// Run settings
+	int msgSize;
+	long long intervalUs; // Between messages on one connection, 0 = as fast as echoes come back
+	long long endUs;
+	vector<char> message;
+	bool openLoop;
+	string histogramLog; // Latency distribution written here after the run. Empty for none
+
+private:
+	bool createContext();
+	void workerLoop(Worker* w);
+	bool openConnection(Conn* c);
+	void closeConnection(Conn* c);
+	void failConnection(Worker* w, Conn* c, long long now);
+	void service(Worker* w, Conn* c, long long now);
+	void issue(Conn* c, long long now);
+	bool timed(Conn* c);
+	bool pump(Worker* w, Conn* c, long long now);
+
+	static short wantEvents(SSL* ssl, int r);
+	static long long nowUs();
+
+	static int passwordCallback(char *buf, int size, int rwflag, void *password) {
+		strncpy(buf, (char *)(CLIENT_KEYPWD), size);
+		buf[size - 1] = '\0';
+		return(strlen(buf));
+	}
+
+public:
+	LoadGenerator(string h, int p);
+	~LoadGenerator();
+
+	bool run(int connections, int threads, int size, double rate, int duration);
+
+	void setVersionRange(int minV, int maxV) {
+		minVersion = minV;
+		maxVersion = maxV;
+	}
+
+	void setVerify(bool enable, string name) {
+		verifyPeer = enable;
+		serverName = name;
+	}
+
+	void setClientCert(string cert, string key) {
+		certFile = cert;
+		keyFile = key;
+	}
+
+	// Needs a rate, see run()
+	void setOpenLoop(bool enable) {
+		openLoop = enable;
+	}
+
+	void setHistogramLog(string path) {
+		histogramLog = path;
+	}
+};
+
+#endif
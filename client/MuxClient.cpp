@@ -0,0 +1,241 @@
+/**
+   ssltests
+   MuxClient.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "MuxClient.h"
+
+#include <errno.h>
+#include <poll.h>
+
+MuxClient::MuxClient(SSLClient* c) {
+	cl = c;
+	nextId = 1;
+	failed = false;
+
+	// A blocked writeData() would read the socket itself and swallow frames, let out hold what doesn't fit
+	cl->setSendQueue(CLIENT_SEND_QUEUE_MAX, CLIENT_SEND_FAIL);
+}
+
+/**
+ * Open Stream
+ * Allocate the next stream id. The server learns of it from its first frame
+ *
+ * @return The stream id, 0 once ids have run out
+ */
+unsigned int MuxClient::openStream() {
+	if(nextId > 0x7fffffff)
+		return 0;
+
+	Stream s;
+	s.sendWindow = MUX_INITIAL_WINDOW;
+	s.credit = 0;
+	s.finSent = false;
+	s.finReceived = false;
+	s.reset = false;
+	streams[nextId] = s;
+	nextId += 2;
+	return nextId - 2;
+}
+
+/**
+ * Write
+ * Queue as much of data on stream id as its window allows, in frames of at most MUX_MAX_PAYLOAD. fin is sent
+ * after the data only if all of it was taken
+ *
+ * @return Bytes taken, -1 if the stream is unknown, finished or reset
+ */
+int MuxClient::write(unsigned int id, const char* data, unsigned int len, bool fin) {
+	StreamMap::iterator it = streams.find(id);
+	if((it == streams.end()) || it->second.finSent || it->second.reset || failed)
+		return -1;
+	Stream& s = it->second;
+
+	unsigned int taken = 0;
+	while((taken < len) && (s.sendWindow > 0)) {
+		unsigned int n = min(len - taken, min(s.sendWindow, (unsigned int)MUX_MAX_PAYLOAD));
+		mux_append_frame(out, id, (fin && (taken + n == len)) ? MUX_FLAG_FIN : 0, data + taken, n);
+		s.sendWindow -= n;
+		taken += n;
+	}
+	if(fin && (taken == len)) {
+		// The FIN rode on the last data frame, unless there was no data
+		if(len == 0)
+			mux_append_frame(out, id, MUX_FLAG_FIN, NULL, 0);
+		s.finSent = true;
+	}
+
+	return taken;
+}
+
+/**
+ * Read
+ * Take up to len received bytes of stream id. The server is credited in one WINDOW frame once half a window has
+ * been read
+ *
+ * @return Bytes copied to buf, 0 if none are waiting, -1 if the stream is unknown or was reset
+ */
+int MuxClient::read(unsigned int id, char* buf, unsigned int len) {
+	StreamMap::iterator it = streams.find(id);
+	if((it == streams.end()) || it->second.reset)
+		return -1;
+	Stream& s = it->second;
+
+	unsigned int n = min(len, (unsigned int)s.in.size());
+	s.in.copy(buf, n);
+	s.in.erase(0, n);
+	s.credit += n;
+	if(!s.finReceived && (s.credit >= MUX_INITIAL_WINDOW / 2)) {
+		mux_append_frame(out, id, MUX_FLAG_WINDOW, NULL, s.credit);
+		s.credit = 0;
+	}
+
+	return n;
+}
+
+/**
+ * Finished
+ * Whether the server ended stream id (FIN or reset) and everything it sent has been read
+ */
+bool MuxClient::finished(unsigned int id) {
+	StreamMap::iterator it = streams.find(id);
+	if(it == streams.end())
+		return true;
+	return it->second.reset || (it->second.finReceived && it->second.in.empty());
+}
+
+/**
+ * Close Stream
+ * Forget stream id, resetting it on the server unless both sides already finished it
+ */
+void MuxClient::closeStream(unsigned int id) {
+	StreamMap::iterator it = streams.find(id);
+	if(it == streams.end())
+		return;
+
+	if(!it->second.reset && !(it->second.finSent && it->second.finReceived))
+		mux_append_frame(out, id, MUX_FLAG_RESET, NULL, 0);
+	streams.erase(it);
+}
+
+/**
+ * Service
+ * Hand queued frames to the connection, wait up to timeoutMs for the socket, then read everything available and
+ * sort it onto its streams
+ *
+ * @return False once the connection failed or the server broke the protocol
+ */
+bool MuxClient::service(int timeoutMs) {
+	SSL* ssl = cl->getSSL();
+	if(failed || !ssl || !cl->isClientRunning())
+		return false;
+
+	if(!out.empty()) {
+		int r = cl->writeData(&out[0], out.size());
+		if(r < 0) {
+			failed = true;
+			return false;
+		}
+		if(r > 0)
+			out.clear();
+	}
+
+	struct pollfd pfd = { cl->getFd(), POLLIN, 0 };
+	if(cl->getQueuedBytes() > 0)
+		pfd.events |= POLLOUT;
+	if(SSL_pending(ssl) > 0)
+		timeoutMs = 0;
+	if((poll(&pfd, 1, timeoutMs) < 0) && (errno != EINTR))
+		return false;
+	if((cl->getQueuedBytes() > 0) && (cl->flush() < 0)) {
+		failed = true;
+		return false;
+	}
+
+	char buf[16384];
+	while(true) {
+		int r = SSL_read(ssl, buf, sizeof(buf));
+		if(r > 0) {
+			in.insert(in.end(), buf, buf + r);
+			continue;
+		}
+		int err = SSL_get_error(ssl, r);
+		if((err == SSL_ERROR_WANT_READ) || (err == SSL_ERROR_WANT_WRITE))
+			break;
+		printf("MuxClient: Server closed the connection\n");
+		failed = true;
+		return false;
+	}
+
+	size_t pos = 0;
+	while(in.size() - pos >= MUX_HEADER_SIZE) {
+		MuxFrameHeader h;
+		mux_decode_header((const unsigned char*)&in[pos], &h);
+		unsigned int payload = (h.flags & MUX_FLAG_WINDOW) ? 0 : h.length;
+		if(payload > MUX_MAX_PAYLOAD) {
+			printf("MuxClient: Frame of %u bytes on stream %u is over the limit\n", payload, h.stream);
+			failed = true;
+			return false;
+		}
+		if(in.size() - pos < MUX_HEADER_SIZE + payload)
+			break;
+		if(!frame(h, payload ? &in[pos + MUX_HEADER_SIZE] : NULL)) {
+			failed = true;
+			return false;
+		}
+		pos += MUX_HEADER_SIZE + payload;
+	}
+	in.erase(in.begin(), in.begin() + pos);
+
+	return true;
+}
+
+/**
+ * Frame
+ * Apply one frame from the server. Frames for streams already closed are dropped
+ *
+ * @return False if the server overran the stream's window or credited more than was sent
+ */
+bool MuxClient::frame(const MuxFrameHeader& h, const char* payload) {
+	StreamMap::iterator it = streams.find(h.stream);
+	if(it == streams.end())
+		return true;
+	Stream& s = it->second;
+
+	if(h.flags & MUX_FLAG_RESET) {
+		s.reset = true;
+		return true;
+	}
+	if(h.flags & MUX_FLAG_WINDOW) {
+		// Credit only returns bytes sent, it can't open the window past where it started
+		if(h.length > MUX_INITIAL_WINDOW - s.sendWindow) {
+			printf("MuxClient: Server credited stream %u past its window\n", h.stream);
+			return false;
+		}
+		s.sendWindow += h.length;
+		return true;
+	}
+
+	if(s.in.size() + s.credit + h.length > MUX_INITIAL_WINDOW) {
+		printf("MuxClient: Server overran the window of stream %u\n", h.stream);
+		return false;
+	}
+	if(payload)
+		s.in.append(payload, h.length);
+	if(h.flags & MUX_FLAG_FIN)
+		s.finReceived = true;
+	return true;
+}
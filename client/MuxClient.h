@@ -0,0 +1,83 @@
+/**
+   ssltests
+   MuxClient.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _muxclient_h_
+#define _muxclient_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+#include "SSLClient.h"
+#include "../common/StreamFrame.h"
+
+using namespace std;
+
+/**
+ * Mux Client
+ * Many independent request streams over one connected SSLClient that negotiated MUX_ALPN (see StreamFrame.h).
+ * write() and read() never block: write() takes what the stream's window allows and queues it, read() hands out
+ * what has arrived. Nothing moves until service(), which sends everything queued since the last call in as few
+ * TLS records as it fits in and reads and demultiplexes whatever the server sent. Not thread safe, one thread
+ * drives all streams.
+ */
+class MuxClient {
+private:
+	struct Stream {
+		string in; // Received, not read yet
+		unsigned int sendWindow; // Bytes the server still accepts on this stream
+		unsigned int credit; // Bytes read but not credited back to the server yet
+		bool finSent;
+		bool finReceived;
+		bool reset; // The server refused or aborted the stream
+	};
+	typedef boost::unordered_map<unsigned int, Stream> StreamMap;
+
+	SSLClient* cl; // Not owned
+	StreamMap streams;
+	unsigned int nextId;
+	vector<char> out; // Frames not handed to cl yet
+	vector<char> in; // Frames still arriving
+	bool failed;
+
+private:
+	bool frame(const MuxFrameHeader& h, const char* payload);
+
+public:
+	MuxClient(SSLClient* c);
+
+	unsigned int openStream();
+	int write(unsigned int id, const char* data, unsigned int len, bool fin);
+	int read(unsigned int id, char* buf, unsigned int len);
+	bool finished(unsigned int id);
+	void closeStream(unsigned int id);
+	bool service(int timeoutMs);
+
+	unsigned int openStreams() {
+		return streams.size();
+	}
+
+	bool isFailed() {
+		return failed;
+	}
+};
+
+#endif
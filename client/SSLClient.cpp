@@ -18,6 +18,25 @@
 
 #include "SSLClient.h"
 
+#include <errno.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+// OpenSSL 1.0's connect BIO only takes IPv4 addresses
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+#define RESOLVE_FAMILY AF_UNSPEC
+#else
+#define RESOLVE_FAMILY AF_INET
+#endif
+
 /**
  * Client Constructor
  * Initializes default values for private members
@@ -27,16 +46,55 @@ SSLClient::SSLClient() {
 	host = "";
 	port = 443;
 	clientRunning = false;
+	verbose = true;
+	ktls = false;
+	verifyPeer = CLIENT_VERIFY;
+	serverName = "";
+	verifyCache = NULL;
+	verifyUs = 0;
+	verifyCached = false;
+	minVersion = CLIENT_MIN_VERSION;
+	maxVersion = CLIENT_MAX_VERSION;
+	certFile = "";
+	keyFile = "";
+	ciphers = "";
+	alpn = "";
+	sharedContext = NULL;
+	context = NULL;
+	clientCTX = NULL;
 	clientBIO = NULL;
 	ssl = NULL;
+	session = NULL;
+	earlyIdempotent = false;
+	earlySent = false;
+	earlyPending = false;
+	sendHead = 0;
+	maxQueued = CLIENT_SEND_QUEUE_MAX;
+	sendPolicy = CLIENT_SEND_BLOCK;
+	sendRefused = false;
+	drainCallback = NULL;
+	drainArg = NULL;
+	connectTimeoutMs = CLIENT_CONNECT_TIMEOUT;
+	handshakeTimeoutMs = CLIENT_HANDSHAKE_TIMEOUT;
 }
 
 /**
  * Client Destructor
  */
 SSLClient::~SSLClient() {
-	if(ssl)
+	if(ssl) {
 		disconnect();
+	} else {
+		// Never got as far as an SSL structure owning the BIO
+		if(clientBIO)
+			BIO_free_all(clientBIO);
+		if(context)
+			context->release();
+	}
+	if(session)
+		SSL_SESSION_free(session);
+	if(sharedContext)
+		sharedContext->release();
 }
 
 /**
@@ -51,8 +109,15 @@ bool SSLClient::initSocket(string h, int p) {
     // Setup the address structure
 	host = h;
 	port = p;
-	char constr[32];
-	sprintf(constr, "%s:%i", h.c_str(), port);
+
+	// Left to BIO_do_connect(), the lookup would block for as long as the resolver likes, before any deadline applies
+	string addr;
+	if(!resolveHost(h, connectTimeoutMs, addr)) {
+		printf("SSLClient: Could not resolve %s within %i ms\n", h.c_str(), connectTimeoutMs);
+		return false;
+	}
+	char constr[64];
+	snprintf(constr, sizeof(constr), "%s:%i", addr.c_str(), port);
 
 	// Attempt to init SSL
 	if(!initSSL()) {
@@ -74,95 +139,487 @@ bool SSLClient::initSocket(string h, int p) {
 }
 
 /**
- * Init SSL
- * Initialize the SSL Method and client context as well as load the appropriate certificates and cipher suites
+ * Resolve Host
+ * Look up the numeric address of a host name without waiting more than timeoutMs. getaddrinfo() has no timeout of
+ * its own, so names are looked up on a detached thread that is left to finish by itself if it runs over
  *
- * @return True if successful, false if otherwise
+ * @param name Host name or numeric address
+ * @param timeoutMs Longest wait for the lookup
+ * @param addr Set to the address in the form BIO_new_connect() takes (IPv6 in brackets)
+ * @return True if resolved in time, false otherwise
  */
-bool SSLClient::initSSL() {
-	// Create a CTX structure with a method indicating that we only understand TLSv1
-	sslMethod = TLSv1_client_method();
-	clientCTX = SSL_CTX_new(sslMethod);
-	if(!clientCTX) {
-		printf("SSLClient: Could not create clientCTX\n");
-		return false;
+bool SSLClient::resolveHost(const string& name, int timeoutMs, string& addr) {
+	// Numeric addresses need no lookup
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = RESOLVE_FAMILY;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST;
+	struct addrinfo* res = NULL;
+	if(getaddrinfo(name.c_str(), NULL, &hints, &res) == 0) {
+		addr = numericAddress(res);
+		freeaddrinfo(res);
+		return !addr.empty();
 	}
 
-	// Load the trusted certificate into the clientCTX
-	if(SSL_CTX_load_verify_locations(clientCTX, CLIENT_CERTFILE, NULL) <= 0) {
-		printf("SSLClient: Couldn't load verification cert file\n");
+	boost::shared_ptr<HostLookup> lookup(new HostLookup());
+	lookup->name = name;
+	lookup->done = false;
+	boost::thread lookupThread(boost::bind(&SSLClient::lookupHost, lookup));
+	lookupThread.detach();
+
+	boost::system_time until = boost::get_system_time() + boost::posix_time::milliseconds(timeoutMs);
+	boost::unique_lock<boost::mutex> lock(lookup->mutex);
+	while(!lookup->done) {
+		if(!lookup->doneCond.timed_wait(lock, until))
+			break;
+	}
+	if(!lookup->done)
 		return false;
+
+	addr = lookup->addr;
+	return !addr.empty();
+}
+
+/**
+ * Lookup Host
+ * Body of the thread started by resolveHost(). Holds its own reference to the lookup, so the caller may stop waiting
+ *
+ * @param lookup Name to resolve, and where to leave the result
+ */
+void SSLClient::lookupHost(boost::shared_ptr<HostLookup> lookup) {
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = RESOLVE_FAMILY;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo* res = NULL;
+	string addr = "";
+	if(getaddrinfo(lookup->name.c_str(), NULL, &hints, &res) == 0) {
+		addr = numericAddress(res);
+		freeaddrinfo(res);
 	}
 
-	// We won't verify the server against a CA
-	SSL_CTX_set_verify(clientCTX, SSL_VERIFY_NONE, NULL);
+	boost::lock_guard<boost::mutex> lock(lookup->mutex);
+	lookup->addr = addr;
+	lookup->done = true;
+	lookup->doneCond.notify_all();
+}
 
-	// Enable all cipher suites
-	if(SSL_CTX_set_cipher_list(clientCTX, "ALL") <= 0) {
-		printf("Could not select any ciphers\n");
-		return false;
+/**
+ * Numeric Address
+ * Format a getaddrinfo() result for BIO_new_connect(). The BIO only gets the one address, so IPv4 is preferred when
+ * there is one, as the server listens on IPv4 only
+ *
+ * @param ai Lookup results
+ * @return Address string, IPv6 in brackets. Empty if it could not be formatted
+ */
+string SSLClient::numericAddress(const struct addrinfo* ai) {
+	for(const struct addrinfo* a = ai; a != NULL; a = a->ai_next) {
+		if(a->ai_family == AF_INET) {
+			ai = a;
+			break;
+		}
+	}
+
+	char buf[INET6_ADDRSTRLEN];
+	if(ai->ai_family == AF_INET6) {
+		if(!inet_ntop(AF_INET6, &((struct sockaddr_in6*)ai->ai_addr)->sin6_addr, buf, sizeof(buf)))
+			return "";
+		return string("[") + buf + "]";
+	}
+	if(!inet_ntop(AF_INET, &((struct sockaddr_in*)ai->ai_addr)->sin_addr, buf, sizeof(buf)))
+		return "";
+	return buf;
+}
+
+/**
+ * Init SSL
+ * Take a reference to the shared context, or build a context of the client's own from its settings (certificates,
+ * versions, verification, ciphers)
+ *
+ * @return True if successful, false if otherwise
+ */
+bool SSLClient::initSSL() {
+	// Left over from an initSocket() that failed later on
+	if(context)
+		context->release();
+	context = NULL;
+	clientCTX = NULL;
+
+	if(sharedContext) {
+		sharedContext->retain();
+		context = sharedContext;
+		verifyPeer = context->isVerifyPeer();
+	} else {
+		context = new ClientContext();
+		context->setVerify(verifyPeer, verifyCache);
+		context->setVersionRange(minVersion, maxVersion);
+		context->setClientCert(certFile, keyFile);
+		context->setCiphers(ciphers);
+		context->setKtls(ktls);
+		// Nothing would be left to resume, the context goes with this connection
+		context->setSessionStore(false);
+		if(!context->init())
+			return false;
 	}
+	clientCTX = context->getCTX();
 
 	return true;
 }
 
+/**
+ * Set Context
+ * Share c with other clients instead of building a context per connection. Takes its own reference, the caller
+ * keeps (and eventually releases) theirs
+ */
+void SSLClient::setContext(ClientContext* c) {
+	if(c)
+		c->retain();
+	if(sharedContext)
+		sharedContext->release();
+	sharedContext = c;
+}
+
 /**
  * Connect
- * Attempt to connect to the target host. Do NOT call if initSocket() failed
+ * Attempt to connect to the target host. Do NOT call if initSocket() failed. Waits in poll() for the socket
+ * instead of spinning, and gives up once the connect or handshake deadline (see setTimeouts()) passes
  *
  * @return True if succeeded
  */
 bool SSLClient::attemptConnect() {
-	// Attempt to connect to the server
-	bool con = (BIO_do_connect(clientBIO) > 0) ? true : false;
-	printf("SSLClient: Attempting to connect to %s:%i...\n", host.c_str(), port);
-
-	// Because it's a nonblocking BIO, keep retrying the connect until indicated otherwise
-	while(!con && BIO_should_retry(clientBIO)) {
-		if(BIO_do_connect(clientBIO) > 0) {
-			con = true;
-			break;
+	if(!startConnect())
+		return false;
+
+	while(true) {
+		int events = continueConnect();
+		if(events == 0)
+			return true;
+		if(events < 0)
+			return false;
+
+		long remainingMs = (long)((deadline - boost::posix_time::microsec_clock::universal_time()).total_milliseconds());
+		if(remainingMs <= 0) {
+			printf("SSLClient: %s to %s:%i timed out\n", ssl ? "Handshake" : "Connect", host.c_str(), port);
+			return false;
+		}
+		struct pollfd pfd = { getFd(), (short)events, 0 };
+		if((poll(&pfd, 1, (int)remainingMs) < 0) && (errno != EINTR)) {
+			printf("SSLClient: poll() failed while connecting\n");
+			return false;
 		}
 	}
-	if(!con) {
-		printf("SSLClient: Could not connect to remote host\n");
-		SSL_CTX_free(clientCTX);
+}
+
+/**
+ * Start Connect
+ * Begin a non-blocking connect to the host given to initSocket(). Drive it with continueConnect() whenever the
+ * socket is ready for the events it asks for; attemptConnect() does exactly that for one client, a caller with
+ * many clients can poll all of their sockets from one loop
+ *
+ * @return False if the connect could not be started
+ */
+bool SSLClient::startConnect() {
+	if(!clientBIO || !clientCTX)
 		return false;
+	if(verbose)
+		printf("SSLClient: Attempting to connect to %s:%i...\n", host.c_str(), port);
+
+	deadline = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(connectTimeoutMs);
+	earlySent = false;
+	earlyPending = !earlyData.empty();
+	return true;
+}
+
+/**
+ * Continue Connect
+ * Take the connect and then the handshake as far as they go without blocking
+ *
+ * @return 0 once the handshake is complete, the poll() events (POLLIN/POLLOUT) to wait for before calling again,
+ * or -1 if the connect or handshake failed
+ */
+int SSLClient::continueConnect() {
+	// TCP connect. The first call creates the socket, later ones check on it
+	if(!ssl) {
+		if(BIO_do_connect(clientBIO) <= 0) {
+			if(BIO_should_retry(clientBIO))
+				return POLLOUT;
+			printf("SSLClient: Could not connect to remote host\n");
+			return -1;
+		}
+		if(!createSSL())
+			return -1;
+		deadline = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(handshakeTimeoutMs);
+	}
+
+	// Send a queued idempotent request in the first flight if the session allows it (see setEarlyData())
+	if(earlyPending) {
+		int r = writeEarlyData();
+		if(r < 0) {
+			printf("SSLClient: Sending early data failed\n");
+			return -1;
+		}
+		if(r > 0)
+			return r;
+		earlyPending = false;
+	}
+
+	// SSL_connect: Perform SSL handshake
+	int r = SSL_connect(ssl);
+	if(r != 1) {
+		switch(SSL_get_error(ssl, r)) {
+			case SSL_ERROR_WANT_READ:
+				return POLLIN;
+			case SSL_ERROR_WANT_WRITE:
+				return POLLOUT;
+			default:
+				break;
+		}
+
+		long vr = SSL_get_verify_result(ssl);
+		if(verifyPeer && (vr != X509_V_OK))
+			printf("SSLClient: SSL_connect failed, server certificate not trusted: %s\n", X509_verify_cert_error_string(vr));
+		else
+			printf("SSLClient: SSL_connect failed\n");
+		return -1;
 	}
+	clientRunning = true;
+
+	if(verbose)
+		printf("SSLClient: Connection was successful! (%s, %s%s%s)\n", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+			SSL_session_reused(ssl) ? ", resumed" : "", earlyDataAccepted() ? ", early data accepted" : "");
+	if(verbose && verifyPeer && !SSL_session_reused(ssl))
+		printf("SSLClient: Server certificate verified in %li us%s\n", verifyUs, verifyCached ? " (cached)" : "");
+
+	// The server didn't take the early data (or it was never sent), deliver the request normally
+	if(!earlyData.empty() && !earlyDataAccepted())
+		writeData(&earlyData[0], earlyData.size());
+	earlyData.clear();
+
+	return 0;
+}
+
+/**
+ * Connect Timed Out
+ * For callers driving continueConnect() themselves
+ *
+ * @return True if the current phase (TCP connect or handshake) has run past its deadline
+ */
+bool SSLClient::connectTimedOut() {
+	return boost::posix_time::microsec_clock::universal_time() >= deadline;
+}
+
+/**
+ * Get Fd
+ * @return The socket, -1 before the first continueConnect()
+ */
+int SSLClient::getFd() {
+	int fd = -1;
+	if(!clientBIO || (BIO_get_fd(clientBIO, &fd) < 0))
+		return -1;
+	return fd;
+}
+
+/**
+ * Create SSL
+ * Set up the SSL structure on the freshly connected socket
+ *
+ * @return False if it couldn't be created
+ */
+bool SSLClient::createSSL() {
+	// Handshake flights and short requests shouldn't sit behind Nagle waiting for a delayed ACK
+	int one = 1, fd = getFd();
+	if(fd >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
 
 	// Create a new SSL structure for the client based on the context
 	ssl = SSL_new(clientCTX);
 	if(!ssl) {
 		printf("SSLClient: Couldn't create a new SSL structure\n");
-		BIO_free(clientBIO);
-		SSL_CTX_free(clientCTX);
 		return false;
 	}
 
 	SSL_set_connect_state(ssl);
 	SSL_set_bio(ssl, clientBIO, clientBIO);
-	
-	// SSL_connect: Perform SSL handshake
-	// Non-blocking: Retry the connect call as long as we are allowed to (BIO_should_retry)
-	if(SSL_connect(ssl) <= 0) {
-		while(BIO_should_retry(clientBIO)) {
-			if(SSL_connect(ssl) > 0)
-				clientRunning = true;
+	SSL_set_app_data(ssl, this);
+	if(!serverName.empty()) {
+		SSL_set_tlsext_host_name(ssl, serverName.c_str());
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+		if(verifyPeer)
+			X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), serverName.c_str(), 0);
+#endif
+	}
+	verifyUs = 0;
+	verifyCached = false;
+	if(session) {
+		SSL_set_session(ssl, session);
+	} else if(sharedContext) {
+		// Whatever another client of the shared context last got from this server
+		SSL_SESSION* stored = context->takeSession(host, port, serverName);
+		if(stored) {
+			SSL_set_session(ssl, stored);
+			SSL_SESSION_free(stored);
 		}
-	} else {
-		clientRunning = true;
 	}
-
-	// Connect wasn't successful
-	if(!clientRunning) {
-		printf("SSLClient: SSL_connect failed\n");
-		return false;
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	if(!alpn.empty() && (alpn.size() < 256)) {
+		// Wire format: each protocol name prefixed by its length
+		string protos(1, (char)alpn.size());
+		protos += alpn;
+		SSL_set_alpn_protos(ssl, (const unsigned char*)protos.data(), protos.size());
 	}
+#endif
 
-	printf("SSLClient: Connection was successful!\n");
 	return true;
 }
 
+/**
+ * Get ALPN Selected
+ * Application protocol the server picked from the one offered, empty if it picked none or the handshake isn't done
+ */
+string SSLClient::getAlpnSelected() {
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	const unsigned char* proto = NULL;
+	unsigned int len = 0;
+	if(ssl)
+		SSL_get0_alpn_selected(ssl, &proto, &len);
+	if(proto && len)
+		return string((const char*)proto, len);
+#endif
+	return "";
+}
+
+/**
+ * Verify Callback
+ * Stands in for X509_verify_cert() when checking the server's chain so the time it takes can be reported, and
+ * so the verify cache (arg, may be NULL) can answer for chains it has seen before
+ */
+int SSLClient::verifyCallback(X509_STORE_CTX* x509ctx, void* arg) {
+	VerifyCache* cache = (VerifyCache*)arg;
+	SSL* s = (SSL*)X509_STORE_CTX_get_ex_data(x509ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+	SSLClient* cl = s ? (SSLClient*)SSL_get_app_data(s) : NULL;
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	bool hit = false;
+	int ok = cache ? cache->verify(x509ctx, &hit) : X509_verify_cert(x509ctx);
+	long us = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+	if(cl) {
+		cl->verifyUs = us;
+		cl->verifyCached = hit;
+	}
+	return ok;
+}
+
+/**
+ * Is kTLS Send / Is kTLS Recv
+ * Whether the kernel encrypts (decrypts) records on this connection. OpenSSL falls back to user space without
+ * telling anyone when the kernel or negotiated cipher doesn't support it
+ */
+bool SSLClient::isKtlsSend() {
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(OPENSSL_NO_KTLS)
+	return ssl && (BIO_get_ktls_send(SSL_get_wbio(ssl)) > 0);
+#else
+	return false;
+#endif
+}
+
+bool SSLClient::isKtlsRecv() {
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(OPENSSL_NO_KTLS)
+	return ssl && (BIO_get_ktls_recv(SSL_get_rbio(ssl)) > 0);
+#else
+	return false;
+#endif
+}
+
+/**
+ * Set Session
+ * Resume this session on the next attemptConnect(). Needed for early data, which is only possible on resumption
+ *
+ * @param s Session from getSession() of an earlier connection, the client takes its own reference
+ */
+void SSLClient::setSession(SSL_SESSION* s) {
+	if(session)
+		SSL_SESSION_free(session);
+	session = s;
+	if(session) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+		SSL_SESSION_up_ref(session);
+#else
+		CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+#endif
+	}
+}
+
+/**
+ * Get Session
+ * The current connection's session for resuming later. With TLS 1.3 the server sends it after the handshake, so
+ * read at least one response first
+ *
+ * @return The session (caller frees), NULL if there is none
+ */
+SSL_SESSION* SSLClient::getSession() {
+	return ssl ? SSL_get1_session(ssl) : NULL;
+}
+
+/**
+ * Set Early Data
+ * Queue the first request of the next attemptConnect(). An idempotent request goes out as TLS 1.3 early data
+ * (0-RTT) when resuming a session that allows it, because a replayed copy does no harm. A request that isn't
+ * idempotent always waits for the handshake. Either way it has been sent once attemptConnect() returns
+ *
+ * @param data Request bytes
+ * @param len Length of data
+ * @param idempotent Whether the server can safely process the request more than once
+ */
+void SSLClient::setEarlyData(const char* data, unsigned int len, bool idempotent) {
+	earlyData.assign(data, data + len);
+	earlyIdempotent = idempotent;
+	earlySent = false;
+}
+
+/**
+ * Early Data Accepted
+ * @return True if the last handshake carried the queued request as early data and the server accepted it
+ */
+bool SSLClient::earlyDataAccepted() {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	return ssl && earlySent && (SSL_get_early_data_status(ssl) == SSL_EARLY_DATA_ACCEPTED);
+#else
+	return false;
+#endif
+}
+
+/**
+ * Write Early Data
+ * Write the queued request ahead of the handshake if allowed. Not sending it is not an error
+ *
+ * @return 0 when done (sent or not allowed), the poll() events to wait for before calling again, -1 if the write
+ * failed
+ */
+int SSLClient::writeEarlyData() {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	SSL_SESSION* sess = SSL_get_session(ssl);
+	if(!earlyIdempotent || !sess || (SSL_SESSION_get_max_early_data(sess) < earlyData.size()))
+		return 0;
+
+	size_t written = 0;
+	int r = SSL_write_early_data(ssl, &earlyData[0], earlyData.size(), &written);
+	if(r <= 0) {
+		switch(SSL_get_error(ssl, r)) {
+			case SSL_ERROR_WANT_READ:
+				return POLLIN;
+			case SSL_ERROR_WANT_WRITE:
+				return POLLOUT;
+			default:
+				return -1;
+		}
+	}
+	earlySent = true;
+#endif
+	return 0;
+}
+
 /**
  * Read Data
  * Check's if there is any new data to read on the wire
@@ -175,9 +632,11 @@ void SSLClient::readData() {
 	unsigned int bytesRead = 0, maxLen = 4096;
 	char *pData = new char[maxLen];
 
-	// Loop and grab all data on the wire
+	// Loop and grab all data on the wire, up to a full buffer
 	do {
 		bytesRead += r;
+		if(bytesRead == maxLen)
+			break;
 		r = SSL_read(ssl, pData+bytesRead, maxLen-bytesRead);
 	} while(r > 0);
 
@@ -185,10 +644,17 @@ void SSLClient::readData() {
 	if((r == 0) || (SSL_get_shutdown(ssl) != 0)) {
 		printf("Server closed the connection\n");
 		clientRunning = false;
+	} else if(r < 0) {
+		// Anything but "try again" is fatal (a reset, a TLS alert), and the dead socket would keep poll() returning
+		int err = SSL_get_error(ssl, r);
+		if((err != SSL_ERROR_WANT_READ) && (err != SSL_ERROR_WANT_WRITE)) {
+			printf("Connection to the server failed while reading\n");
+			clientRunning = false;
+		}
 	}
 	
 	// If data was read, print it out
-	if(bytesRead > 0) {
+	if((bytesRead > 0) && verbose) {
 		printf("Received %u bytes from server:\n", bytesRead);
 		for(unsigned int i = 0; i < bytesRead; i++) {
 			printf("0x%X ", pData[i]);
@@ -203,53 +669,115 @@ void SSLClient::readData() {
 	delete [] pData;
 }
 
-void SSLClient::writeData(char* pData, unsigned int len) {
-	int r = 0;
-	unsigned int totalSent = 0, bytesLeft = len, dataLen = len;
-
-	// Loop until all data is written to the wire
-	while(totalSent < dataLen) {
-		r = SSL_write(ssl, pData+totalSent, bytesLeft);
-
-		switch(SSL_get_error(ssl, r)) {
-			// Data was written to the wire
-			case SSL_ERROR_NONE:
-				totalSent += r;
-				bytesLeft -= r;
-				printf("writeData() Wrote %u bytes, %u remaining\n", totalSent, bytesLeft);
-				break;
-
-			// WOULDBLOCK
-			case SSL_ERROR_WANT_WRITE:
-				break;
+/**
+ * Write Data
+ * Queue data for the server and send as much of it as the socket takes right away. The rest goes out on later
+ * flush() calls (serviceSocket() makes them when the socket is writable). When the queue is full the send policy
+ * (see setSendQueue()) decides: block until there is room, or refuse the data. A write is queued whole or not at
+ * all; one larger than the whole queue is accepted once the queue is empty
+ *
+ * @param pData Bytes to send
+ * @param len Length of pData
+ * @return len if queued, 0 if refused because the queue is full, -1 if the connection is gone
+ */
+int SSLClient::writeData(const char* pData, unsigned int len) {
+	if(!ssl || !clientRunning)
+		return -1;
+
+	while((getQueuedBytes() > 0) && (getQueuedBytes() + len > maxQueued)) {
+		if(sendPolicy != CLIENT_SEND_BLOCK) {
+			sendRefused = true;
+			return 0;
+		}
+		// Keep reading meanwhile, a peer that echoes stops reading once its own sends back up
+		if(!serviceSocket(CLIENT_POLL_MS))
+			return -1;
+	}
 
-			case SSL_ERROR_WANT_READ:
-				break;
+	sendQueue.insert(sendQueue.end(), pData, pData + len);
+	return (flush() < 0) ? -1 : (int)len;
+}
 
-			// Possible error?
-			default:
-				break;
+/**
+ * Flush
+ * Write queued data until the socket would block
+ *
+ * @return Bytes written, -1 if the connection failed
+ */
+int SSLClient::flush() {
+	int total = 0;
+
+	while(sendHead < sendQueue.size()) {
+		// A retry after WANT_WRITE never asks for less than before, the queue only grows at the back
+		int len = (int)min((size_t)CLIENT_WRITE_CHUNK, sendQueue.size() - sendHead);
+		int r = SSL_write(ssl, &sendQueue[sendHead], len);
+		if(r > 0) {
+			if(verbose) {
+				printf("flush() Wrote %i bytes, %u still queued:\n", r, (unsigned int)(sendQueue.size() - sendHead - r));
+				for(int i = 0; i < r; i++)
+					printf("0x%X ", sendQueue[sendHead + i]);
+				printf("\n");
+				for(int i = 0; i < r; i++)
+					printf("%c", sendQueue[sendHead + i]);
+				printf("\n");
+			}
+			sendHead += r;
+			total += r;
+			continue;
 		}
-	}
 
-	// Check to see if the connection was closed or there was a problem sending the data. Either way, DC
-	if((r == 0) || (SSL_get_shutdown(ssl) != 0)) {
+		int err = SSL_get_error(ssl, r);
+		if((err == SSL_ERROR_WANT_WRITE) || (err == SSL_ERROR_WANT_READ))
+			break;
 		printf("Server closed the connection or there was a write error\n");
 		clientRunning = false;
+		return -1;
 	}
 
-	// If data was written, print it out
-	if(totalSent > 0) {
-		printf("Wrote %u bytes to server:\n", totalSent);
-		for(unsigned int i = 0; i < totalSent; i++) {
-			printf("0x%X ", pData[i]);
-		}
-		printf("\n");
-		for(unsigned int i = 0; i < totalSent; i++) {
-			printf("%c", pData[i]);
-		}
-		printf("\n");
+	// Reclaim the sent front of the queue once it is the bigger part
+	if(sendHead == sendQueue.size()) {
+		sendQueue.clear();
+		sendHead = 0;
+	} else if(sendHead > sendQueue.size() / 2) {
+		sendQueue.erase(sendQueue.begin(), sendQueue.begin() + sendHead);
+		sendHead = 0;
+	}
+
+	// Writers that were refused may go again once half the queue is free
+	if(sendRefused && (getQueuedBytes() <= maxQueued / 2)) {
+		sendRefused = false;
+		if((sendPolicy == CLIENT_SEND_CALLBACK) && drainCallback)
+			drainCallback(this, drainArg);
 	}
+
+	return total;
+}
+
+/**
+ * Service Socket
+ * Wait up to timeoutMs for the socket to become readable, or writable while data is queued, then read what
+ * arrived (readData()) and flush what is queued
+ *
+ * @return False once the connection is gone
+ */
+bool SSLClient::serviceSocket(int timeoutMs) {
+	if(!ssl || !clientRunning)
+		return false;
+
+	struct pollfd pfd = { getFd(), POLLIN, 0 };
+	if(getQueuedBytes() > 0)
+		pfd.events |= POLLOUT;
+	if(SSL_pending(ssl) > 0)
+		timeoutMs = 0;
+	if((poll(&pfd, 1, timeoutMs) < 0) && (errno != EINTR))
+		return false;
+
+	if((SSL_pending(ssl) > 0) || (pfd.revents & (POLLIN | POLLHUP | POLLERR)))
+		readData();
+	if(clientRunning && (getQueuedBytes() > 0))
+		flush();
+
+	return clientRunning;
 }
 
 /**
@@ -260,10 +788,18 @@ void SSLClient::disconnect() {
 	// Shutdown SSL & Free memory
 	SSL_shutdown(ssl);
 	SSL_free(ssl);
-	if(clientCTX)
-		SSL_CTX_free(clientCTX);
+	if(context)
+		context->release();
+	context = NULL;
+	clientCTX = NULL;
+	clientBIO = NULL; // Freed with ssl
+	ssl = NULL;
 	clientRunning = false;
+	sendQueue.clear();
+	sendHead = 0;
+	sendRefused = false;
 
-	printf("SSLClient: Client has disconnected from the server.\n");
+	if(verbose)
+		printf("SSLClient: Client has disconnected from the server.\n");
 }
 
@@ -20,28 +20,111 @@
 #define _SSLClient_h
 
 #include <iostream>
+#include <vector>
+
+#include <netdb.h>
 
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
 
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "../common/TlsVersion.h"
+#include "../common/VerifyCache.h"
+#include "ClientContext.h"
+
 #define CLIENT_CERTFILE "../certs/thawte_cert.cer"
+#define CLIENT_VERIFY false // Verify the server's certificate chain against CLIENT_CERTFILE (-verify), which must then sign the server's certificate
+#define CLIENT_MIN_VERSION 0 // Oldest protocol version offered (0 = library default)
+#define CLIENT_MAX_VERSION 0 // Newest protocol version offered (0 = newest the library supports)
+#define CLIENT_KEYPWD "1234" // Password of the client certificate's private key, see setClientCert()
+#define CLIENT_CONNECT_TIMEOUT 5000 // ms allowed for resolving the host name, and again for the TCP connect
+#define CLIENT_HANDSHAKE_TIMEOUT 10000 // ms allowed for the TLS handshake once connected
+#define CLIENT_POLL_MS 100 // Longest serviceSocket() wait of the echo loop and of a blocked writeData()
+#define CLIENT_WRITE_CHUNK 16384 // Bytes handed to each SSL_write from the send queue (one full TLS record)
+#define CLIENT_SEND_QUEUE_MAX (1024 * 1024) // Bytes writeData() queues before the send policy applies
+#define CLIENT_SEND_BLOCK 0 // Send policy: writeData() waits until the queue has room
+#define CLIENT_SEND_FAIL 1 // Send policy: writeData() refuses what doesn't fit
+#define CLIENT_SEND_CALLBACK 2 // Send policy: refuse, then call the drain callback once the queue is half empty
 
 using namespace std;
 
 class SSLClient {
+	friend class ClientContext;
+
 private:
 	string host;
 	int port;
 	bool clientRunning;
+	bool verbose; // Dump every byte sent and received
+	bool ktls; // Ask OpenSSL to hand record encryption to the kernel after the handshake
 
-	const SSL_METHOD* sslMethod;
-	SSL_CTX* clientCTX;
+	bool verifyPeer;
+	string serverName; // Sent as SNI and, when OpenSSL can, checked against the certificate. Empty for neither
+	VerifyCache* verifyCache; // Shared, not owned. NULL to verify every chain in full
+	long verifyUs; // Time spent verifying the server's chain on the last connect
+	bool verifyCached;
+	int minVersion;
+	int maxVersion;
+	string certFile; // Client certificate presented when the server asks for one. Empty for none
+	string keyFile;
+	string ciphers; // Offered cipher list, TLS 1.3 suites if it starts with TLS_. Empty for all
+	string alpn; // Application protocol offered in the handshake. Empty for none
+
+	ClientContext* sharedContext; // Given to setContext(), one reference held
+	ClientContext* context; // Of the current connection, shared or built for it alone. One reference held
+	SSL_CTX* clientCTX; // context's
 	BIO* clientBIO;
 	SSL* ssl; // SSL structure
+	SSL_SESSION* session; // Resumed by the next attemptConnect()
+
+	// Data waiting for the socket, see writeData()
+	vector<char> sendQueue;
+	size_t sendHead; // First unsent byte of sendQueue
+	size_t maxQueued;
+	int sendPolicy;
+	bool sendRefused; // A write was refused since the queue last drained
+	void (*drainCallback)(SSLClient* cl, void* arg);
+	void* drainArg;
+
+	// Connect in progress, see startConnect()
+	int connectTimeoutMs;
+	int handshakeTimeoutMs;
+	boost::posix_time::ptime deadline; // Of the current phase, TCP connect or handshake
+
+	// First request of the next connection, see setEarlyData()
+	string earlyData;
+	bool earlyIdempotent;
+	bool earlySent;
+	bool earlyPending; // Not yet tried on the connect in progress
+
+	// A host name lookup on a thread of its own, shared with a caller that may give up waiting for it
+	struct HostLookup {
+		string name;
+		boost::mutex mutex; // Guards done and addr
+		boost::condition_variable doneCond;
+		bool done;
+		string addr; // Empty if the name didn't resolve
+	};
 
-private:
 	bool initSSL();
+	bool createSSL();
+	int writeEarlyData();
+
+	static bool resolveHost(const string& name, int timeoutMs, string& addr);
+	static void lookupHost(boost::shared_ptr<HostLookup> lookup);
+	static string numericAddress(const struct addrinfo* ai);
+
+	static int verifyCallback(X509_STORE_CTX* x509ctx, void* arg);
+
+	static int passwordCallback(char *buf, int size, int rwflag, void *password) {
+		strncpy(buf, (char *)(CLIENT_KEYPWD), size);
+		buf[size - 1] = '\0';
+		return(strlen(buf));
+	}
     
 public:
     SSLClient();
@@ -49,10 +132,21 @@ public:
     
 	bool initSocket(string, int);
     bool attemptConnect();
+	bool startConnect();
+	int continueConnect();
+	bool connectTimedOut();
+	int getFd();
 	void readData();
-	void writeData(char*, unsigned int);
+	int writeData(const char*, unsigned int);
+	int flush();
+	bool serviceSocket(int timeoutMs);
 	void disconnect();
 
+	void setSession(SSL_SESSION* s);
+	SSL_SESSION* getSession();
+	void setEarlyData(const char* data, unsigned int len, bool idempotent);
+	bool earlyDataAccepted();
+
 	void setClientRunning(bool c) {
 		clientRunning = c;
 	}
@@ -61,6 +155,101 @@ public:
 		return clientRunning;
 	}
 
+	void setVerbose(bool v) {
+		verbose = v;
+	}
+
+	// Takes effect on the next initSocket()
+	void setVersionRange(int minV, int maxV) {
+		minVersion = minV;
+		maxVersion = maxV;
+	}
+
+	// Takes effect on the next initSocket()
+	void setVerify(bool enable, VerifyCache* cache) {
+		verifyPeer = enable;
+		verifyCache = cache;
+	}
+
+	// Takes effect on the next initSocket()
+	void setClientCert(string cert, string key) {
+		certFile = cert;
+		keyFile = key;
+	}
+
+	// Queue limit in bytes and what writeData() does when it is reached (CLIENT_SEND_BLOCK, _FAIL, _CALLBACK)
+	void setSendQueue(size_t maxBytes, int policy) {
+		maxQueued = maxBytes;
+		sendPolicy = policy;
+	}
+
+	// Called from flush() under CLIENT_SEND_CALLBACK once a refused writer may try again
+	void setDrainCallback(void (*cb)(SSLClient* cl, void* arg), void* arg) {
+		drainCallback = cb;
+		drainArg = arg;
+	}
+
+	// Bytes accepted by writeData() that haven't reached the socket yet
+	size_t getQueuedBytes() {
+		return sendQueue.size() - sendHead;
+	}
+
+	// Deadlines of the TCP connect and of the handshake after it, in ms
+	void setTimeouts(int connectMs, int handshakeMs) {
+		connectTimeoutMs = connectMs;
+		handshakeTimeoutMs = handshakeMs;
+	}
+
+	void setServerName(string name) {
+		serverName = name;
+	}
+
+	long getVerifyUs() {
+		return verifyUs;
+	}
+
+	bool wasVerifyCached() {
+		return verifyCached;
+	}
+
+	// Takes effect on the next initSocket()
+	void setCiphers(string list) {
+		ciphers = list;
+	}
+
+	// Share a context from the next initSocket() on. Its settings replace the client's own
+	void setContext(ClientContext* c);
+
+	// Takes effect on the next initSocket()
+	void setAlpn(string protocol) {
+		alpn = protocol;
+	}
+
+	// Takes effect on the next initSocket()
+	void setKtls(bool enable) {
+		ktls = enable;
+	}
+
+	SSL* getSSL() {
+		return ssl;
+	}
+
+	string getHost() {
+		return host;
+	}
+
+	int getPort() {
+		return port;
+	}
+
+	string getServerName() {
+		return serverName;
+	}
+
+	string getAlpnSelected();
+	bool isKtlsSend();
+	bool isKtlsRecv();
+
 };
 
 #endif
@@ -0,0 +1,465 @@
+/**
+   ssltests
+   TraceReplay.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "TraceReplay.h"
+#include "Benchmark.h"
+
+#include <deque>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <boost/bind.hpp>
+#include <boost/unordered_map.hpp>
+
+TraceReplay::TraceReplay(string h, int p) {
+	host = h;
+	port = p;
+
+	verifyPeer = CLIENT_VERIFY;
+	verifyCache = NULL;
+	serverName = "";
+	certFile = "";
+	keyFile = "";
+	minVersion = CLIENT_MIN_VERSION;
+	maxVersion = CLIENT_MAX_VERSION;
+
+	map = NULL;
+	mapLen = 0;
+	flags = 0;
+	messageBytes = 0;
+	messageCount = 0;
+	maxMessage = 0;
+
+	speed = 1;
+	ctx = NULL;
+	baseUs = 0;
+}
+
+TraceReplay::~TraceReplay() {
+	if(map)
+		munmap((void*)map, mapLen);
+}
+
+/**
+ * Load
+ * Map a trace file and index it: each connection's open and close time and where its client messages are. A
+ * record cut off by the end of the file (a recorder that crashed) ends the trace
+ *
+ * @return True if the file is a trace with at least one connection
+ */
+bool TraceReplay::load(const char* path) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		printf("TraceReplay: Could not open %s\n", path);
+		return false;
+	}
+	struct stat st;
+	if((fstat(fd, &st) < 0) || (st.st_size < TRACE_FILE_HEADER_SIZE)) {
+		printf("TraceReplay: %s is too short for a trace\n", path);
+		close(fd);
+		return false;
+	}
+	mapLen = st.st_size;
+	void* m = mmap(NULL, mapLen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(m == MAP_FAILED) {
+		printf("TraceReplay: Could not map %s\n", path);
+		mapLen = 0;
+		return false;
+	}
+	map = (const unsigned char*)m;
+	madvise(m, mapLen, MADV_SEQUENTIAL);
+
+	if(memcmp(map, TRACE_MAGIC, 8) != 0) {
+		printf("TraceReplay: %s is not a trace file\n", path);
+		return false;
+	}
+	flags = trace_get32(map + 8);
+
+	boost::unordered_map<unsigned int, unsigned int> index; // Connection number to conns
+	size_t pos = TRACE_FILE_HEADER_SIZE;
+	unsigned long long endUs = 0;
+	while(mapLen - pos >= TRACE_RECORD_HEADER_SIZE) {
+		TraceRecordHeader h;
+		trace_decode_record(map + pos, &h);
+		size_t size = TRACE_RECORD_HEADER_SIZE + (trace_has_payload(flags, h.type) ? h.length : 0);
+		if(mapLen - pos < size)
+			break;
+		endUs = h.time;
+
+		if(h.type == TRACE_OPEN) {
+			TraceConn tc;
+			tc.openUs = h.time;
+			tc.closeUs = h.time;
+			index[h.connection] = conns.size();
+			conns.push_back(tc);
+		} else {
+			boost::unordered_map<unsigned int, unsigned int>::iterator it = index.find(h.connection);
+			if(it != index.end()) {
+				TraceConn& tc = conns[it->second];
+				tc.closeUs = h.time;
+				if(h.type == TRACE_CLIENT) {
+					tc.messages.push_back(pos);
+					messageBytes += h.length;
+					messageCount++;
+					maxMessage = max(maxMessage, h.length);
+				}
+			}
+		}
+		pos += size;
+	}
+
+	if(conns.empty()) {
+		printf("TraceReplay: %s has no connections\n", path);
+		return false;
+	}
+	if(!(flags & TRACE_FLAG_PAYLOAD))
+		filler.assign(maxMessage ? maxMessage : 1, 'r');
+
+	printf("Trace: %u connections, %lu client messages (%.2f MB) over %.1f s, %s\n", (unsigned int)conns.size(), messageCount,
+		messageBytes / (1024.0 * 1024.0), endUs / 1000000.0, (flags & TRACE_FLAG_PAYLOAD) ? "with payload" : "sizes only");
+	return true;
+}
+
+/**
+ * Run
+ * Replay the loaded trace and report how closely the schedule was kept and the echo latency
+ *
+ * @param timeScale Playback speed, 1 as recorded, 2 twice as fast, 0 without waiting
+ * @param copies Times the trace is played at once, each recorded connection is opened this many times
+ * @param threads Event loop threads the replayed connections are spread over
+ * @return True if every connection got through and every message was echoed
+ */
+bool TraceReplay::run(double timeScale, int copies, int threads) {
+	speed = (timeScale > 0) ? timeScale : 0;
+	copies = max(1, copies);
+	threads = (int)max(1UL, min((unsigned long)max(1, threads), (unsigned long)conns.size() * copies));
+
+	ctx = new ClientContext();
+	ctx->setVerify(verifyPeer, verifyCache);
+	ctx->setVersionRange(minVersion, maxVersion);
+	if(!certFile.empty())
+		ctx->setClientCert(certFile, keyFile);
+	if(!ctx->init()) {
+		ctx->release();
+		ctx = NULL;
+		return false;
+	}
+
+	// Deal the connections out round robin, each loop opens its share in the recorded order
+	vector<Worker> workers(threads);
+	unsigned long n = 0;
+	for(unsigned int i = 0; i < conns.size(); i++) {
+		for(int c = 0; c < copies; c++)
+			workers[n++ % threads].starts.push_back(&conns[i]);
+	}
+	for(int t = 0; t < threads; t++) {
+		Worker& w = workers[t];
+		w.nextStart = 0;
+		w.connected = 0;
+		w.connectFailures = 0;
+		w.lost = 0;
+		w.messages = 0;
+		w.unanswered = 0;
+		w.bytes = 0;
+	}
+
+	char pace[32];
+	if(speed > 0)
+		sprintf(pace, "%.2fx speed", speed);
+	else
+		sprintf(pace, "no waits");
+	printf("Replay: %i cop%s on %i thread%s against %s:%i, %s\n", copies, (copies == 1) ? "y" : "ies", threads,
+		(threads == 1) ? "" : "s", host.c_str(), port, pace);
+
+	double cpu = Benchmark::cpuSeconds();
+	baseUs = nowUs();
+	boost::thread_group loops;
+	for(int t = 0; t < threads; t++)
+		loops.create_thread(boost::bind(&TraceReplay::workerLoop, this, &workers[t]));
+	loops.join_all();
+	double secs = (nowUs() - baseUs) / 1000000.0;
+	cpu = Benchmark::cpuSeconds() - cpu;
+
+	ctx->release();
+	ctx = NULL;
+
+	connected = 0;
+	connectFailures = 0;
+	lost = 0;
+	messages = 0;
+	unanswered = 0;
+	bytes = 0;
+	for(int t = 0; t < threads; t++) {
+		Worker& w = workers[t];
+		slip.add(w.slip);
+		latency.add(w.latency);
+		connected += w.connected;
+		connectFailures += w.connectFailures;
+		lost += w.lost;
+		messages += w.messages;
+		unanswered += w.unanswered;
+		bytes += w.bytes;
+	}
+
+	printf("  %lu connections, %lu connect failures, %lu lost after connecting\n", connected, connectFailures, lost);
+	printf("  %lu messages, %.0f msgs/s, %.2f MB/s, %lu never echoed, %.1f s\n", messages, messages / secs,
+		bytes / secs / (1024 * 1024), unanswered, secs);
+	printf("  client CPU %.2f s (%.0f%% of one core)\n", cpu, (100.0 * cpu) / secs);
+	if(slip.count())
+		printf("  sent late by: p50 %lli us, p99 %lli us, max %lli us\n", slip.valueAtPercentile(50), slip.valueAtPercentile(99), slip.max());
+	if(latency.count())
+		printf("  latency from schedule: avg %.0f us, p50 %lli us, p90 %lli us, p99 %lli us, p99.9 %lli us, max %lli us\n",
+			latency.mean(), latency.valueAtPercentile(50), latency.valueAtPercentile(90), latency.valueAtPercentile(99),
+			latency.valueAtPercentile(99.9), latency.max());
+
+	return !connectFailures && !lost && !unanswered;
+}
+
+/**
+ * Worker Loop
+ * Event loop for one thread's share of the connections: open each when it is due, then move every open one along
+ * whenever its socket is ready or its next message, close or drain deadline comes up, until all are done
+ */
+void TraceReplay::workerLoop(Worker* w) {
+	vector<struct pollfd> fds;
+	vector<Active*> polled;
+
+	while((w->nextStart < w->starts.size()) || !w->active.empty()) {
+		long long now = nowUs();
+		while((w->nextStart < w->starts.size()) && (dueUs(w->starts[w->nextStart]->openUs) <= now)) {
+			Active* a = openConnection(w->starts[w->nextStart++]);
+			if(a)
+				w->active.push_back(a);
+			else
+				w->connectFailures++;
+		}
+
+		// Sleep until a socket is ready or the next connection, message or deadline is due
+		long long wake = now + REPLAY_POLL_MS * 1000LL;
+		if(w->nextStart < w->starts.size())
+			wake = min(wake, dueUs(w->starts[w->nextStart]->openUs));
+		fds.clear();
+		polled.clear();
+		for(unsigned int i = 0; i < w->active.size(); i++) {
+			Active* a = w->active[i];
+			wake = min(wake, a->nextUs);
+			struct pollfd p;
+			p.fd = a->cl->getFd();
+			p.events = a->events;
+			p.revents = 0;
+			fds.push_back(p);
+			polled.push_back(a);
+		}
+
+		int timeoutMs = (wake > now) ? (int)((wake - now + 999) / 1000) : 0;
+		if((poll(fds.empty() ? NULL : &fds[0], fds.size(), timeoutMs) < 0) && (errno != EINTR))
+			break;
+
+		// Connections that are done are finished by service() and leave the loop
+		now = nowUs();
+		w->active.clear();
+		for(unsigned int i = 0; i < polled.size(); i++) {
+			Active* a = polled[i];
+			if((fds[i].revents || (now >= a->nextUs)) && !service(a, now, w))
+				continue;
+			w->active.push_back(a);
+		}
+	}
+
+	for(unsigned int i = 0; i < w->active.size(); i++)
+		finishConnection(w, w->active[i], false);
+	w->active.clear();
+}
+
+/**
+ * Open Connection
+ * Start a non-blocking connect for one recorded connection
+ *
+ * @return The connection, NULL if the connect could not be started
+ */
+TraceReplay::Active* TraceReplay::openConnection(const TraceConn* tc) {
+	SSLClient* cl = new SSLClient();
+	cl->setVerbose(false);
+	cl->setContext(ctx);
+	if(!serverName.empty())
+		cl->setServerName(serverName);
+	// Writes are never left to block, a blocked writeData() would read (and lose) the echo itself
+	cl->setSendQueue(CLIENT_SEND_QUEUE_MAX, CLIENT_SEND_FAIL);
+	int r = -1;
+	if(cl->initSocket(host, port) && cl->startConnect())
+		r = cl->continueConnect();
+	if(r < 0) {
+		delete cl;
+		return NULL;
+	}
+
+	Active* a = new Active();
+	a->tc = tc;
+	a->cl = cl;
+	a->connecting = true;
+	a->events = (short)r;
+	a->nextUs = nowUs() + REPLAY_POLL_MS * 1000LL;
+	a->next = 0;
+	a->closeDue = dueUs(tc->closeUs);
+	a->drainEnd = 0;
+	a->sentBytes = 0;
+	a->received = 0;
+	a->sentCount = 0;
+	a->echoed = 0;
+	return a;
+}
+
+/**
+ * Service
+ * Move a connection along: finish connecting, write every message that is due while reading the echo, and once
+ * its recorded life is over wait up to REPLAY_DRAIN_MS for the rest of the echo
+ *
+ * @return False if the connection is done, it has been finished and freed
+ */
+bool TraceReplay::service(Active* a, long long now, Worker* w) {
+	SSLClient* cl = a->cl;
+	if(a->connecting) {
+		int r = cl->continueConnect();
+		if((r > 0) && cl->connectTimedOut()) {
+			printf("SSLClient: %s to %s:%i timed out\n", cl->getSSL() ? "Handshake" : "Connect", host.c_str(), port);
+			r = -1;
+		}
+		if(r < 0) {
+			delete cl;
+			delete a;
+			w->connectFailures++;
+			return false;
+		}
+		if(r > 0) {
+			a->events = (short)r;
+			a->nextUs = now + REPLAY_POLL_MS * 1000LL;
+			return true;
+		}
+		a->connecting = false;
+	}
+
+	bool ok = (cl->getQueuedBytes() == 0) || (cl->flush() >= 0);
+
+	// Write every message that is due, unless the send queue is full
+	const TraceConn* tc = a->tc;
+	while(ok && (a->next < tc->messages.size())) {
+		TraceRecordHeader h;
+		const unsigned char* rec = map + tc->messages[a->next];
+		trace_decode_record(rec, &h);
+		long long due = dueUs(h.time);
+		if(due > now)
+			break;
+		const char* data = (flags & TRACE_FLAG_PAYLOAD) ? (const char*)rec + TRACE_RECORD_HEADER_SIZE : &filler[0];
+		int r = cl->writeData(data, h.length);
+		if(r < 0)
+			ok = false;
+		if(r <= 0)
+			break;
+		w->slip.record(now - due);
+		a->sentBytes += h.length;
+		a->sentCount++;
+		a->pending.push_back(make_pair(a->sentBytes, due));
+		a->next++;
+	}
+
+	// Read what came back
+	char buf[REPLAY_READ_SIZE];
+	while(ok) {
+		int r = SSL_read(cl->getSSL(), buf, sizeof(buf));
+		if(r > 0) {
+			a->received += r;
+			continue;
+		}
+		int err = SSL_get_error(cl->getSSL(), r);
+		if((err != SSL_ERROR_WANT_READ) && (err != SSL_ERROR_WANT_WRITE))
+			ok = false;
+		break;
+	}
+	now = nowUs();
+	while(!a->pending.empty() && (a->received >= a->pending.front().first)) {
+		w->latency.record(now - a->pending.front().second);
+		a->pending.pop_front();
+		a->echoed++;
+	}
+	if(!ok) {
+		finishConnection(w, a, false);
+		return false;
+	}
+
+	// Done once everything is sent and the recorded life is over, and then the echo is in or overdue
+	long long wake = a->closeDue;
+	if((a->next == tc->messages.size()) && (now >= a->closeDue)) {
+		if(!a->drainEnd)
+			a->drainEnd = now + REPLAY_DRAIN_MS * 1000LL;
+		if(a->pending.empty() || (now >= a->drainEnd)) {
+			finishConnection(w, a, true);
+			return false;
+		}
+		wake = a->drainEnd;
+	} else if(a->next < tc->messages.size()) {
+		TraceRecordHeader h;
+		trace_decode_record(map + tc->messages[a->next], &h);
+		wake = min(wake, dueUs(h.time));
+	}
+
+	a->nextUs = (SSL_pending(cl->getSSL()) > 0) ? now : wake;
+	a->events = POLLIN;
+	if(cl->getQueuedBytes() > 0)
+		a->events |= POLLOUT;
+	return true;
+}
+
+/**
+ * Finish Connection
+ * Close a connection that got through its handshake and add up what it did
+ */
+void TraceReplay::finishConnection(Worker* w, Active* a, bool ok) {
+	w->connected++;
+	if(!ok)
+		w->lost++;
+	w->messages += a->sentCount;
+	w->unanswered += a->sentCount - a->echoed;
+	w->bytes += a->sentBytes;
+	delete a->cl;
+	delete a;
+}
+
+/**
+ * Due Us
+ * When an event at traceUs into the trace is due in this replay
+ */
+long long TraceReplay::dueUs(unsigned long long traceUs) {
+	if(speed <= 0)
+		return baseUs;
+	return baseUs + (long long)(traceUs / speed);
+}
+
+/**
+ * Now Us
+ * Monotonic clock in microseconds
+ */
+long long TraceReplay::nowUs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
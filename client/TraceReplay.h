@@ -0,0 +1,164 @@
+/**
+   ssltests
+   TraceReplay.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _tracereplay_h_
+#define _tracereplay_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <boost/thread.hpp>
+
+#include "SSLClient.h"
+#include "LatencyHistogram.h"
+#include "../common/TraceFormat.h"
+
+#define REPLAY_THREADS 4 // Event loop threads the replayed connections are spread over
+#define REPLAY_POLL_MS 100 // Longest an event loop sleeps in poll() before checking the clock
+#define REPLAY_DRAIN_MS 5000 // Wait for outstanding echoes once a connection's recorded life is over
+#define REPLAY_READ_SIZE 16384 // Bytes drained per SSL_read() (one full TLS record)
+
+using namespace std;
+
+/**
+ * Trace Replay
+ * Plays a trace recorded by the server (-trace, see TraceFormat.h) back against the echo server: every recorded
+ * connection is opened when it was opened, sends each of its client messages, with the same size and the recorded
+ * plaintext if the trace has it, when it was sent, and stays open as long as it did. Timing can be kept, scaled
+ * (speed 2 plays twice as fast) or dropped (speed 0, every message as soon as the last was written), and the
+ * whole trace can be played several times over at once to multiply the load while keeping its shape.
+ *
+ * The file is mapped, not read: indexing it touches every record header once and payloads are written to the
+ * connections straight from the mapping, so a trace larger than memory replays from the page cache. Replayed
+ * connections are spread over a few threads, each running a poll() event loop over its share as LoadGenerator
+ * does, so replaying tens of thousands of connections doesn't take as many threads. All of them share one
+ * ClientContext. Latency is measured from when a message was due, so a server that falls behind shows up in full.
+ */
+class TraceReplay {
+private:
+	struct TraceConn {
+		unsigned long long openUs;
+		unsigned long long closeUs; // Last record of the connection if its close wasn't recorded
+		vector<size_t> messages; // Offsets of its client message records in the mapping
+	};
+
+	// One replayed connection while it is open
+	struct Active {
+		const TraceConn* tc;
+		SSLClient* cl;
+		bool connecting; // Connect or handshake still in progress
+		short events; // poll() interest
+		long long nextUs; // Service again by then even if the socket stays quiet
+		unsigned int next; // Next message to write
+		long long closeDue;
+		long long drainEnd; // Give up on the rest of the echo at this time, 0 until draining
+		deque<pair<unsigned long long, long long> > pending; // End of each message in the stream and when it was due
+		unsigned long long sentBytes;
+		unsigned long long received;
+		unsigned long sentCount;
+		unsigned long echoed;
+	};
+
+	struct Worker {
+		vector<const TraceConn*> starts; // Connections this loop opens, in the order they are due
+		unsigned int nextStart;
+		vector<Active*> active;
+		LatencyHistogram slip;
+		LatencyHistogram latency;
+		unsigned long connected;
+		unsigned long connectFailures;
+		unsigned long lost;
+		unsigned long messages;
+		unsigned long unanswered;
+		unsigned long long bytes;
+	};
+
+	string host;
+	int port;
+
+	// Applied to every connection
+	bool verifyPeer;
+	VerifyCache* verifyCache;
+	string serverName;
+	string certFile;
+	string keyFile;
+	int minVersion;
+	int maxVersion;
+
+	// The mapped trace
+	const unsigned char* map;
+	size_t mapLen;
+	unsigned int flags;
+	vector<TraceConn> conns; // In the order they opened
+	unsigned long long messageBytes; // Sent by clients over the whole trace
+	unsigned long messageCount;
+	unsigned int maxMessage;
+	vector<char> filler; // Sent in place of the plaintext when the trace has none
+
+	// Run settings
+	double speed;
+	ClientContext* ctx;
+	long long baseUs;
+
+	// Results, summed over the workers once they are done
+	LatencyHistogram slip; // How late each message was written, us
+	LatencyHistogram latency; // Due time to complete echo, us
+	unsigned long connected;
+	unsigned long connectFailures;
+	unsigned long lost; // Connections that broke after connecting
+	unsigned long messages;
+	unsigned long unanswered; // Messages whose echo never came back
+	unsigned long long bytes;
+
+private:
+	void workerLoop(Worker* w);
+	Active* openConnection(const TraceConn* tc);
+	bool service(Active* a, long long now, Worker* w);
+	void finishConnection(Worker* w, Active* a, bool ok);
+	long long dueUs(unsigned long long traceUs);
+
+	static long long nowUs();
+
+public:
+	TraceReplay(string h, int p);
+	~TraceReplay();
+
+	bool load(const char* path);
+	bool run(double timeScale, int copies, int threads);
+
+	void setVerify(bool enable, VerifyCache* cache, string name) {
+		verifyPeer = enable;
+		verifyCache = cache;
+		serverName = name;
+	}
+
+	void setClientCert(string cert, string key) {
+		certFile = cert;
+		keyFile = key;
+	}
+
+	void setVersionRange(int minV, int maxV) {
+		minVersion = minV;
+		maxVersion = maxV;
+	}
+};
+
+#endif
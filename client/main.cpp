@@ -17,11 +17,17 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
 
 #include "SSLClient.h"
+#include "Benchmark.h"
+#include "LoadGenerator.h"
+#include "TraceReplay.h"
+#include "../common/CryptoLocks.h"
 
 int main (int argc, const char * argv[])
 {
@@ -34,9 +40,214 @@ int main (int argc, const char * argv[])
 	SSL_load_error_strings();
 	RAND_load_file("/dev/urandom", 1024); // Seed the PRNG
 
+	string host = "127.0.0.1";
+	int port = 443;
+	int minVersion = CLIENT_MIN_VERSION, maxVersion = CLIENT_MAX_VERSION;
+	bool verbose = true, verify = CLIENT_VERIFY, useVerifyCache = false;
+	string serverName = "";
+	string certFile = "", keyFile = "";
+	int lockKind = CRYPTO_LOCKS_MUTEX;
+	bool lockStats = false;
+	int verifyConnects = 0;
+	int hsWorkers = 0, hsSeconds = 0;
+	long long bulkBytes = 0;
+	int poolRequests = 0, poolWorkers = 1;
+	int muxSeconds = 0;
+	int ctxConnects = 0, ctxWorkers = 1;
+	int bulkConnections = 1;
+	int benchHandshakes = 0, earlyRequests = 0, earlySize = 0;
+	long long benchBytes = 0, ktlsBytes = 0;
+	int loadConnections = 0, loadThreads = 1, loadSize = 64, loadDuration = 10;
+	double loadRate = 0;
+	int connectTimeout = CLIENT_CONNECT_TIMEOUT, handshakeTimeout = CLIENT_HANDSHAKE_TIMEOUT;
+	bool openLoop = false;
+	string histogramLog = "";
+	string replayFile = "";
+	double replaySpeed = 1;
+	int replayCopies = 1, replayThreads = REPLAY_THREADS;
+	for(int i = 1; i < argc; i++) {
+		if((strcmp(argv[i], "-host") == 0) && (i+1 < argc)) {
+			host = argv[++i];
+		} else if((strcmp(argv[i], "-port") == 0) && (i+1 < argc)) {
+			port = atoi(argv[++i]);
+		} else if(((strcmp(argv[i], "-minversion") == 0) || (strcmp(argv[i], "-maxversion") == 0)) && (i+1 < argc)) {
+			int v = tls_version_from_name(argv[i+1]);
+			if(v < 0) {
+				printf("Unknown protocol version %s, expected one of: %s\n", argv[i+1], TLSVERSION_NAMES);
+				return -1;
+			}
+			if(strcmp(argv[i], "-minversion") == 0)
+				minVersion = v;
+			else
+				maxVersion = v;
+			i++;
+		} else if(strcmp(argv[i], "-quiet") == 0) {
+			verbose = false;
+		} else if((strcmp(argv[i], "-cryptolocks") == 0) && (i+1 < argc)) {
+			lockKind = CryptoLocks::kindFromName(argv[++i]);
+			if(lockKind < 0) {
+				printf("Unknown lock kind %s, expected one of: %s\n", argv[i], CRYPTO_LOCKS_NAMES);
+				return -1;
+			}
+		} else if(strcmp(argv[i], "-lockstats") == 0) {
+			lockStats = true;
+		} else if(strcmp(argv[i], "-verify") == 0) {
+			verify = true;
+		} else if(strcmp(argv[i], "-noverify") == 0) {
+			verify = false;
+		} else if(strcmp(argv[i], "-verifycache") == 0) {
+			useVerifyCache = true;
+		} else if((strcmp(argv[i], "-servername") == 0) && (i+1 < argc)) {
+			serverName = argv[++i];
+		} else if((strcmp(argv[i], "-cert") == 0) && (i+1 < argc)) {
+			certFile = argv[++i];
+		} else if((strcmp(argv[i], "-key") == 0) && (i+1 < argc)) {
+			keyFile = argv[++i];
+		} else if((strcmp(argv[i], "-verifybench") == 0) && (i+1 < argc)) {
+			verifyConnects = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-ctxbench") == 0) && (i+2 < argc)) {
+			ctxConnects = atoi(argv[++i]);
+			ctxWorkers = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-muxbench") == 0) && (i+1 < argc)) {
+			muxSeconds = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-poolbench") == 0) && (i+2 < argc)) {
+			poolRequests = atoi(argv[++i]);
+			poolWorkers = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-bulkbench") == 0) && (i+2 < argc)) {
+			bulkBytes = atoll(argv[++i]);
+			bulkConnections = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-hsbench") == 0) && (i+2 < argc)) {
+			hsWorkers = atoi(argv[++i]);
+			hsSeconds = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-protobench") == 0) && (i+2 < argc)) {
+			benchHandshakes = atoi(argv[++i]);
+			benchBytes = atoll(argv[++i]);
+		} else if((strcmp(argv[i], "-load") == 0) && (i+2 < argc)) {
+			loadConnections = atoi(argv[++i]);
+			loadThreads = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-size") == 0) && (i+1 < argc)) {
+			loadSize = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-rate") == 0) && (i+1 < argc)) {
+			loadRate = atof(argv[++i]);
+		} else if((strcmp(argv[i], "-timeouts") == 0) && (i+2 < argc)) {
+			connectTimeout = atoi(argv[++i]);
+			handshakeTimeout = atoi(argv[++i]);
+		} else if(strcmp(argv[i], "-openloop") == 0) {
+			openLoop = true;
+		} else if((strcmp(argv[i], "-histlog") == 0) && (i+1 < argc)) {
+			histogramLog = argv[++i];
+		} else if((strcmp(argv[i], "-replay") == 0) && (i+1 < argc)) {
+			replayFile = argv[++i];
+		} else if((strcmp(argv[i], "-speed") == 0) && (i+1 < argc)) {
+			replaySpeed = atof(argv[++i]);
+		} else if((strcmp(argv[i], "-copies") == 0) && (i+1 < argc)) {
+			replayCopies = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-replaythreads") == 0) && (i+1 < argc)) {
+			replayThreads = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-duration") == 0) && (i+1 < argc)) {
+			loadDuration = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-ktlsbench") == 0) && (i+1 < argc)) {
+			ktlsBytes = atoll(argv[++i]);
+		} else if((strcmp(argv[i], "-earlybench") == 0) && (i+2 < argc)) {
+			earlyRequests = atoi(argv[++i]);
+			earlySize = atoi(argv[++i]);
+		} else {
+			printf("Unknown option: %s\n", argv[i]);
+			printf("Usage: %s [-host h] [-port n] [-minversion v] [-maxversion v] [-quiet] [-cryptolocks kind] [-lockstats]\n"
+				"\t[-verify | -noverify] [-verifycache] [-servername name] [-cert file -key file] [-timeouts connect_ms handshake_ms]\n"
+				"\t[-protobench handshakes bytes] [-earlybench requests size] [-ktlsbench bytes] [-verifybench connects]\n"
+				"\t[-hsbench workers secs] [-bulkbench bytes connections] [-poolbench requests workers]\n"
+				"\t[-muxbench secs] [-ctxbench connects workers]\n"
+				"\t[-load connections threads [-size bytes] [-rate msgs/s] [-duration secs] [-openloop] [-histlog file]]\n"
+				"\t[-replay tracefile [-speed x] [-copies n] [-replaythreads n]]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	// Before any thread is started, OpenSSL 1.0 is only thread safe with locking callbacks
+	if(!CryptoLocks::install(lockKind, lockStats))
+		return -1;
+
+	// Chains verified by one connection are trusted by the next without a full verification
+	VerifyCache* verifyCache = NULL;
+	if(useVerifyCache)
+		verifyCache = new VerifyCache(VERIFY_CACHE_SIZE, VERIFY_CACHE_TTL);
+
+	// Generate load from many connections instead of the echo exchange
+	if(loadConnections > 0) {
+		LoadGenerator load(host, port);
+		load.setVersionRange(minVersion, maxVersion);
+		load.setVerify(verify, serverName);
+		load.setOpenLoop(openLoop);
+		load.setHistogramLog(histogramLog);
+		if(!certFile.empty())
+			load.setClientCert(certFile, keyFile.empty() ? certFile : keyFile);
+		bool ok = load.run(loadConnections, loadThreads, loadSize, loadRate, loadDuration);
+		if(verifyCache)
+			delete verifyCache;
+		CryptoLocks::printStats();
+		return ok ? 0 : -1;
+	}
+
+	// Replay a trace recorded by the server instead of the echo exchange
+	if(!replayFile.empty()) {
+		TraceReplay replay(host, port);
+		replay.setVersionRange(minVersion, maxVersion);
+		replay.setVerify(verify, verifyCache, serverName);
+		if(!certFile.empty())
+			replay.setClientCert(certFile, keyFile.empty() ? certFile : keyFile);
+		bool ok = replay.load(replayFile.c_str()) && replay.run(replaySpeed, replayCopies, replayThreads);
+		if(verifyCache)
+			delete verifyCache;
+		CryptoLocks::printStats();
+		return ok ? 0 : -1;
+	}
+
+	// Run a benchmark instead of the echo exchange
+	if((benchHandshakes > 0) || (ktlsBytes > 0) || (earlyRequests > 0) || (verifyConnects > 0) || (hsWorkers > 0) || (bulkBytes > 0) || (poolRequests > 0) || (muxSeconds > 0) || (ctxConnects > 0)) {
+		Benchmark bench(host, port);
+		bench.setVerify(verify, verifyCache, serverName);
+		bench.setVersionRange(minVersion, maxVersion);
+		if(!certFile.empty())
+			bench.setClientCert(certFile, keyFile.empty() ? certFile : keyFile);
+		bool ok = false;
+		if(benchHandshakes > 0)
+			ok = bench.runProtocols(benchHandshakes, benchBytes);
+		else if(ktlsBytes > 0)
+			ok = bench.runKtls(ktlsBytes);
+		else if(earlyRequests > 0)
+			ok = bench.runEarlyData(earlyRequests, earlySize);
+		else if(hsWorkers > 0)
+			ok = bench.runHandshakes(hsWorkers, hsSeconds);
+		else if(bulkBytes > 0)
+			ok = bench.runBulk(bulkBytes, bulkConnections);
+		else if(poolRequests > 0)
+			ok = bench.runPool(poolRequests, poolWorkers);
+		else if(muxSeconds > 0)
+			ok = bench.runMux(muxSeconds);
+		else if(ctxConnects > 0)
+			ok = bench.runContext(ctxConnects, ctxWorkers);
+		else
+			ok = bench.runVerify(verifyConnects);
+		if(verifyCache) {
+			verifyCache->printStats();
+			delete verifyCache;
+		}
+		CryptoLocks::printStats();
+		return ok ? 0 : -1;
+	}
+
 	// Init and run the client
 	SSLClient* cl = new SSLClient();
-	if(!cl->initSocket("127.0.0.1", 443)) {
+	cl->setVerbose(verbose);
+	cl->setVersionRange(minVersion, maxVersion);
+	cl->setVerify(verify, verifyCache);
+	cl->setTimeouts(connectTimeout, handshakeTimeout);
+	if(!serverName.empty())
+		cl->setServerName(serverName);
+	if(!certFile.empty())
+		cl->setClientCert(certFile, keyFile.empty() ? certFile : keyFile);
+	if(!cl->initSocket(host, port)) {
 		delete cl;
 		return -1;
 	}
@@ -49,7 +260,7 @@ int main (int argc, const char * argv[])
 	int i = 0;
 	char hi[3] = "hi";
 	while(cl->isClientRunning()) {
-		cl->readData();
+		cl->serviceSocket(CLIENT_POLL_MS);
 		if(i < 3) {
 			cl->writeData(hi, sizeof(hi));
 			i++;
@@ -57,6 +268,10 @@ int main (int argc, const char * argv[])
 	}
 
 	delete cl;
+	if(verifyCache)
+		delete verifyCache;
+	CryptoLocks::printStats();
+	CryptoLocks::uninstall();
 
 	return 0;
 }
@@ -0,0 +1,218 @@
+/**
+   ssltests
+   CryptoLocks.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "CryptoLocks.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+CryptoLocks::PaddedLock* CryptoLocks::locks = NULL;
+int CryptoLocks::numLocks = 0;
+int CryptoLocks::kind = CRYPTO_LOCKS_MUTEX;
+bool CryptoLocks::counting = false;
+
+/**
+ * Install
+ * Create the locks and register the callbacks. Call before OpenSSL is used from a second thread
+ *
+ * @param lockKind CRYPTO_LOCKS_MUTEX, CRYPTO_LOCKS_RWLOCK or CRYPTO_LOCKS_SPIN
+ * @param countContention Count acquisitions and contention per lock id, see printStats()
+ * @return True on success
+ */
+bool CryptoLocks::install(int lockKind, bool countContention) {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if(locks)
+		return true;
+
+	kind = lockKind;
+	counting = countContention;
+	numLocks = CRYPTO_num_locks();
+
+	void* mem = NULL;
+	if(posix_memalign(&mem, CRYPTO_LOCKS_CACHE_LINE, numLocks * sizeof(PaddedLock)) != 0) {
+		printf("CryptoLocks: Could not allocate %i locks\n", numLocks);
+		return false;
+	}
+	locks = (PaddedLock*)mem;
+	memset(locks, 0, numLocks * sizeof(PaddedLock));
+	for(int i = 0; i < numLocks; i++) {
+		if(kind == CRYPTO_LOCKS_RWLOCK)
+			pthread_rwlock_init(&locks[i].lock.rwlock, NULL);
+		else
+			pthread_mutex_init(&locks[i].lock.mutex, NULL);
+	}
+
+	CRYPTO_THREADID_set_callback(threadIdCallback);
+	CRYPTO_set_locking_callback(lockingCallback);
+	return true;
+#else
+	// Nothing to do, the library has its own locks
+	if(countContention)
+		printf("CryptoLocks: %s locks internally, no lock statistics\n", OPENSSL_VERSION_TEXT);
+	return true;
+#endif
+}
+
+/**
+ * Uninstall
+ * Unregister the callbacks and free the locks. No other thread may be using OpenSSL
+ */
+void CryptoLocks::uninstall() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if(!locks)
+		return;
+
+	CRYPTO_set_locking_callback(NULL);
+	for(int i = 0; i < numLocks; i++) {
+		if(kind == CRYPTO_LOCKS_RWLOCK)
+			pthread_rwlock_destroy(&locks[i].lock.rwlock);
+		else
+			pthread_mutex_destroy(&locks[i].lock.mutex);
+	}
+	free(locks);
+	locks = NULL;
+	numLocks = 0;
+#endif
+}
+
+/**
+ * Print Stats
+ * Dump the CRYPTO_LOCKS_TOP lock ids with the most contention, if counting
+ */
+void CryptoLocks::printStats() {
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if(!locks || !counting)
+		return;
+
+	// Sorted by contention, then by use
+	std::vector<std::pair<std::pair<unsigned long, unsigned long>, int> > order;
+	unsigned long acquired = 0, contended = 0;
+	for(int i = 0; i < numLocks; i++) {
+		Lock* l = &locks[i].lock;
+		acquired += l->acquired;
+		contended += l->contended;
+		if(l->acquired > 0)
+			order.push_back(std::make_pair(std::make_pair(l->contended, l->acquired), i));
+	}
+	std::sort(order.rbegin(), order.rend());
+
+	printf("CryptoLocks: %s locks, %lu acquisitions, %lu contended (%.2f%%)\n", kindName(kind), acquired, contended,
+		acquired ? (100.0 * contended) / acquired : 0.0);
+	for(unsigned int i = 0; (i < order.size()) && (i < CRYPTO_LOCKS_TOP); i++) {
+		Lock* l = &locks[order[i].second].lock;
+		printf("  %-16s %10lu acquired %10lu contended (%6.2f%%)", CRYPTO_get_lock_name(order[i].second),
+			l->acquired, l->contended, (100.0 * l->contended) / l->acquired);
+		if(kind == CRYPTO_LOCKS_SPIN)
+			printf(" %10lu parked", l->parked);
+		printf("\n");
+	}
+#endif
+}
+
+int CryptoLocks::kindFromName(const char* name) {
+	if(strcmp(name, "mutex") == 0)
+		return CRYPTO_LOCKS_MUTEX;
+	if(strcmp(name, "rwlock") == 0)
+		return CRYPTO_LOCKS_RWLOCK;
+	if(strcmp(name, "spin") == 0)
+		return CRYPTO_LOCKS_SPIN;
+	return -1;
+}
+
+const char* CryptoLocks::kindName(int lockKind) {
+	switch(lockKind) {
+		case CRYPTO_LOCKS_RWLOCK:
+			return "rwlock";
+		case CRYPTO_LOCKS_SPIN:
+			return "spin";
+		default:
+			return "mutex";
+	}
+}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+/**
+ * Lock Mutex
+ * Take a mutex or spin lock, counting contention. Spin locks retry for a while before sleeping, OpenSSL holds
+ * most of its locks for a few instructions (a reference count, a list insert)
+ */
+void CryptoLocks::lockMutex(Lock* l) {
+	if(pthread_mutex_trylock(&l->mutex) == 0)
+		return;
+	if(counting)
+		__sync_fetch_and_add(&l->contended, 1);
+
+	if(kind == CRYPTO_LOCKS_SPIN) {
+		for(int i = 0; i < CRYPTO_LOCKS_SPIN_COUNT; i++) {
+#if defined(__i386__) || defined(__x86_64__)
+			__asm__ __volatile__("pause");
+#endif
+			if(pthread_mutex_trylock(&l->mutex) == 0)
+				return;
+		}
+		if(counting)
+			__sync_fetch_and_add(&l->parked, 1);
+	}
+	pthread_mutex_lock(&l->mutex);
+}
+
+/**
+ * Locking Callback
+ * Called by OpenSSL around every access to shared state. type is the CRYPTO lock id
+ */
+void CryptoLocks::lockingCallback(int mode, int type, const char* file, int line) {
+	Lock* l = &locks[type].lock;
+
+	if(!(mode & CRYPTO_LOCK)) {
+		if(kind == CRYPTO_LOCKS_RWLOCK)
+			pthread_rwlock_unlock(&l->rwlock);
+		else
+			pthread_mutex_unlock(&l->mutex);
+		return;
+	}
+
+	if(counting)
+		__sync_fetch_and_add(&l->acquired, 1);
+
+	if(kind != CRYPTO_LOCKS_RWLOCK) {
+		lockMutex(l);
+	} else if(mode & CRYPTO_READ) {
+		if(pthread_rwlock_tryrdlock(&l->rwlock) != 0) {
+			if(counting)
+				__sync_fetch_and_add(&l->contended, 1);
+			pthread_rwlock_rdlock(&l->rwlock);
+		}
+	} else {
+		if(pthread_rwlock_trywrlock(&l->rwlock) != 0) {
+			if(counting)
+				__sync_fetch_and_add(&l->contended, 1);
+			pthread_rwlock_wrlock(&l->rwlock);
+		}
+	}
+}
+
+/**
+ * Thread ID Callback
+ * Error queues and the RNG are kept per thread, keyed by this
+ */
+void CryptoLocks::threadIdCallback(CRYPTO_THREADID* id) {
+	CRYPTO_THREADID_set_numeric(id, (unsigned long)pthread_self());
+}
+#endif
@@ -0,0 +1,82 @@
+/**
+   ssltests
+   CryptoLocks.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _cryptolocks_h_
+#define _cryptolocks_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <pthread.h>
+
+#include <openssl/crypto.h>
+
+#define CRYPTO_LOCKS_MUTEX 0 // Plain mutex per lock id, reads and writes alike
+#define CRYPTO_LOCKS_RWLOCK 1 // Reader/writer lock, CRYPTO_READ holders run side by side
+#define CRYPTO_LOCKS_SPIN 2 // Mutex tried CRYPTO_LOCKS_SPIN_COUNT times before the thread sleeps on it
+#define CRYPTO_LOCKS_NAMES "mutex, rwlock, spin"
+#define CRYPTO_LOCKS_SPIN_COUNT 200 // Lock attempts before a spinning thread parks
+#define CRYPTO_LOCKS_CACHE_LINE 64 // Locks are padded and aligned to this so neighbours don't share a line
+#define CRYPTO_LOCKS_TOP 10 // Hottest lock ids printed by printStats()
+
+/**
+ * Crypto Locks
+ * The locking and thread id callbacks OpenSSL 1.0 needs before it is used from more than one thread. Without
+ * them its shared state (session caches, reference counts, the RNG, error queues) is unprotected. There is one
+ * lock per CRYPTO lock id, each on cache lines of its own so threads working different ids don't bounce a line
+ * between cores. Optionally every lock counts how often it was taken and how often it was already held, to
+ * show which of OpenSSL's locks are hot under load.
+ *
+ * OpenSSL 1.1 and newer lock internally and ignore these callbacks, install() does nothing there.
+ */
+class CryptoLocks {
+private:
+	struct Lock {
+		pthread_mutex_t mutex;
+		pthread_rwlock_t rwlock;
+		unsigned long acquired;
+		unsigned long contended; // Already held when asked for
+		unsigned long parked; // Spin locks only: still held after spinning
+	};
+
+	struct PaddedLock {
+		Lock lock;
+		char pad[CRYPTO_LOCKS_CACHE_LINE - (sizeof(Lock) % CRYPTO_LOCKS_CACHE_LINE)];
+	};
+
+	static PaddedLock* locks;
+	static int numLocks;
+	static int kind;
+	static bool counting;
+
+private:
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	static void lockMutex(Lock* l);
+	static void lockingCallback(int mode, int type, const char* file, int line);
+	static void threadIdCallback(CRYPTO_THREADID* id);
+#endif
+
+public:
+	static bool install(int lockKind, bool countContention);
+	static void uninstall();
+	static void printStats();
+
+	static int kindFromName(const char* name);
+	static const char* kindName(int lockKind);
+};
+
+#endif
@@ -0,0 +1,94 @@
+/**
+   ssltests
+   KeyProtocol.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _keyprotocol_h_
+#define _keyprotocol_h_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Key Protocol
+ * Wire format spoken between the keyless SSLServer (KeylessClient) and the key server over a Unix domain socket.
+ *
+ * Every frame is an 8 byte header followed by len bytes of payload, all integers in network byte order:
+ *   uint32 id      Chosen by the requester, echoed back in the response. Responses may arrive in any order
+ *   uint8  op      Request: KEYOP_*. Response: KEYSTATUS_*
+ *   uint8  arg     Request: RSA padding mode. Response: unused
+ *   uint16 len     Payload length (at most KEYPROTO_MAX_PAYLOAD)
+ *
+ * Requests are pipelined: a requester may have any number outstanding on one socket, and both sides coalesce
+ * whatever frames are ready into a single write.
+ *
+ * Whoever can connect gets signatures and decrypts with the server's key, and whoever listens sees premaster
+ * secrets. The key server creates its socket mode 0600 in a directory only its user can replace it in, and
+ * KeylessClient only talks to a key server run by the same user (or root).
+ */
+
+#define KEYSERVER_SOCKET_DIR "/tmp/ssltests-keyserver" // Created mode 0700 for the default socket
+#define KEYSERVER_SOCKET KEYSERVER_SOCKET_DIR "/keyserver.sock"
+
+#define KEYPROTO_HEADER_LEN 8
+#define KEYPROTO_MAX_PAYLOAD 1024
+
+// Request ops
+#define KEYOP_RSA_DECRYPT 1 // RSA_private_decrypt(payload, arg)
+#define KEYOP_RSA_SIGN 2 // RSA_private_encrypt(payload, arg)
+#define KEYOP_ECDSA_SIGN 3 // ECDSA_sign(payload), response is a DER encoded signature
+
+// Response status
+#define KEYSTATUS_OK 0
+#define KEYSTATUS_ERROR 1
+
+static inline void keyproto_pack_header(unsigned char* buf, uint32_t id, uint8_t op, uint8_t arg, uint16_t len) {
+	buf[0] = (id >> 24) & 0xFF;
+	buf[1] = (id >> 16) & 0xFF;
+	buf[2] = (id >> 8) & 0xFF;
+	buf[3] = id & 0xFF;
+	buf[4] = op;
+	buf[5] = arg;
+	buf[6] = (len >> 8) & 0xFF;
+	buf[7] = len & 0xFF;
+}
+
+static inline void keyproto_unpack_header(const unsigned char* buf, uint32_t* id, uint8_t* op, uint8_t* arg, uint16_t* len) {
+	*id = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+	*op = buf[4];
+	*arg = buf[5];
+	*len = (uint16_t)((buf[6] << 8) | buf[7]);
+}
+
+/**
+ * Length of the frame at the start of a receive buffer, once all of it has arrived
+ *
+ * @param avail Bytes in buf
+ * @return Header plus payload length, 0 if the frame isn't complete yet, -1 if its header announces more than
+ * KEYPROTO_MAX_PAYLOAD (the peer isn't speaking this protocol, drop the connection)
+ */
+static inline int keyproto_frame_length(const unsigned char* buf, size_t avail) {
+	if(avail < KEYPROTO_HEADER_LEN)
+		return 0;
+	unsigned int len = ((unsigned int)buf[6] << 8) | buf[7];
+	if(len > KEYPROTO_MAX_PAYLOAD)
+		return -1;
+	if(avail < KEYPROTO_HEADER_LEN + len)
+		return 0;
+	return KEYPROTO_HEADER_LEN + len;
+}
+
+#endif
@@ -0,0 +1,103 @@
+/**
+   ssltests
+   StreamFrame.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _streamframe_h_
+#define _streamframe_h_
+
+#include <string.h>
+
+#include <openssl/ssl.h>
+
+/**
+ * Stream Frame
+ * Framing shared by the client and server for carrying many independent streams over one TLS connection. A
+ * client that offers MUX_ALPN and gets it selected speaks only frames from then on:
+ *
+ *   stream id (4 bytes) | flags (1 byte) | payload length (3 bytes) | payload
+ *
+ * all big endian. Clients number their streams 1, 3, 5... and a stream exists from its first frame. The server
+ * echoes each stream's data back on the same stream and answers its FIN with a FIN once the echo is out.
+ *
+ * Flow control is per stream and per direction: a sender may have at most MUX_INITIAL_WINDOW payload bytes the
+ * receiver hasn't credited back yet. The receiver credits bytes once it is done with them (read by the
+ * application, echoed by the server) with a MUX_FLAG_WINDOW frame whose length field is the credit. One slow
+ * stream therefore stalls only itself, never the connection.
+ */
+
+#define MUX_ALPN "ssltests-mux/1"
+#define MUX_HEADER_SIZE 8
+#define MUX_MAX_PAYLOAD (16384 - MUX_HEADER_SIZE) // A header and full payload fill exactly one TLS record
+#define MUX_INITIAL_WINDOW 65536 // Uncredited payload bytes a sender may have out per stream
+#define MUX_MAX_STREAMS 1024 // Open streams per connection, the server resets new ones beyond this
+#define MUX_FLAG_FIN 0x01 // Sender is done with the stream, comes after its last data
+#define MUX_FLAG_WINDOW 0x02 // Window update, no payload: length is the credit granted
+#define MUX_FLAG_RESET 0x04 // Stream aborted, drop its state
+
+struct MuxFrameHeader {
+	unsigned int stream;
+	unsigned char flags;
+	unsigned int length;
+};
+
+static inline void mux_encode_header(unsigned char* out, unsigned int stream, unsigned char flags, unsigned int length) {
+	out[0] = (stream >> 24) & 0xff;
+	out[1] = (stream >> 16) & 0xff;
+	out[2] = (stream >> 8) & 0xff;
+	out[3] = stream & 0xff;
+	out[4] = flags;
+	out[5] = (length >> 16) & 0xff;
+	out[6] = (length >> 8) & 0xff;
+	out[7] = length & 0xff;
+}
+
+static inline void mux_decode_header(const unsigned char* in, MuxFrameHeader* h) {
+	h->stream = ((unsigned int)in[0] << 24) | ((unsigned int)in[1] << 16) | ((unsigned int)in[2] << 8) | in[3];
+	h->flags = in[4];
+	h->length = ((unsigned int)in[5] << 16) | ((unsigned int)in[6] << 8) | in[7];
+}
+
+/**
+ * Append a frame to a send buffer
+ */
+template <class Buffer>
+static inline void mux_append_frame(Buffer& out, unsigned int stream, unsigned char flags, const char* payload, unsigned int length) {
+	unsigned char header[MUX_HEADER_SIZE];
+	mux_encode_header(header, stream, flags, length);
+	out.insert(out.end(), (const char*)header, (const char*)header + MUX_HEADER_SIZE);
+	if(payload && length)
+		out.insert(out.end(), payload, payload + length);
+}
+
+/**
+ * ALPN select callback for servers: picks MUX_ALPN when the client offers it, otherwise no protocol (a plain
+ * echo connection)
+ */
+static inline int mux_alpn_select(SSL* ssl, const unsigned char** out, unsigned char* outlen, const unsigned char* in,
+	unsigned int inlen, void* arg) {
+	unsigned int len = strlen(MUX_ALPN);
+	for(unsigned int i = 0; i < inlen; i += in[i] + 1) {
+		if((in[i] == len) && (i + 1 + len <= inlen) && (memcmp(in + i + 1, MUX_ALPN, len) == 0)) {
+			*out = in + i + 1;
+			*outlen = (unsigned char)len;
+			return SSL_TLSEXT_ERR_OK;
+		}
+	}
+	return SSL_TLSEXT_ERR_NOACK;
+}
+
+#endif
@@ -0,0 +1,149 @@
+/**
+   ssltests
+   TlsVersion.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _tlsversion_h_
+#define _tlsversion_h_
+
+#include <string.h>
+
+#include <openssl/ssl.h>
+
+/**
+ * TLS Version
+ * Protocol version ranges shared by the client and server. Both create their contexts with the version flexible
+ * method and then narrow it to [min, max] here, so a build against an OpenSSL that knows TLS 1.2/1.3 negotiates
+ * the best common version (AEAD ciphers, 1-RTT handshakes with 1.3) while older builds keep working.
+ *
+ * Versions are the wire values (TLS1_VERSION etc). 0 means no bound on that side, which keeps the library's
+ * own minimum and security level; only an explicit minimum below TLS 1.2 lowers them. OpenSSL 1.0's minimum
+ * is SSLv3, so there no lower bound means TLS 1.0.
+ */
+
+#ifndef TLS1_1_VERSION
+#define TLS1_1_VERSION 0x0302
+#endif
+#ifndef TLS1_2_VERSION
+#define TLS1_2_VERSION 0x0303
+#endif
+#ifndef TLS1_3_VERSION
+#define TLS1_3_VERSION 0x0304
+#endif
+
+#define TLSVERSION_NAMES "ssl3, tls1, tls1.1, tls1.2, tls1.3"
+#define TLS_DEFAULT_CIPHERS "DEFAULT" // The library's own list, its security level decides what is too weak
+#define TLS_LEGACY_CIPHERS "ALL" // Everything, for ranges explicitly reaching below TLS 1.2
+
+static inline const SSL_METHOD* tls_server_method() {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return TLS_server_method();
+#else
+	return SSLv23_server_method();
+#endif
+}
+
+static inline const SSL_METHOD* tls_client_method() {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return TLS_client_method();
+#else
+	return SSLv23_client_method();
+#endif
+}
+
+/**
+ * Parse a version name
+ *
+ * @return The version, -1 if the name isn't one of TLSVERSION_NAMES
+ */
+static inline int tls_version_from_name(const char* name) {
+	if(strcmp(name, "ssl3") == 0)
+		return SSL3_VERSION;
+	if(strcmp(name, "tls1") == 0)
+		return TLS1_VERSION;
+	if(strcmp(name, "tls1.1") == 0)
+		return TLS1_1_VERSION;
+	if(strcmp(name, "tls1.2") == 0)
+		return TLS1_2_VERSION;
+	if(strcmp(name, "tls1.3") == 0)
+		return TLS1_3_VERSION;
+	return -1;
+}
+
+static inline const char* tls_version_name(int version) {
+	switch(version) {
+		case SSL3_VERSION: return "ssl3";
+		case TLS1_VERSION: return "tls1";
+		case TLS1_1_VERSION: return "tls1.1";
+		case TLS1_2_VERSION: return "tls1.2";
+		case TLS1_3_VERSION: return "tls1.3";
+		default: return "unknown";
+	}
+}
+
+/**
+ * Cipher list for a range starting at minVersion: the library default unless old versions were asked for
+ */
+static inline const char* tls_cipher_list(int minVersion) {
+	return (minVersion && (minVersion < TLS1_2_VERSION)) ? TLS_LEGACY_CIPHERS : TLS_DEFAULT_CIPHERS;
+}
+
+/**
+ * Limit ctx to versions in [minVersion, maxVersion]
+ *
+ * @return False if the range is empty or this OpenSSL can't speak any version in it
+ */
+static inline bool tls_set_version_range(SSL_CTX* ctx, int minVersion, int maxVersion) {
+	if(minVersion && maxVersion && (minVersion > maxVersion))
+		return false;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	if(!SSL_CTX_set_min_proto_version(ctx, minVersion) || !SSL_CTX_set_max_proto_version(ctx, maxVersion))
+		return false;
+
+	// Newer libraries refuse pre TLS 1.2 handshakes at the default security level
+	if(minVersion && (minVersion < TLS1_2_VERSION))
+		SSL_CTX_set_security_level(ctx, 0);
+	return true;
+#else
+	// Older libraries only have per version opt outs. Versions they don't know can't be negotiated anyway.
+	// Their own minimum is SSLv3, so no bound means TLS 1.0 here and SSLv3 only when asked for by name
+	if(!minVersion)
+		minVersion = (maxVersion == SSL3_VERSION) ? SSL3_VERSION : TLS1_VERSION;
+	struct { int version; long op; } ops[] = {
+		{ SSL3_VERSION, SSL_OP_NO_SSLv3 },
+		{ TLS1_VERSION, SSL_OP_NO_TLSv1 },
+#ifdef SSL_OP_NO_TLSv1_1
+		{ TLS1_1_VERSION, SSL_OP_NO_TLSv1_1 },
+#endif
+#ifdef SSL_OP_NO_TLSv1_2
+		{ TLS1_2_VERSION, SSL_OP_NO_TLSv1_2 },
+#endif
+	};
+	long opts = SSL_OP_NO_SSLv2;
+	bool any = false;
+	for(unsigned int i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if((ops[i].version < minVersion) || (maxVersion && (ops[i].version > maxVersion)))
+			opts |= ops[i].op;
+		else
+			any = true;
+	}
+	SSL_CTX_set_options(ctx, opts);
+	return any;
+#endif
+}
+
+#endif
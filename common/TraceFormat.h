@@ -0,0 +1,97 @@
+/**
+   ssltests
+   TraceFormat.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _traceformat_h_
+#define _traceformat_h_
+
+#include <string.h>
+
+/**
+ * Trace Format
+ * File written by the server's TraceRecorder and replayed by the client's TraceReplay: the application messages
+ * of every connection, with their timing and size and optionally their plaintext. A file header
+ *
+ *   magic "SSLTRC01" (8 bytes) | flags (4) | connections (4) | records (8)
+ *
+ * is followed by one record per event in the order they happened:
+ *
+ *   time (8 bytes) | connection (4) | length (4) | type (1) | reserved (3) | payload
+ *
+ * all big endian. time is microseconds since recording started, connection numbers the connections from 1 in the
+ * order they completed the handshake. The payload (length bytes) is present only on message records of files
+ * with TRACE_FLAG_PAYLOAD. Counts in the header are written when the recorder closes, 0 means a file cut short by
+ * a crash; readers then go up to the last complete record.
+ */
+
+#define TRACE_MAGIC "SSLTRC01"
+#define TRACE_FILE_HEADER_SIZE 24
+#define TRACE_RECORD_HEADER_SIZE 20
+#define TRACE_FLAG_PAYLOAD 0x01 // Message records carry their plaintext
+#define TRACE_OPEN 1 // Handshake completed
+#define TRACE_CLIENT 2 // Message from the client, length bytes
+#define TRACE_SERVER 3 // Message from the server, length bytes
+#define TRACE_CLOSE 4 // Connection gone
+
+struct TraceRecordHeader {
+	unsigned long long time;
+	unsigned int connection;
+	unsigned int length;
+	unsigned char type;
+};
+
+static inline void trace_put32(unsigned char* out, unsigned int v) {
+	out[0] = (v >> 24) & 0xff;
+	out[1] = (v >> 16) & 0xff;
+	out[2] = (v >> 8) & 0xff;
+	out[3] = v & 0xff;
+}
+
+static inline unsigned int trace_get32(const unsigned char* in) {
+	return ((unsigned int)in[0] << 24) | ((unsigned int)in[1] << 16) | ((unsigned int)in[2] << 8) | in[3];
+}
+
+static inline void trace_encode_file_header(unsigned char* out, unsigned int flags, unsigned int connections, unsigned long long records) {
+	memcpy(out, TRACE_MAGIC, 8);
+	trace_put32(out + 8, flags);
+	trace_put32(out + 12, connections);
+	trace_put32(out + 16, (unsigned int)(records >> 32));
+	trace_put32(out + 20, (unsigned int)records);
+}
+
+static inline void trace_encode_record(unsigned char* out, const TraceRecordHeader& h) {
+	trace_put32(out, (unsigned int)(h.time >> 32));
+	trace_put32(out + 4, (unsigned int)h.time);
+	trace_put32(out + 8, h.connection);
+	trace_put32(out + 12, h.length);
+	out[16] = h.type;
+	out[17] = out[18] = out[19] = 0;
+}
+
+static inline void trace_decode_record(const unsigned char* in, TraceRecordHeader* h) {
+	h->time = ((unsigned long long)trace_get32(in) << 32) | trace_get32(in + 4);
+	h->connection = trace_get32(in + 8);
+	h->length = trace_get32(in + 12);
+	h->type = in[16];
+}
+
+// Whether a record of type carries a payload in a file with flags
+static inline bool trace_has_payload(unsigned int flags, unsigned char type) {
+	return (flags & TRACE_FLAG_PAYLOAD) && ((type == TRACE_CLIENT) || (type == TRACE_SERVER));
+}
+
+#endif
@@ -0,0 +1,209 @@
+/**
+   ssltests
+   VerifyCache.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "VerifyCache.h"
+
+#include <openssl/evp.h>
+
+VerifyCache::VerifyCache(int size, int ttlSecs) {
+	maxEntries = (size < 1) ? 1 : size;
+	ttl = ttlSecs;
+	generation = 0;
+
+	hits = 0;
+	misses = 0;
+	failures = 0;
+	expired = 0;
+}
+
+VerifyCache::~VerifyCache() {
+	std::list<Entry*>::iterator it;
+	for(it = lru.begin(); it != lru.end(); it++)
+		delete *it;
+}
+
+/**
+ * Verify
+ * Verify the chain in x509ctx, from the cache if it was verified recently. Meant to be called from a
+ * SSL_CTX_set_cert_verify_callback() callback in place of X509_verify_cert()
+ *
+ * @param hit Set to whether the cache answered
+ * @return 1 if the chain is trusted, 0 otherwise (same as X509_verify_cert())
+ */
+int VerifyCache::verify(X509_STORE_CTX* x509ctx, bool* hit) {
+	*hit = false;
+
+	std::string key;
+	if(chainKey(x509ctx, key) && chainCurrent(x509ctx) && lookup(key)) {
+		X509_STORE_CTX_set_error(x509ctx, X509_V_OK);
+		*hit = true;
+		return 1;
+	}
+
+	mutex.lock();
+	unsigned long started = generation;
+	mutex.unlock();
+
+	int ok = X509_verify_cert(x509ctx);
+
+	boost::lock_guard<boost::mutex> lock(mutex);
+	misses++;
+	if(ok <= 0) {
+		failures++;
+		return 0;
+	}
+	if(!key.empty() && (generation == started))
+		insert(key);
+	return ok;
+}
+
+/**
+ * Clear
+ * Forget every verified chain, for when the trust store or revocation lists they were checked against change.
+ * Verifications still running against the old ones aren't remembered either
+ */
+void VerifyCache::clear() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	std::list<Entry*>::iterator it;
+	for(it = lru.begin(); it != lru.end(); it++)
+		delete *it;
+	lru.clear();
+	entries.clear();
+	generation++;
+}
+
+/**
+ * Print Stats
+ * Dump how often verification was answered from the cache
+ */
+void VerifyCache::printStats() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	printf("VerifyCache: %lu hits, %lu full verifications (%lu failed), %lu expired, %u chains cached\n",
+		hits, misses, failures, expired, (unsigned int)entries.size());
+}
+
+/**
+ * Lookup
+ * @return True if key was verified less than ttl seconds ago. Counts the hit and refreshes its LRU position
+ */
+bool VerifyCache::lookup(const std::string& key) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	EntryMap::iterator it = entries.find(key);
+	if(it == entries.end())
+		return false;
+
+	Entry* e = it->second;
+	if(time(NULL) - e->verifiedAt >= ttl) {
+		lru.erase(e->lruPos);
+		entries.erase(it);
+		delete e;
+		expired++;
+		return false;
+	}
+
+	lru.splice(lru.begin(), lru, e->lruPos);
+	hits++;
+	return true;
+}
+
+/**
+ * Insert
+ * Remember a verified chain, evicting the least recently used one if full. Must be called with mutex held
+ */
+void VerifyCache::insert(const std::string& key) {
+	EntryMap::iterator it = entries.find(key);
+	if(it != entries.end()) {
+		it->second->verifiedAt = time(NULL);
+		return;
+	}
+
+	Entry* e = new Entry();
+	e->key = key;
+	e->verifiedAt = time(NULL);
+	lru.push_front(e);
+	e->lruPos = lru.begin();
+	entries[key] = e;
+
+	while(entries.size() > maxEntries) {
+		Entry* victim = lru.back();
+		lru.pop_back();
+		entries.erase(victim->key);
+		delete victim;
+	}
+}
+
+/**
+ * Chain Key
+ * SHA-256 of each certificate the server presented, leaf first, followed by the SNI name
+ */
+bool VerifyCache::chainKey(X509_STORE_CTX* x509ctx, std::string& key) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509* leaf = X509_STORE_CTX_get0_cert(x509ctx);
+	STACK_OF(X509)* chain = X509_STORE_CTX_get0_untrusted(x509ctx);
+#else
+	X509* leaf = x509ctx->cert;
+	STACK_OF(X509)* chain = x509ctx->untrusted;
+#endif
+	if(!leaf)
+		return false;
+
+	unsigned char md[EVP_MAX_MD_SIZE];
+	unsigned int mdLen = 0;
+	if(!X509_digest(leaf, EVP_sha256(), md, &mdLen))
+		return false;
+	key.assign((const char*)md, mdLen);
+
+	// The untrusted stack usually starts with the leaf again
+	for(int i = 0; chain && (i < sk_X509_num(chain)); i++) {
+		X509* cert = sk_X509_value(chain, i);
+		if(cert == leaf)
+			continue;
+		if(!X509_digest(cert, EVP_sha256(), md, &mdLen))
+			return false;
+		key.append((const char*)md, mdLen);
+	}
+
+	SSL* ssl = (SSL*)X509_STORE_CTX_get_ex_data(x509ctx, SSL_get_ex_data_X509_STORE_CTX_idx());
+	const char* name = ssl ? SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name) : NULL;
+	key.push_back('\0');
+	if(name)
+		key.append(name);
+
+	return true;
+}
+
+/**
+ * Chain Current
+ * @return True if no presented certificate has expired since the chain was cached
+ */
+bool VerifyCache::chainCurrent(X509_STORE_CTX* x509ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509* leaf = X509_STORE_CTX_get0_cert(x509ctx);
+	STACK_OF(X509)* chain = X509_STORE_CTX_get0_untrusted(x509ctx);
+#else
+	X509* leaf = x509ctx->cert;
+	STACK_OF(X509)* chain = x509ctx->untrusted;
+#endif
+	if(X509_cmp_current_time(X509_get_notAfter(leaf)) <= 0)
+		return false;
+	for(int i = 0; chain && (i < sk_X509_num(chain)); i++) {
+		if(X509_cmp_current_time(X509_get_notAfter(sk_X509_value(chain, i))) <= 0)
+			return false;
+	}
+	return true;
+}
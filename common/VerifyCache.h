@@ -0,0 +1,85 @@
+/**
+   ssltests
+   VerifyCache.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _verifycache_h_
+#define _verifycache_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <list>
+#include <time.h>
+
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#define VERIFY_CACHE_SIZE 1024 // Verified chains remembered
+#define VERIFY_CACHE_TTL 3600 // Seconds before a remembered chain is verified in full again
+
+/**
+ * Verify Cache
+ * Remembers server certificate chains that passed X509_verify_cert() so that reconnecting to the same server
+ * skips path building and every signature check. The key is the SHA-256 of each presented certificate plus the
+ * SNI name the client asked for, so a different chain, or the same chain for another host name, is verified in
+ * full. A hit still checks that no presented certificate has expired. Entries are dropped after
+ * VERIFY_CACHE_TTL seconds (bounding how long a revoked certificate or changed trust store goes unnoticed) and
+ * the least recently used one goes first once the cache is full. Safe to share between threads.
+ */
+class VerifyCache {
+private:
+	struct Entry {
+		std::string key;
+		time_t verifiedAt;
+		std::list<Entry*>::iterator lruPos;
+	};
+	typedef boost::unordered_map<std::string, Entry*> EntryMap;
+
+	size_t maxEntries;
+	int ttl;
+
+	boost::mutex mutex; // Guards everything below
+	EntryMap entries;
+	std::list<Entry*> lru; // Most recently used at the front
+	unsigned long generation; // Bumped by clear(), chains verified against what came before aren't remembered
+
+	// Statistics
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long failures;
+	unsigned long expired;
+
+private:
+	bool lookup(const std::string& key);
+	void insert(const std::string& key);
+
+	static bool chainKey(X509_STORE_CTX* x509ctx, std::string& key);
+	static bool chainCurrent(X509_STORE_CTX* x509ctx);
+
+public:
+	VerifyCache(int size, int ttlSecs);
+	~VerifyCache();
+
+	int verify(X509_STORE_CTX* x509ctx, bool* hit);
+	void clear();
+	void printStats();
+};
+
+#endif
@@ -0,0 +1,277 @@
+/**
+   ssltests
+   KeyServer.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "KeyServer.h"
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <openssl/pem.h>
+#include <openssl/ecdsa.h>
+#include <openssl/err.h>
+
+string KeyServer::keyPassword = KEYSERVER_PVKPWD;
+
+KeyServer::KeyServer() {
+	listenFd = -1;
+	pkey = NULL;
+	rsa = NULL;
+	ec = NULL;
+}
+
+KeyServer::~KeyServer() {
+	if(listenFd >= 0) {
+		close(listenFd);
+		unlink(path.c_str());
+	}
+
+	// Kick every client thread out of read() and wait for them to finish
+	clientMutex.lock();
+	list<int>::iterator it;
+	for(it = clientFds.begin(); it != clientFds.end(); it++)
+		shutdown(*it, SHUT_RDWR);
+	clientMutex.unlock();
+	clientThreads.join_all();
+
+	if(rsa)
+		RSA_free(rsa);
+	if(ec)
+		EC_KEY_free(ec);
+	if(pkey)
+		EVP_PKEY_free(pkey);
+}
+
+/**
+ * Init
+ * Load the private key and start listening on the Unix domain socket
+ *
+ * @param socketPath Path of the socket to create (a stale one of ours is replaced, see preparePath())
+ * @param keyFile PEM private key
+ * @param password Password for keyFile
+ * @return True if successful, false if otherwise
+ */
+bool KeyServer::init(string socketPath, string keyFile, string password) {
+	path = socketPath;
+	keyPassword = password;
+
+	BIO* kbio = BIO_new_file(keyFile.c_str(), "r");
+	if(!kbio) {
+		printf("KeyServer: Could not open key file %s\n", keyFile.c_str());
+		return false;
+	}
+	pkey = PEM_read_bio_PrivateKey(kbio, NULL, passwordCallback, NULL);
+	BIO_free(kbio);
+	if(!pkey) {
+		printf("KeyServer: Could not load private key\n");
+		return false;
+	}
+	rsa = EVP_PKEY_get1_RSA(pkey);
+	ec = EVP_PKEY_get1_EC_KEY(pkey);
+	ERR_clear_error();
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	if(!preparePath())
+		return false;
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listenFd < 0) {
+		printf("KeyServer: Could not create socket\n");
+		return false;
+	}
+
+	// The socket is created with mode 0600 so only this user can connect. No client threads run yet to see the umask
+	mode_t oldMask = umask(0177);
+	int bound = bind(listenFd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(oldMask);
+	if(bound < 0 || listen(listenFd, 64) < 0) {
+		printf("KeyServer: Could not bind %s\n", path.c_str());
+		close(listenFd);
+		listenFd = -1;
+		return false;
+	}
+
+	printf("KeyServer ready on %s (%s key)\n", path.c_str(), rsa ? "RSA" : (ec ? "EC" : "unsupported"));
+	return true;
+}
+
+/**
+ * Prepare Path
+ * Make sure no one else can take over the socket path: its directory (created mode 0700 for the default
+ * KEYSERVER_SOCKET) must belong to this user or root and, if others can write to it, be sticky so they can't
+ * unlink our socket. A socket of ours left over from an earlier run is removed, anything else there is refused
+ *
+ * @return True if the socket can be bound at path
+ */
+bool KeyServer::preparePath() {
+	size_t slash = path.rfind('/');
+	string dir = (slash == string::npos) ? "." : ((slash == 0) ? "/" : path.substr(0, slash));
+	if((path == KEYSERVER_SOCKET) && (mkdir(dir.c_str(), 0700) < 0) && (errno != EEXIST)) {
+		printf("KeyServer: Could not create %s\n", dir.c_str());
+		return false;
+	}
+
+	struct stat st;
+	if(lstat(dir.c_str(), &st) < 0 || !S_ISDIR(st.st_mode) || ((st.st_uid != geteuid()) && (st.st_uid != 0)) ||
+		((st.st_mode & (S_IWGRP | S_IWOTH)) && !(st.st_mode & S_ISVTX))) {
+		printf("KeyServer: %s must be a directory of this user or root that others can't replace files in\n", dir.c_str());
+		return false;
+	}
+
+	if(lstat(path.c_str(), &st) < 0)
+		return errno == ENOENT;
+	if(!S_ISSOCK(st.st_mode) || (st.st_uid != geteuid())) {
+		printf("KeyServer: %s exists and isn't a socket of ours, not replacing it\n", path.c_str());
+		return false;
+	}
+	return unlink(path.c_str()) == 0;
+}
+
+/**
+ * Run
+ * Accept's new clients (if any) and spawns a thread to serve each one
+ */
+void KeyServer::run() {
+	struct pollfd pfd;
+	pfd.fd = listenFd;
+	pfd.events = POLLIN;
+	if(poll(&pfd, 1, 500) <= 0)
+		return;
+
+	int fd = accept(listenFd, NULL, NULL);
+	if(fd < 0)
+		return;
+
+	clientMutex.lock();
+	clientFds.push_back(fd);
+	clientMutex.unlock();
+	clientThreads.create_thread(boost::bind(&KeyServer::serveClient, this, fd));
+
+	printf("KeyServer: New client connected\n");
+}
+
+/**
+ * Serve Client
+ * Read requests off a client socket, answer every complete one, and write the responses back in a single write
+ */
+void KeyServer::serveClient(int fd) {
+	vector<unsigned char> in, out;
+	unsigned char tmp[65536];
+	unsigned long requests = 0, batches = 0;
+
+	while(true) {
+		ssize_t r = read(fd, tmp, sizeof(tmp));
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0)
+			break;
+		in.insert(in.end(), tmp, tmp + r);
+
+		// Process every complete frame that arrived
+		size_t off = 0;
+		int flen = 0;
+		out.clear();
+		while((flen = keyproto_frame_length(&in[0] + off, in.size() - off)) > 0) {
+			uint32_t id;
+			uint8_t op, arg;
+			uint16_t len;
+			keyproto_unpack_header(&in[off], &id, &op, &arg, &len);
+
+			processRequest(id, op, arg, &in[off + KEYPROTO_HEADER_LEN], len, out);
+			requests++;
+			off += flen;
+		}
+		if(flen < 0) {
+			printf("KeyServer: Oversized request, dropping the client\n");
+			break;
+		}
+		in.erase(in.begin(), in.begin() + off);
+
+		if(out.empty())
+			continue;
+		batches++;
+
+		size_t sent = 0;
+		while(sent < out.size()) {
+			ssize_t w = write(fd, &out[sent], out.size() - sent);
+			if(w < 0 && errno == EINTR)
+				continue;
+			if(w <= 0)
+				break;
+			sent += w;
+		}
+		if(sent < out.size())
+			break;
+	}
+
+	clientMutex.lock();
+	clientFds.remove(fd);
+	clientMutex.unlock();
+	close(fd);
+
+	printf("KeyServer: Client disconnected after %lu requests in %lu batches\n", requests, batches);
+}
+
+/**
+ * Process Request
+ * Perform one private key operation and append its response frame to out
+ */
+void KeyServer::processRequest(uint32_t id, uint8_t op, uint8_t arg, const unsigned char* data, uint16_t len, vector<unsigned char>& out) {
+	unsigned char result[KEYPROTO_MAX_PAYLOAD];
+	int r = -1;
+
+	switch(op) {
+		case KEYOP_RSA_DECRYPT:
+			if(rsa && (RSA_size(rsa) <= KEYPROTO_MAX_PAYLOAD))
+				r = RSA_private_decrypt(len, data, result, rsa, arg);
+			break;
+
+		case KEYOP_RSA_SIGN:
+			if(rsa && (RSA_size(rsa) <= KEYPROTO_MAX_PAYLOAD))
+				r = RSA_private_encrypt(len, data, result, rsa, arg);
+			break;
+
+		case KEYOP_ECDSA_SIGN:
+			if(ec && (ECDSA_size(ec) <= KEYPROTO_MAX_PAYLOAD)) {
+				unsigned int siglen = 0;
+				if(ECDSA_sign(0, data, len, result, &siglen, ec) > 0)
+					r = siglen;
+			}
+			break;
+
+		default:
+			break;
+	}
+	if(r < 0)
+		ERR_clear_error();
+
+	size_t off = out.size();
+	uint16_t rlen = (r > 0) ? (uint16_t)r : 0;
+	out.resize(off + KEYPROTO_HEADER_LEN + rlen);
+	keyproto_pack_header(&out[off], id, (r >= 0) ? KEYSTATUS_OK : KEYSTATUS_ERROR, 0, rlen);
+	if(rlen > 0)
+		memcpy(&out[off + KEYPROTO_HEADER_LEN], result, rlen);
+}
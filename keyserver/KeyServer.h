@@ -0,0 +1,80 @@
+/**
+   ssltests
+   KeyServer.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _keyserver_h_
+#define _keyserver_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+
+#include <boost/thread.hpp>
+
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+
+#include "../common/KeyProtocol.h"
+
+#define KEYSERVER_PVKFILE "../certs/s_ssl.pvk"
+#define KEYSERVER_PVKPWD "1234"
+
+using namespace std;
+
+/**
+ * Key Server
+ * Holds the private key on behalf of a keyless SSLServer and answers KeyProtocol requests on a Unix domain socket.
+ * Each client socket is served by its own thread, which processes every complete request from a read before
+ * writing all of the responses back in one batch
+ */
+class KeyServer {
+private:
+	string path;
+	int listenFd;
+	EVP_PKEY* pkey;
+	RSA* rsa;
+	EC_KEY* ec;
+
+	boost::thread_group clientThreads;
+	list<int> clientFds;
+	boost::mutex clientMutex;
+
+	static string keyPassword;
+
+private:
+	bool preparePath();
+	void serveClient(int fd);
+	void processRequest(uint32_t id, uint8_t op, uint8_t arg, const unsigned char* data, uint16_t len, vector<unsigned char>& out);
+
+	static int passwordCallback(char *buf, int size, int rwflag, void *password) {
+		strncpy(buf, keyPassword.c_str(), size);
+		buf[size - 1] = '\0';
+		return(strlen(buf));
+	}
+
+public:
+	KeyServer();
+	~KeyServer();
+	bool init(string socketPath, string keyFile, string password);
+	void run();
+};
+
+#endif
@@ -0,0 +1,75 @@
+/**
+   ssltests
+   main.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+
+#include "KeyServer.h"
+
+bool canRun;
+
+// Handles an unix terminiation signals (Ctrl C)
+void sighandler(int sig) {
+	canRun = false;
+}
+
+int main (int argc, const char * argv[])
+{
+	// Register sighandler for terminiation signals:
+	signal(SIGABRT, &sighandler);
+	signal(SIGINT, &sighandler);
+	signal(SIGTERM, &sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	// Init SSL
+	if(!SSL_library_init()) {
+		printf("SSL library init failed\n");
+		return -1;
+	}
+
+	SSL_load_error_strings();
+	RAND_load_file("/dev/urandom", 1024); // Seed the PRNG
+
+	string socketPath = KEYSERVER_SOCKET, keyFile = KEYSERVER_PVKFILE, password = KEYSERVER_PVKPWD;
+	for(int i = 1; i < argc; i++) {
+		if((strcmp(argv[i], "-socket") == 0) && (i+1 < argc)) {
+			socketPath = argv[++i];
+		} else if((strcmp(argv[i], "-key") == 0) && (i+1 < argc)) {
+			keyFile = argv[++i];
+		} else if((strcmp(argv[i], "-pass") == 0) && (i+1 < argc)) {
+			password = argv[++i];
+		} else {
+			printf("Unknown option: %s\n", argv[i]);
+			printf("Usage: %s [-socket path] [-key file] [-pass password]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	// Init and run the key server
+	KeyServer* ks = new KeyServer();
+	canRun = ks->init(socketPath, keyFile, password);
+	while(canRun)
+		ks->run();
+	delete ks;
+
+	return 0;
+}
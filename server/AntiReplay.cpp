@@ -0,0 +1,111 @@
+/**
+   ssltests
+   AntiReplay.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "AntiReplay.h"
+
+AntiReplayCache::AntiReplayCache(int window) {
+	windowSecs = (window < 1) ? 1 : window;
+	rotatedAt = time(NULL);
+
+	accepted = 0;
+	replays = 0;
+	overflows = 0;
+}
+
+AntiReplayCache::~AntiReplayCache() {
+	printStats();
+}
+
+/**
+ * Attach
+ * Have ctx consult the cache before accepting early data. Early data itself is enabled separately with
+ * SSL_CTX_set_max_early_data()
+ *
+ * @param ctx Context to attach to. The cache must outlive it
+ * @return False if this OpenSSL has no early data support
+ */
+bool AntiReplayCache::attach(SSL_CTX* ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	SSL_CTX_set_allow_early_data_cb(ctx, allowEarlyDataCallback, this);
+	return true;
+#else
+	return false;
+#endif
+}
+
+/**
+ * Print Stats
+ * Dump how many 0-RTT attempts were let through or refused
+ */
+void AntiReplayCache::printStats() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	printf("AntiReplayCache: %lu early data accepted, %lu replays refused, %lu refused while full, %u randoms remembered (%i s window)\n",
+		accepted, replays, overflows, (unsigned int)(current.size() + previous.size()), windowSecs);
+}
+
+/**
+ * Check And Insert
+ * Remember a client random
+ *
+ * @return True if it hadn't been seen within the window and early data may be accepted
+ */
+bool AntiReplayCache::checkAndInsert(const unsigned char* random, size_t len) {
+	std::string key((const char*)random, len);
+	time_t now = time(NULL);
+
+	boost::lock_guard<boost::mutex> lock(mutex);
+
+	// Everything in previous is at least one window old once it rotates out
+	if(now - rotatedAt >= windowSecs) {
+		previous.swap(current);
+		current.clear();
+		if(now - rotatedAt >= 2 * windowSecs)
+			previous.clear();
+		rotatedAt = now;
+	}
+
+	if((current.find(key) != current.end()) || (previous.find(key) != previous.end())) {
+		replays++;
+		return false;
+	}
+	if(current.size() + previous.size() >= ANTIREPLAY_MAX_ENTRIES) {
+		overflows++;
+		return false;
+	}
+
+	current.insert(key);
+	accepted++;
+	return true;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/**
+ * Allow Early Data Callback
+ * Called while processing a ClientHello that offers early data on a resumable session
+ */
+int AntiReplayCache::allowEarlyDataCallback(SSL* ssl, void* arg) {
+	AntiReplayCache* cache = (AntiReplayCache*)arg;
+
+	unsigned char random[SSL3_RANDOM_SIZE];
+	size_t len = SSL_get_client_random(ssl, random, sizeof(random));
+	if(len == 0)
+		return 0;
+
+	return cache->checkAndInsert(random, len) ? 1 : 0;
+}
+#endif
@@ -0,0 +1,77 @@
+/**
+   ssltests
+   AntiReplay.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _antireplay_h_
+#define _antireplay_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <time.h>
+
+#include <boost/thread.hpp>
+#include <boost/unordered_set.hpp>
+
+#include <openssl/ssl.h>
+
+#define ANTIREPLAY_MAX_ENTRIES 1000000 // Early data is refused outright once this many ClientHellos are remembered
+
+/**
+ * Anti Replay Cache
+ * Decides whether a TLS 1.3 ClientHello may have its early data (0-RTT) accepted. Session tickets stay stateless
+ * (SSL_OP_NO_ANTI_REPLAY turns off OpenSSL's single use tickets, which would need a shared session cache), so a
+ * captured ClientHello with early data could be replayed. The cache remembers the client random of every
+ * ClientHello offering early data for at least windowSecs and refuses early data from a random it has seen.
+ * OpenSSL already refuses early data from tickets whose age is off by more than a few seconds, so a replay older
+ * than the window fails that check instead.
+ *
+ * Entries live in two generations that rotate every windowSecs, so expiry is O(1) and memory is bounded by
+ * two windows' worth of 0-RTT attempts (capped at ANTIREPLAY_MAX_ENTRIES, beyond which it fails closed).
+ * Refused early data isn't lost, the client resends it after the handshake.
+ */
+class AntiReplayCache {
+private:
+	typedef boost::unordered_set<std::string> RandomSet;
+
+	int windowSecs;
+	boost::mutex mutex; // Guards everything below
+	RandomSet current;
+	RandomSet previous;
+	time_t rotatedAt;
+
+	// Statistics
+	unsigned long accepted;
+	unsigned long replays;
+	unsigned long overflows;
+
+private:
+	bool checkAndInsert(const unsigned char* random, size_t len);
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	static int allowEarlyDataCallback(SSL* ssl, void* arg);
+#endif
+
+public:
+	AntiReplayCache(int window);
+	~AntiReplayCache();
+
+	bool attach(SSL_CTX* ctx);
+	void printStats();
+};
+
+#endif
@@ -0,0 +1,246 @@
+/**
+   ssltests
+   ClientAuth.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "ClientAuth.h"
+
+#include <vector>
+
+#include <openssl/pem.h>
+#include <openssl/err.h>
+
+ClientAuth::ClientAuth(std::string ca, std::string crl, bool requireCert, int cacheSize, int cacheTtl) : cache(cacheSize, cacheTtl) {
+	caFile = ca;
+	crlFile = crl;
+	required = requireCert;
+	revoked.reset(new RevokedSet());
+	epoch = 0;
+
+	verified = 0;
+	rejected = 0;
+	revokedRejected = 0;
+}
+
+ClientAuth::~ClientAuth() {
+	printStats();
+}
+
+/**
+ * Load CRL
+ * Build a new revocation set from crlFile (PEM, possibly several CRLs, or a single DER CRL) and swap it in.
+ * Each CRL must be signed by a certificate in the CA bundle. On failure the previous set stays in use.
+ * Either way contexts attached from now on read the CA bundle again, so sessions from before can't resume
+ *
+ * @return True if the new set was installed (or there is no CRL file)
+ */
+bool ClientAuth::loadCrl() {
+	mutex.lock();
+	epoch++;
+	mutex.unlock();
+
+	if(crlFile.empty())
+		return true;
+
+	std::vector<X509_CRL*> crls;
+	BIO* bio = BIO_new_file(crlFile.c_str(), "r");
+	if(!bio) {
+		printf("ClientAuth: Could not open CRL file %s\n", crlFile.c_str());
+		return false;
+	}
+	X509_CRL* crl;
+	while((crl = PEM_read_bio_X509_CRL(bio, NULL, NULL, NULL)) != NULL)
+		crls.push_back(crl);
+	if(crls.empty()) {
+		(void)BIO_reset(bio);
+		if((crl = d2i_X509_CRL_bio(bio, NULL)) != NULL)
+			crls.push_back(crl);
+	}
+	BIO_free(bio);
+	ERR_clear_error();
+
+	// CRL signers come from the CA bundle
+	STACK_OF(X509_INFO)* cas = NULL;
+	bio = BIO_new_file(caFile.c_str(), "r");
+	if(bio) {
+		cas = PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
+		BIO_free(bio);
+	}
+
+	RevokedPtr set(new RevokedSet());
+	bool ok = !crls.empty() && cas;
+	for(unsigned int i = 0; ok && (i < crls.size()); i++) {
+		X509_NAME* issuer = X509_CRL_get_issuer(crls[i]);
+
+		bool signedOk = false;
+		for(int c = 0; c < sk_X509_INFO_num(cas); c++) {
+			X509* ca = sk_X509_INFO_value(cas, c)->x509;
+			if(!ca || X509_NAME_cmp(X509_get_subject_name(ca), issuer) != 0)
+				continue;
+			EVP_PKEY* pkey = X509_get_pubkey(ca);
+			signedOk = pkey && (X509_CRL_verify(crls[i], pkey) > 0);
+			if(pkey)
+				EVP_PKEY_free(pkey);
+			if(signedOk)
+				break;
+		}
+		if(!signedOk) {
+			printf("ClientAuth: CRL %u in %s isn't signed by a CA in %s\n", i, crlFile.c_str(), caFile.c_str());
+			ok = false;
+			break;
+		}
+		if(X509_CRL_get_nextUpdate(crls[i]) && (X509_cmp_current_time(X509_CRL_get_nextUpdate(crls[i])) < 0))
+			printf("ClientAuth: Warning, CRL %u in %s is past its nextUpdate\n", i, crlFile.c_str());
+
+		STACK_OF(X509_REVOKED)* entries = X509_CRL_get_REVOKED(crls[i]);
+		for(int r = 0; entries && (r < sk_X509_REVOKED_num(entries)); r++) {
+			X509_REVOKED* rev = sk_X509_REVOKED_value(entries, r);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+			ASN1_INTEGER* serial = (ASN1_INTEGER*)X509_REVOKED_get0_serialNumber(rev);
+#else
+			ASN1_INTEGER* serial = rev->serialNumber;
+#endif
+			set->insert(revocationKey(issuer, serial));
+		}
+	}
+
+	for(unsigned int i = 0; i < crls.size(); i++)
+		X509_CRL_free(crls[i]);
+	if(cas)
+		sk_X509_INFO_pop_free(cas, X509_INFO_free);
+	if(!ok) {
+		printf("ClientAuth: Could not load CRLs from %s, keeping the previous revocation list\n", crlFile.c_str());
+		return false;
+	}
+
+	boost::lock_guard<boost::mutex> lock(mutex);
+	revoked = set;
+	printf("ClientAuth: %u revoked certificates loaded from %u CRL(s)\n", (unsigned int)set->size(), (unsigned int)crls.size());
+	return true;
+}
+
+/**
+ * Attach
+ * Request and verify client certificates on handshakes through ctx
+ *
+ * @param ctx Context to attach to. This object must outlive it
+ * @return True on success
+ */
+bool ClientAuth::attach(SSL_CTX* ctx) {
+	if(SSL_CTX_load_verify_locations(ctx, caFile.c_str(), NULL) <= 0) {
+		printf("ClientAuth: Could not load CA bundle %s\n", caFile.c_str());
+		return false;
+	}
+
+	// Tell clients which CAs we accept so they pick the right certificate
+	STACK_OF(X509_NAME)* names = SSL_load_client_CA_file(caFile.c_str());
+	if(names)
+		SSL_CTX_set_client_CA_list(ctx, names);
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | (required ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT : 0), NULL);
+	SSL_CTX_set_cert_verify_callback(ctx, verifyCallback, this);
+
+	// Sessions carry the verified client identity, resuming one needs a session id context. Sessions from
+	// before the last loadCrl() have another one and get a full handshake instead of skipping verification
+	char sidCtx[SSL_MAX_SID_CTX_LENGTH];
+	mutex.lock();
+	int sidLen = snprintf(sidCtx, sizeof(sidCtx), "ssltests/%lu", epoch);
+	mutex.unlock();
+	SSL_CTX_set_session_id_context(ctx, (const unsigned char*)sidCtx, sidLen);
+
+	return true;
+}
+
+/**
+ * Print Stats
+ * Dump verification outcomes and the fingerprint cache's hit rate
+ */
+void ClientAuth::printStats() {
+	mutex.lock();
+	printf("ClientAuth: %lu client certificates accepted, %lu rejected (%lu revoked), %u revoked serials loaded\n",
+		verified, rejected, revokedRejected, (unsigned int)revoked->size());
+	mutex.unlock();
+	cache.printStats();
+}
+
+/**
+ * Is Revoked
+ * One hash probe against the current revocation set
+ */
+bool ClientAuth::isRevoked(X509* cert) {
+	RevokedPtr set;
+	mutex.lock();
+	set = revoked;
+	mutex.unlock();
+
+	if(set->empty())
+		return false;
+	return set->find(revocationKey(X509_get_issuer_name(cert), X509_get_serialNumber(cert))) != set->end();
+}
+
+/**
+ * Revocation Key
+ * Canonical DER of the issuer name followed by the serial's content bytes
+ */
+std::string ClientAuth::revocationKey(X509_NAME* issuer, ASN1_INTEGER* serial) {
+	std::string key;
+	unsigned char* der = NULL;
+	int len = i2d_X509_NAME(issuer, &der);
+	if(len > 0) {
+		key.assign((const char*)der, len);
+		OPENSSL_free(der);
+	}
+	key.append((const char*)ASN1_STRING_data(serial), ASN1_STRING_length(serial));
+	return key;
+}
+
+/**
+ * Verify Callback
+ * Replaces X509_verify_cert() for client certificates: revocation first, then the fingerprint cache, then a
+ * full verification for chains the cache hasn't seen
+ */
+int ClientAuth::verifyCallback(X509_STORE_CTX* x509ctx, void* arg) {
+	ClientAuth* auth = (ClientAuth*)arg;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	X509* leaf = X509_STORE_CTX_get0_cert(x509ctx);
+	STACK_OF(X509)* chain = X509_STORE_CTX_get0_untrusted(x509ctx);
+#else
+	X509* leaf = x509ctx->cert;
+	STACK_OF(X509)* chain = x509ctx->untrusted;
+#endif
+
+	bool revoked = leaf && auth->isRevoked(leaf);
+	for(int i = 0; !revoked && chain && (i < sk_X509_num(chain)); i++)
+		revoked = auth->isRevoked(sk_X509_value(chain, i));
+	if(revoked) {
+		X509_STORE_CTX_set_error(x509ctx, X509_V_ERR_CERT_REVOKED);
+		boost::lock_guard<boost::mutex> lock(auth->mutex);
+		auth->rejected++;
+		auth->revokedRejected++;
+		return 0;
+	}
+
+	bool hit = false;
+	int ok = auth->cache.verify(x509ctx, &hit);
+
+	boost::lock_guard<boost::mutex> lock(auth->mutex);
+	if(ok > 0)
+		auth->verified++;
+	else
+		auth->rejected++;
+	return ok;
+}
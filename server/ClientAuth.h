@@ -0,0 +1,85 @@
+/**
+   ssltests
+   ClientAuth.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _clientauth_h_
+#define _clientauth_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_set.hpp>
+
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "../common/VerifyCache.h"
+
+/**
+ * Client Auth
+ * Mutual TLS: asks clients for a certificate and verifies it against a CA bundle. Chains that verified are
+ * remembered in a VerifyCache keyed by their fingerprints, so a client reconnecting with the same certificate
+ * skips path building and signature checks. Revocation is checked on every handshake, cached or not, against a
+ * hash set of (issuer, serial) pairs built from a CRL file, which costs one probe however long the CRL is.
+ * OpenSSL's own CRL checking stays off. The CRL can be reloaded while running (SIGHUP, see SSLServer::reload()).
+ * Resumed sessions skip certificate verification altogether, so every load also starts a new session epoch:
+ * contexts attached after it use a session id context of their own, and sessions and tickets issued before it
+ * fall back to a full handshake that checks the client against the current CA bundle and CRLs.
+ */
+class ClientAuth {
+private:
+	typedef boost::unordered_set<std::string> RevokedSet;
+	typedef boost::shared_ptr<RevokedSet> RevokedPtr;
+
+	std::string caFile;
+	std::string crlFile; // Empty for no revocation checking
+	bool required; // Fail handshakes without a client certificate
+	VerifyCache cache;
+
+	boost::mutex mutex; // Guards everything below
+	RevokedPtr revoked;
+	unsigned long epoch; // Bumped by every loadCrl(), part of the session id context
+
+	// Statistics
+	unsigned long verified;
+	unsigned long rejected;
+	unsigned long revokedRejected;
+
+private:
+	bool isRevoked(X509* cert);
+
+	static std::string revocationKey(X509_NAME* issuer, ASN1_INTEGER* serial);
+	static int verifyCallback(X509_STORE_CTX* x509ctx, void* arg);
+
+public:
+	ClientAuth(std::string ca, std::string crl, bool requireCert, int cacheSize, int cacheTtl);
+	~ClientAuth();
+
+	bool loadCrl();
+	bool attach(SSL_CTX* ctx);
+	void printStats();
+
+	// Chains verified before a reload may not pass against the CA bundle and CRLs loaded by it
+	void flushCache() {
+		cache.clear();
+	}
+};
+
+#endif
@@ -17,17 +17,35 @@
 */
 
 #include "Connection.h"
+#include "RenegotiationGuard.h"
+
+bool Connection::s_verbose = true;
+TraceRecorder* Connection::s_trace = NULL;
+boost::mutex Connection::s_statsMutex;
+unsigned long Connection::s_ktlsSend = 0;
+unsigned long Connection::s_ktlsRecv = 0;
+unsigned long Connection::s_userspace = 0;
 
 Connection::Connection(BIO* b, SSL* s) {
 	m_bio = b;
 	m_ssl = s;
 	m_connected = false;
 	m_thread = NULL;
+	m_handshakeDone = false;
+	m_ktlsFd = -1;
+	m_traceId = 0;
+	m_mux = false;
+
+	// Early data must be read with SSL_read_early_data() before anything else touches the handshake
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	m_earlyData = SSL_get_max_early_data(s) > 0;
+#else
+	m_earlyData = false;
+#endif
 }
 
 Connection::~Connection() {
-	if(m_bio)
-		BIO_free(m_bio);
+	// m_bio belongs to m_ssl since SSL_set_bio() and was freed with it in disconnect()
 	if(m_thread != NULL)
 		delete m_thread;
 }
@@ -51,8 +69,15 @@ void Connection::stop() {
 	m_runMutex.unlock();
 }
 
+// Wait for the thread to leave operator(), after stop() or once the client went away
+void Connection::join() {
+	if(m_thread != NULL)
+		m_thread->join();
+}
+
 void Connection::operator() () {
-	std::cout << "Connection thread spawned..\n";
+	if(s_verbose)
+		std::cout << "Connection thread spawned..\n";
 
 	bool connected = true;
 	// Thread must be spawned with m_connected as true
@@ -67,7 +92,21 @@ void Connection::operator() () {
 
 	// Main loop
 	while(connected) {
-		readData();
+		if(m_earlyData)
+			readEarlyData();
+		else
+			readData();
+		if(!m_handshakeDone && SSL_is_init_finished(m_ssl))
+			handshakeFinished();
+
+		// Drop clients that renegotiate more than RenegotiationGuard allows
+		if(RenegotiationGuard::refused(m_ssl)) {
+			if(s_verbose)
+				std::cout << "Renegotiation refused, dropping the client\n";
+			m_runMutex.lock();
+			m_connected = false;
+			m_runMutex.unlock();
+		}
 
 		// update connected state
 		m_runMutex.lock();
@@ -82,10 +121,16 @@ void Connection::operator() () {
 }
 
 void Connection::disconnect() {
-	std::cout << "Connection Disconnecting\n";
+	if(s_verbose)
+		std::cout << "Connection Disconnecting\n";
+	if(s_trace)
+		s_trace->closeConnection(m_traceId);
+
 	// Shutdown and Free SSL objects
 	SSL_shutdown(m_ssl);
 	SSL_free(m_ssl);
+	m_ssl = NULL;
+	m_bio = NULL;
 	m_runMutex.lock();
 	m_connected = false;
 	m_runMutex.unlock();
@@ -96,22 +141,25 @@ void Connection::readData() {
 	unsigned int bytesRead = 0, maxLen = 4096;
 	char *pData = new char[maxLen];
 
-	// Loop and grab all data on the wire
+	// Loop and grab all data on the wire, up to a full buffer
 	do {
 		bytesRead += r;
+		if(bytesRead == maxLen)
+			break;
 		r = SSL_read(m_ssl, pData+bytesRead, maxLen-bytesRead);
 	} while(r > 0);
 
 	// Check to see if the connection was closed
 	if((r == 0) || (SSL_get_shutdown(m_ssl) != 0)) {
-		std::cout << "Client closed the connection\n";
+		if(s_verbose)
+			std::cout << "Client closed the connection\n";
 		m_runMutex.lock();
 		m_connected = false;
 		m_runMutex.unlock();
 	}
 	
 	// If data was read, print it out and write it back
-	if(bytesRead > 0) {
+	if((bytesRead > 0) && s_verbose) {
 		std::cout << "Received " << bytesRead << " bytes from client:\n";
 		for(unsigned int i = 0; i < bytesRead; i++) {
 			printf("0x%X ", pData[i]);
@@ -121,19 +169,318 @@ void Connection::readData() {
 			printf("%c", pData[i]);
 		}
 		std::cout << "\n";
+	}
 
-		// Send the data back
+	// Settle the protocol before the first bytes are handled, they may have arrived with the handshake
+	if(!m_handshakeDone && SSL_is_init_finished(m_ssl))
+		handshakeFinished();
+
+	if(s_trace)
+		s_trace->message(m_traceId, true, pData, bytesRead);
+
+	// Send the data back
+	if((bytesRead > 0) && m_mux)
+		muxInput(pData, bytesRead);
+	else if(bytesRead > 0)
 		writeData(pData, bytesRead);
-	}
 
 	delete [] pData;
 }
 
+/**
+ * Mux Input
+ * Take in bytes of a multiplexed connection, act on every complete frame and send the echoes, window updates
+ * and FINs that result in one write. A client that breaks the framing or its flow control is dropped
+ */
+void Connection::muxInput(const char* pData, unsigned int len) {
+	std::vector<char> out;
+	size_t pos = 0;
+
+	m_muxIn.insert(m_muxIn.end(), pData, pData + len);
+	while(m_muxIn.size() - pos >= MUX_HEADER_SIZE) {
+		MuxFrameHeader h;
+		mux_decode_header((const unsigned char*)&m_muxIn[pos], &h);
+		unsigned int payload = (h.flags & MUX_FLAG_WINDOW) ? 0 : h.length;
+		if(payload > MUX_MAX_PAYLOAD) {
+			muxDrop("Client sent a frame over the size limit, dropping it\n");
+			return;
+		}
+		if(m_muxIn.size() - pos < MUX_HEADER_SIZE + payload)
+			break;
+
+		if(!muxFrame(h, payload ? &m_muxIn[pos + MUX_HEADER_SIZE] : NULL, payload, out)) {
+			muxDrop("Client broke the stream framing or flow control, dropping it\n");
+			return;
+		}
+		pos += MUX_HEADER_SIZE + payload;
+	}
+	m_muxIn.erase(m_muxIn.begin(), m_muxIn.begin() + pos);
+
+	muxFlush(out);
+	if(!out.empty())
+		writeData(&out[0], out.size());
+}
+
+/**
+ * Mux Drop
+ * End a multiplexed connection whose client broke the protocol. Nothing more of its input is looked at
+ *
+ * @param why Logged when verbose
+ */
+void Connection::muxDrop(const char* why) {
+	if(s_verbose)
+		std::cout << why;
+	m_runMutex.lock();
+	m_connected = false;
+	m_runMutex.unlock();
+	m_muxIn.clear();
+}
+
+/**
+ * Mux Frame
+ * Apply one frame from the client. Data is queued for echo on its stream, which is created by its first frame
+ *
+ * @return False if the frame breaks the protocol (stream 0, data past the window, credit past the window)
+ */
+bool Connection::muxFrame(const MuxFrameHeader& h, const char* payload, unsigned int len, std::vector<char>& out) {
+	if(h.stream == 0)
+		return false;
+
+	boost::unordered_map<unsigned int, MuxStream>::iterator it = m_streams.find(h.stream);
+	if(it == m_streams.end()) {
+		// Credit or reset for a stream that already finished
+		if(h.flags & (MUX_FLAG_WINDOW | MUX_FLAG_RESET))
+			return true;
+		if(m_streams.size() >= MUX_MAX_STREAMS) {
+			mux_append_frame(out, h.stream, MUX_FLAG_RESET, NULL, 0);
+			return true;
+		}
+		MuxStream s;
+		s.sendWindow = MUX_INITIAL_WINDOW;
+		s.credit = 0;
+		s.finReceived = false;
+		it = m_streams.insert(std::make_pair(h.stream, s)).first;
+	}
+	MuxStream& s = it->second;
+
+	if(h.flags & MUX_FLAG_RESET) {
+		m_streams.erase(it);
+		return true;
+	}
+	if(h.flags & MUX_FLAG_WINDOW) {
+		// Credit only returns bytes echoed, it can't open the window past where it started
+		if(h.length > MUX_INITIAL_WINDOW - s.sendWindow)
+			return false;
+		s.sendWindow += h.length;
+		return true;
+	}
+
+	// Everything not yet credited back counts against the window the client was given
+	if(s.finReceived || (s.pending.size() + s.credit + len > MUX_INITIAL_WINDOW))
+		return false;
+	s.pending.append(payload ? payload : "", len);
+	if(h.flags & MUX_FLAG_FIN)
+		s.finReceived = true;
+	return true;
+}
+
+/**
+ * Mux Flush
+ * Echo what each stream's window allows, credit the client for what has been echoed once that is half a window,
+ * and finish streams whose client side is done and fully echoed
+ */
+void Connection::muxFlush(std::vector<char>& out) {
+	boost::unordered_map<unsigned int, MuxStream>::iterator it = m_streams.begin();
+	while(it != m_streams.end()) {
+		MuxStream& s = it->second;
+		while(!s.pending.empty() && (s.sendWindow > 0)) {
+			unsigned int n = std::min((unsigned int)s.pending.size(), std::min(s.sendWindow, (unsigned int)MUX_MAX_PAYLOAD));
+			mux_append_frame(out, it->first, 0, s.pending.data(), n);
+			s.pending.erase(0, n);
+			s.sendWindow -= n;
+			s.credit += n;
+		}
+
+		if(s.finReceived && s.pending.empty()) {
+			mux_append_frame(out, it->first, MUX_FLAG_FIN, NULL, 0);
+			it = m_streams.erase(it);
+			continue;
+		}
+		if(s.credit >= MUX_INITIAL_WINDOW / 2) {
+			mux_append_frame(out, it->first, MUX_FLAG_WINDOW, NULL, s.credit);
+			s.credit = 0;
+		}
+		it++;
+	}
+}
+
+/**
+ * Read Early Data
+ * Drive the handshake while reading any 0-RTT data the client sent with its ClientHello. Each chunk is echoed
+ * straight back ahead of the handshake completing (0.5-RTT data), so an accepted early request costs the client
+ * a single round trip. Once the early data is done the connection carries on through readData()
+ */
+void Connection::readEarlyData() {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	char pData[4096];
+	size_t bytesRead = 0, written = 0;
+
+	while(true) {
+		int r = SSL_read_early_data(m_ssl, pData, sizeof(pData), &bytesRead);
+		if(r == SSL_READ_EARLY_DATA_ERROR) {
+			int err = SSL_get_error(m_ssl, r);
+			if((err != SSL_ERROR_WANT_READ) && (err != SSL_ERROR_WANT_WRITE)) {
+				if(s_verbose)
+					std::cout << "Handshake failed while reading early data\n";
+				m_runMutex.lock();
+				m_connected = false;
+				m_runMutex.unlock();
+			}
+			return;
+		}
+
+		if(bytesRead > 0) {
+			if(s_verbose)
+				std::cout << "Received " << bytesRead << " bytes of early data from client\n";
+			// Numbered now, a connection's trace starts with its first message
+			if(s_trace && !m_traceId)
+				m_traceId = s_trace->openConnection();
+			if(s_trace)
+				s_trace->message(m_traceId, true, pData, bytesRead);
+			while(SSL_write_early_data(m_ssl, pData, bytesRead, &written) <= 0) {
+				int err = SSL_get_error(m_ssl, 0);
+				if((err != SSL_ERROR_WANT_WRITE) && (err != SSL_ERROR_WANT_READ)) {
+					m_runMutex.lock();
+					m_connected = false;
+					m_runMutex.unlock();
+					return;
+				}
+				boost::this_thread::yield();
+			}
+			if(s_trace)
+				s_trace->message(m_traceId, false, pData, bytesRead);
+		}
+
+		if(r == SSL_READ_EARLY_DATA_FINISH) {
+			m_earlyData = false;
+			return;
+		}
+	}
+#else
+	m_earlyData = false;
+#endif
+}
+
+/**
+ * Handshake Finished
+ * See whether OpenSSL handed the session keys to the kernel (SSL_OP_ENABLE_KTLS). It falls back to user space
+ * encryption by itself when the kernel lacks the tls module or the cipher isn't supported, so this only picks
+ * the echo path and counts the outcome
+ */
+void Connection::handshakeFinished() {
+	m_handshakeDone = true;
+	if(s_trace && !m_traceId)
+		m_traceId = s_trace->openConnection();
+
+	bool ktlsSend = false, ktlsRecv = false;
+#if (OPENSSL_VERSION_NUMBER >= 0x30000000L) && !defined(OPENSSL_NO_KTLS)
+	ktlsSend = BIO_get_ktls_send(SSL_get_wbio(m_ssl)) > 0;
+	ktlsRecv = BIO_get_ktls_recv(SSL_get_rbio(m_ssl)) > 0;
+#endif
+
+	// With the kernel encrypting, plain send() skips OpenSSL's record layer and its copy. Reads still go through
+	// SSL_read(), which is a thin recvmsg() wrapper with kTLS receive but also handles alerts and key updates
+	if(ktlsSend)
+		BIO_get_fd(SSL_get_wbio(m_ssl), &m_ktlsFd);
+
+	s_statsMutex.lock();
+	if(ktlsSend)
+		s_ktlsSend++;
+	if(ktlsRecv)
+		s_ktlsRecv++;
+	if(!ktlsSend && !ktlsRecv)
+		s_userspace++;
+	s_statsMutex.unlock();
+
+	// The client asked for multiplexed streams
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	const unsigned char* proto = NULL;
+	unsigned int protoLen = 0;
+	SSL_get0_alpn_selected(m_ssl, &proto, &protoLen);
+	m_mux = (protoLen == strlen(MUX_ALPN)) && (memcmp(proto, MUX_ALPN, protoLen) == 0);
+#endif
+
+	if(s_verbose)
+		std::cout << "Handshake done (" << SSL_get_version(m_ssl) << ", " << SSL_get_cipher_name(m_ssl) << "), kTLS send "
+			<< (ktlsSend ? "on" : "off") << ", receive " << (ktlsRecv ? "on" : "off") << (m_mux ? ", multiplexed streams" : "") << "\n";
+
+	// Client certificate, if ClientAuth asked for one and the client sent it
+	X509* peer = s_verbose ? SSL_get_peer_certificate(m_ssl) : NULL;
+	if(peer) {
+		char subject[256];
+		X509_NAME_oneline(X509_get_subject_name(peer), subject, sizeof(subject));
+		std::cout << "Client certificate " << subject << "\n";
+		X509_free(peer);
+	}
+}
+
+/**
+ * Print Offload Stats
+ * Dump how many connections got kernel TLS in each direction
+ */
+void Connection::printOffloadStats() {
+	s_statsMutex.lock();
+	printf("Connection: kTLS send on %lu, receive on %lu, user space only %lu connections\n", s_ktlsSend, s_ktlsRecv, s_userspace);
+	s_statsMutex.unlock();
+}
+
+/**
+ * Send Plain
+ * Write already encrypted-by-the-kernel data straight to the socket
+ *
+ * @return True if all of it was sent
+ */
+bool Connection::sendPlain(char* pData, unsigned int len) {
+	unsigned int sent = 0;
+	while(sent < len) {
+		ssize_t r = send(m_ktlsFd, pData + sent, len - sent, MSG_NOSIGNAL);
+		if(r > 0) {
+			sent += r;
+		} else if((r < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+			boost::this_thread::yield();
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
 void Connection::writeData(char* pData, unsigned int len) {
 	int r = 0;
 
-	// Write data to the wire
-	r = SSL_write(m_ssl, pData, len);
+	if(s_trace)
+		s_trace->message(m_traceId, false, pData, len);
+
+	if(m_ktlsFd >= 0) {
+		if(!sendPlain(pData, len)) {
+			std::cout << "Client closed the connection or there was a write error\n";
+			m_runMutex.lock();
+			m_connected = false;
+			m_runMutex.unlock();
+		}
+		return;
+	}
+
+	// Write data to the wire. The socket is non blocking, so wait out a full send buffer rather than dropping the client
+	do {
+		r = SSL_write(m_ssl, pData, len);
+		if(r > 0)
+			break;
+		int err = SSL_get_error(m_ssl, r);
+		if((err != SSL_ERROR_WANT_WRITE) && (err != SSL_ERROR_WANT_READ))
+			break;
+		boost::this_thread::yield();
+	} while(true);
 
 	// Check to see if the connection was closed or there was a problem sending the data. Either way, DC
 	if((r <= 0) || (SSL_get_shutdown(m_ssl) != 0)) {
@@ -144,7 +491,7 @@ void Connection::writeData(char* pData, unsigned int len) {
 	}
 
 	// If data was written, print it out
-	if(r > 0) {
+	if((r > 0) && s_verbose) {
 		std::cout << "Wrote " << len << " bytes to client:\n";
 		for(unsigned int i = 0; i < len; i++) {
 			printf("0x%X ", pData[i]);
@@ -21,24 +21,63 @@
 
 #include <iostream>
 #include <stdio.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <string>
+#include <vector>
 
 #include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
 
 #include <openssl/ssl.h>
 
+#include "../common/StreamFrame.h"
+#include "TraceRecorder.h"
+
 class Connection {
 private:
 	BIO* m_bio;
 	SSL* m_ssl;
 	bool m_connected;
+	bool m_earlyData; // Still reading TLS 1.3 early data, the handshake hasn't finished
+	bool m_handshakeDone;
+	int m_ktlsFd; // Echoes go straight to send() on this socket once the kernel encrypts records, -1 otherwise
+	unsigned int m_traceId; // Number in the trace, 0 when not recorded
+
+	// Multiplexed streams, when the client negotiated MUX_ALPN (see StreamFrame.h)
+	struct MuxStream {
+		std::string pending; // Received, not echoed yet
+		unsigned int sendWindow; // Echo bytes the client still accepts on this stream
+		unsigned int credit; // Echoed bytes not credited back to the client yet
+		bool finReceived;
+	};
+	bool m_mux;
+	std::vector<char> m_muxIn; // Frames still arriving
+	boost::unordered_map<unsigned int, MuxStream> m_streams;
 
 	boost::thread* m_thread;
 	boost::mutex m_runMutex;
 
+	static bool s_verbose; // Dump every byte echoed (off for benchmarks)
+	static TraceRecorder* s_trace; // Records every connection's messages when set, not owned
+
+	// Record encryption offload, counted once per handshake
+	static boost::mutex s_statsMutex;
+	static unsigned long s_ktlsSend;
+	static unsigned long s_ktlsRecv;
+	static unsigned long s_userspace;
+
 private:
 	void disconnect();
 	void readData();
+	void readEarlyData();
+	void handshakeFinished();
+	bool sendPlain(char* pData, unsigned int len);
 	void writeData(char*, unsigned int);
+	void muxInput(const char* pData, unsigned int len);
+	void muxDrop(const char* why);
+	bool muxFrame(const MuxFrameHeader& h, const char* payload, unsigned int len, std::vector<char>& out);
+	void muxFlush(std::vector<char>& out);
 
 public:
 	Connection(BIO*, SSL*);
@@ -46,7 +85,19 @@ public:
 	
 	void start();
 	void stop();
+	void join();
 	void operator() ();
+
+	static void setVerbose(bool v) {
+		s_verbose = v;
+	}
+
+	// Set before the first connection is accepted
+	static void setTrace(TraceRecorder* t) {
+		s_trace = t;
+	}
+
+	static void printOffloadStats();
 };
 
 #endif
\ No newline at end of file
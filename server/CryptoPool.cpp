@@ -0,0 +1,215 @@
+/**
+   ssltests
+   CryptoPool.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "CryptoPool.h"
+
+#include <openssl/err.h>
+
+int CryptoPool::exIndex = -1;
+
+CryptoPool::CryptoPool(int threads) {
+	numThreads = threads;
+	running = false;
+	jobsRun = 0;
+	maxQueueDepth = 0;
+	totalWaitUs = 0;
+
+	// The RSA ex_data slot maps a key back to the pool that services it
+	if(exIndex < 0)
+		exIndex = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+	// Start from the default software implementation and only replace the private key operations
+	const RSA_METHOD* def = RSA_get_default_method();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	origPrivEnc = RSA_meth_get_priv_enc(def);
+	origPrivDec = RSA_meth_get_priv_dec(def);
+	method = RSA_meth_dup(def);
+	RSA_meth_set1_name(method, "ssltests crypto pool");
+	RSA_meth_set_priv_enc(method, rsaPrivEnc);
+	RSA_meth_set_priv_dec(method, rsaPrivDec);
+#else
+	origPrivEnc = def->rsa_priv_enc;
+	origPrivDec = def->rsa_priv_dec;
+	method = *def;
+	method.name = "ssltests crypto pool";
+	method.rsa_priv_enc = rsaPrivEnc;
+	method.rsa_priv_dec = rsaPrivDec;
+#endif
+}
+
+CryptoPool::~CryptoPool() {
+	stop();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	RSA_meth_free(method);
+#endif
+}
+
+/**
+ * Start
+ * Spawn the worker threads
+ *
+ * @return True if at least one worker is running
+ */
+bool CryptoPool::start() {
+	if(numThreads <= 0)
+		return false;
+
+	jobMutex.lock();
+	running = true;
+	jobMutex.unlock();
+
+	for(int i = 0; i < numThreads; i++)
+		workers.push_back(new boost::thread(boost::bind(&CryptoPool::workerLoop, this)));
+
+	printf("CryptoPool: %i worker threads started\n", numThreads);
+	return true;
+}
+
+/**
+ * Stop
+ * Let the workers drain any queued jobs, then join and free them. Jobs submitted afterwards run inline
+ */
+void CryptoPool::stop() {
+	jobMutex.lock();
+	if(!running) {
+		jobMutex.unlock();
+		return;
+	}
+	running = false;
+	jobMutex.unlock();
+	jobCond.notify_all();
+
+	std::vector<boost::thread*>::iterator it;
+	for(it = workers.begin(); it != workers.end(); it++) {
+		(*it)->join();
+		delete *it;
+	}
+	workers.clear();
+
+	printStats();
+}
+
+/**
+ * Attach
+ * Route the private key operations of an RSA key through this pool
+ *
+ * @param rsa Key to offload. The key must outlive the pool
+ * @return True on success
+ */
+bool CryptoPool::attach(RSA* rsa) {
+	if(!RSA_set_ex_data(rsa, exIndex, this))
+		return false;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return RSA_set_method(rsa, method) > 0;
+#else
+	return RSA_set_method(rsa, &method) > 0;
+#endif
+}
+
+/**
+ * Print Stats
+ * Dump the number of offloaded operations, the deepest the queue got, and the average time a job spent queued
+ */
+void CryptoPool::printStats() {
+	jobMutex.lock();
+	long long avgWait = (jobsRun > 0) ? (totalWaitUs / (long long)jobsRun) : 0;
+	printf("CryptoPool: %lu private key ops, max queue depth %u, avg queue wait %lld us\n", jobsRun, maxQueueDepth, avgWait);
+	jobMutex.unlock();
+}
+
+/**
+ * Submit
+ * Queue a private key operation and block the calling (Connection) thread until a worker completes it
+ *
+ * @return Result of the underlying RSA operation
+ */
+int CryptoPool::submit(RSAPrivFunc func, int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding) {
+	Job job;
+	job.func = func;
+	job.flen = flen;
+	job.from = from;
+	job.to = to;
+	job.rsa = rsa;
+	job.padding = padding;
+	job.result = -1;
+	job.done = false;
+	job.queued = boost::posix_time::microsec_clock::universal_time();
+
+	jobMutex.lock();
+	if(!running) {
+		// Pool is shut down, do the work ourselves
+		jobMutex.unlock();
+		return func(flen, from, to, rsa, padding);
+	}
+	jobs.push_back(&job);
+	if(jobs.size() > maxQueueDepth)
+		maxQueueDepth = jobs.size();
+	jobMutex.unlock();
+	jobCond.notify_one();
+
+	// Park until a worker posts the result back
+	boost::unique_lock<boost::mutex> lock(job.doneMutex);
+	while(!job.done)
+		job.doneCond.wait(lock);
+
+	return job.result;
+}
+
+/**
+ * Worker Loop
+ * Pull jobs off the queue and run them with the default RSA implementation until the pool is stopped
+ */
+void CryptoPool::workerLoop() {
+	while(true) {
+		Job* job = NULL;
+		{
+			boost::unique_lock<boost::mutex> lock(jobMutex);
+			while(running && jobs.empty())
+				jobCond.wait(lock);
+			if(jobs.empty())
+				return;
+
+			job = jobs.front();
+			jobs.pop_front();
+			jobsRun++;
+			totalWaitUs += (boost::posix_time::microsec_clock::universal_time() - job->queued).total_microseconds();
+		}
+
+		int r = job->func(job->flen, job->from, job->to, job->rsa, job->padding);
+
+		// Errors land on this thread's error queue, which the Connection thread will never look at
+		if(r < 0)
+			ERR_clear_error();
+
+		// Notify while still holding the lock, the Job lives on the waiter's stack and is gone once it wakes
+		boost::lock_guard<boost::mutex> lock(job->doneMutex);
+		job->result = r;
+		job->done = true;
+		job->doneCond.notify_one();
+	}
+}
+
+int CryptoPool::rsaPrivEnc(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding) {
+	CryptoPool* pool = (CryptoPool*)RSA_get_ex_data(rsa, exIndex);
+	return pool->submit(pool->origPrivEnc, flen, from, to, rsa, padding);
+}
+
+int CryptoPool::rsaPrivDec(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding) {
+	CryptoPool* pool = (CryptoPool*)RSA_get_ex_data(rsa, exIndex);
+	return pool->submit(pool->origPrivDec, flen, from, to, rsa, padding);
+}
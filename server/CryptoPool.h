@@ -0,0 +1,100 @@
+/**
+   ssltests
+   CryptoPool.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _cryptopool_h_
+#define _cryptopool_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <openssl/rsa.h>
+
+// Signature shared by RSA_METHOD's rsa_priv_enc and rsa_priv_dec
+typedef int (*RSAPrivFunc)(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+
+/**
+ * Crypto Pool
+ * Moves RSA private key operations off of the Connection threads and onto a fixed set of worker threads.
+ * An RSA key is routed through the pool by attach(), which installs an RSA_METHOD whose private operations
+ * queue a job and park the calling thread on a condition variable until a worker posts the result back.
+ * The number of concurrent private key operations is therefore bounded by the pool size no matter how many
+ * handshakes are in flight, leaving the remaining cores to established connections.
+ */
+class CryptoPool {
+private:
+	struct Job {
+		RSAPrivFunc func;
+		int flen;
+		const unsigned char *from;
+		unsigned char *to;
+		RSA *rsa;
+		int padding;
+
+		int result;
+		bool done;
+		boost::posix_time::ptime queued;
+		boost::mutex doneMutex;
+		boost::condition_variable doneCond;
+	};
+
+	int numThreads;
+	bool running;
+	std::vector<boost::thread*> workers;
+
+	std::deque<Job*> jobs;
+	boost::mutex jobMutex;
+	boost::condition_variable jobCond;
+
+	// Statistics (protected by jobMutex)
+	unsigned long jobsRun;
+	unsigned int maxQueueDepth;
+	long long totalWaitUs;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	RSA_METHOD* method;
+#else
+	RSA_METHOD method;
+#endif
+	RSAPrivFunc origPrivEnc;
+	RSAPrivFunc origPrivDec;
+
+	static int exIndex;
+
+private:
+	int submit(RSAPrivFunc func, int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+	void workerLoop();
+
+	static int rsaPrivEnc(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+	static int rsaPrivDec(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+
+public:
+	CryptoPool(int threads);
+	~CryptoPool();
+
+	bool start();
+	void stop();
+	bool attach(RSA* rsa);
+	void printStats();
+};
+
+#endif
@@ -0,0 +1,292 @@
+/**
+   ssltests
+   EphemeralKeyPool.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "EphemeralKeyPool.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+#include <openssl/bn.h>
+#include <openssl/obj_mac.h>
+
+int EphemeralKeyPool::ctxIndex = -1;
+int EphemeralKeyPool::dhIndex = -1;
+int EphemeralKeyPool::ecIndex = -1;
+
+EphemeralKeyPool::EphemeralKeyPool(int size, int reuseCount) {
+	poolSize = (size < 1) ? 1 : size;
+	reuse = (reuseCount < 1) ? 1 : reuseCount;
+	running = false;
+	refillThread = NULL;
+
+	KeyQueue* queues[2] = { &dhQueue, &ecQueue };
+	for(int i = 0; i < 2; i++) {
+		queues[i]->hits = 0;
+		queues[i]->misses = 0;
+		queues[i]->depletions = 0;
+		queues[i]->lowWater = poolSize;
+	}
+	dhQueue.name = "DHE";
+	ecQueue.name = "ECDHE";
+
+	// The SSL_CTX slot finds the pool from a callback, the SSL slots keep a handed out key alive until the SSL is freed
+	if(ctxIndex < 0) {
+		ctxIndex = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+		dhIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, exFreeDH);
+		ecIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, exFreeEC);
+	}
+}
+
+EphemeralKeyPool::~EphemeralKeyPool() {
+	stop();
+
+	std::deque<Entry>::iterator it;
+	for(it = dhQueue.keys.begin(); it != dhQueue.keys.end(); it++)
+		freeEntry(*it);
+	for(it = ecQueue.keys.begin(); it != ecQueue.keys.end(); it++)
+		freeEntry(*it);
+}
+
+/**
+ * Start
+ * Fill the pool and spawn the thread that keeps it topped up
+ *
+ * @return True if the pool is ready
+ */
+bool EphemeralKeyPool::start() {
+	for(int i = 0; i < poolSize; i++) {
+		Entry dh = generate(true), ec = generate(false);
+		if(!dh.dh || !ec.ec) {
+			freeEntry(dh);
+			freeEntry(ec);
+			printf("EphemeralKeyPool: Could not generate keys\n");
+			return false;
+		}
+		dhQueue.keys.push_back(dh);
+		ecQueue.keys.push_back(ec);
+	}
+
+	poolMutex.lock();
+	running = true;
+	poolMutex.unlock();
+	refillThread = new boost::thread(boost::bind(&EphemeralKeyPool::refillLoop, this));
+
+	printf("EphemeralKeyPool: %i DHE and ECDHE keys ready, each used for %i handshake(s)\n", poolSize, reuse);
+	return true;
+}
+
+/**
+ * Stop
+ * Stop refilling the pool. Handshakes still get keys, generated inline once the pool runs dry
+ */
+void EphemeralKeyPool::stop() {
+	poolMutex.lock();
+	if(!running) {
+		poolMutex.unlock();
+		return;
+	}
+	running = false;
+	refillCond.notify_all();
+	poolMutex.unlock();
+
+	refillThread->join();
+	delete refillThread;
+	refillThread = NULL;
+
+	printStats();
+}
+
+/**
+ * Attach
+ * Serve DHE/ECDHE handshakes on ctx from this pool
+ *
+ * @param ctx Context to attach to. The pool must outlive it
+ * @return True on success
+ */
+bool EphemeralKeyPool::attach(SSL_CTX* ctx) {
+	if(!SSL_CTX_set_ex_data(ctx, ctxIndex, this))
+		return false;
+
+	// Single use options would make OpenSSL throw our precomputed key away and generate a new one
+	SSL_CTX_clear_options(ctx, SSL_OP_SINGLE_DH_USE | SSL_OP_SINGLE_ECDH_USE);
+	SSL_CTX_set_tmp_dh_callback(ctx, tmpDHCallback);
+	SSL_CTX_set_tmp_ecdh_callback(ctx, tmpECDHCallback);
+	return true;
+}
+
+/**
+ * Print Stats
+ * Dump how often handshakes found the pool empty, and how low it got
+ */
+void EphemeralKeyPool::printStats() {
+	poolMutex.lock();
+	printQueueStats(dhQueue);
+	printQueueStats(ecQueue);
+	poolMutex.unlock();
+}
+
+void EphemeralKeyPool::printQueueStats(KeyQueue& q) {
+	printf("EphemeralKeyPool: %s %lu from pool, %lu generated inline, depleted %lu times, low water %u/%i\n",
+		q.name, q.hits, q.misses, q.depletions, (unsigned int)q.lowWater, poolSize);
+}
+
+/**
+ * Refill Loop
+ * Generate keys one at a time, outside the lock, until both queues are full again
+ */
+void EphemeralKeyPool::refillLoop() {
+	while(true) {
+		bool needDH, needEC;
+		{
+			boost::unique_lock<boost::mutex> lock(poolMutex);
+			while(running && (dhQueue.keys.size() >= (size_t)poolSize) && (ecQueue.keys.size() >= (size_t)poolSize))
+				refillCond.wait(lock);
+			if(!running)
+				return;
+			needDH = dhQueue.keys.size() < (size_t)poolSize;
+			needEC = ecQueue.keys.size() < (size_t)poolSize;
+		}
+
+		if(needDH) {
+			Entry e = generate(true);
+			if(e.dh) {
+				boost::lock_guard<boost::mutex> lock(poolMutex);
+				dhQueue.keys.push_back(e);
+			}
+		}
+		if(needEC) {
+			Entry e = generate(false);
+			if(e.ec) {
+				boost::lock_guard<boost::mutex> lock(poolMutex);
+				ecQueue.keys.push_back(e);
+			}
+		}
+	}
+}
+
+/**
+ * Take
+ * Hand out the key at the front of a queue, retiring it once it has served `reuse` handshakes
+ *
+ * @return Entry holding one reference that now belongs to the caller
+ */
+EphemeralKeyPool::Entry EphemeralKeyPool::take(KeyQueue& q, bool isDH) {
+	boost::unique_lock<boost::mutex> lock(poolMutex);
+	if(q.keys.empty()) {
+		q.misses++;
+		lock.unlock();
+		return generate(isDH);
+	}
+
+	q.hits++;
+	Entry& front = q.keys.front();
+	Entry e = front;
+	if(isDH)
+		DH_up_ref(e.dh);
+	else
+		EC_KEY_up_ref(e.ec);
+
+	if(++front.uses >= reuse) {
+		freeEntry(front);
+		q.keys.pop_front();
+		if(q.keys.empty())
+			q.depletions++;
+		if(q.keys.size() < q.lowWater)
+			q.lowWater = q.keys.size();
+		refillCond.notify_one();
+	}
+	return e;
+}
+
+/**
+ * Generate
+ * Create one DH key in the 2048 bit RFC 3526 group, or one P-256 ECDH key
+ */
+EphemeralKeyPool::Entry EphemeralKeyPool::generate(bool isDH) {
+	Entry e;
+	e.dh = NULL;
+	e.ec = NULL;
+	e.uses = 0;
+
+	if(isDH) {
+		DH* dh = DH_new();
+		BIGNUM* g = BN_new();
+		BN_set_word(g, 2);
+		dh->p = get_rfc3526_prime_2048(NULL);
+		dh->g = g;
+		if(DH_generate_key(dh) > 0)
+			e.dh = dh;
+		else
+			DH_free(dh);
+	} else {
+		EC_KEY* ec = EC_KEY_new_by_curve_name(NID_X9_62_prime256v1);
+		if(ec && (EC_KEY_generate_key(ec) > 0))
+			e.ec = ec;
+		else if(ec)
+			EC_KEY_free(ec);
+	}
+
+	return e;
+}
+
+void EphemeralKeyPool::freeEntry(Entry& e) {
+	if(e.dh)
+		DH_free(e.dh);
+	if(e.ec)
+		EC_KEY_free(e.ec);
+	e.dh = NULL;
+	e.ec = NULL;
+}
+
+DH* EphemeralKeyPool::tmpDHCallback(SSL* ssl, int isExport, int keyLength) {
+	EphemeralKeyPool* pool = (EphemeralKeyPool*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctxIndex);
+	if(!pool || isExport)
+		return NULL;
+
+	// OpenSSL copies the key after we return, park our reference on the SSL so it can't be freed before then
+	DH* dh = pool->take(pool->dhQueue, true).dh;
+	DH* old = (DH*)SSL_get_ex_data(ssl, dhIndex);
+	if(old)
+		DH_free(old);
+	SSL_set_ex_data(ssl, dhIndex, dh);
+	return dh;
+}
+
+EC_KEY* EphemeralKeyPool::tmpECDHCallback(SSL* ssl, int isExport, int keyLength) {
+	EphemeralKeyPool* pool = (EphemeralKeyPool*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctxIndex);
+	if(!pool || isExport)
+		return NULL;
+
+	EC_KEY* ec = pool->take(pool->ecQueue, false).ec;
+	EC_KEY* old = (EC_KEY*)SSL_get_ex_data(ssl, ecIndex);
+	if(old)
+		EC_KEY_free(old);
+	SSL_set_ex_data(ssl, ecIndex, ec);
+	return ec;
+}
+
+void EphemeralKeyPool::exFreeDH(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+	if(ptr)
+		DH_free((DH*)ptr);
+}
+
+void EphemeralKeyPool::exFreeEC(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+	if(ptr)
+		EC_KEY_free((EC_KEY*)ptr);
+}
+
+#endif
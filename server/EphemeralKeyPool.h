@@ -0,0 +1,100 @@
+/**
+   ssltests
+   EphemeralKeyPool.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _ephemeralkeypool_h_
+#define _ephemeralkeypool_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <deque>
+
+#include <boost/thread.hpp>
+
+#include <openssl/ssl.h>
+#include <openssl/dh.h>
+#include <openssl/ec.h>
+
+// OpenSSL 1.1+ generates every ephemeral key itself, a key returned from the tmp_dh callback only lends its group
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+/**
+ * Ephemeral Key Pool
+ * Keeps a bounded pool of pre-generated DHE and ECDHE keys topped up from a background thread, and hands them
+ * to handshakes through the tmp_dh/tmp_ecdh callbacks. OpenSSL 1.0 uses a key returned by those callbacks as is
+ * (as long as SSL_OP_SINGLE_DH_USE/SSL_OP_SINGLE_ECDH_USE are off) instead of generating one inline, so the
+ * handshake only pays for an O(1) pop. Each key serves up to `reuse` handshakes before it is retired, 1 meaning
+ * a fresh key per connection. If a burst drains the pool the handshake generates its key inline and the miss is
+ * counted.
+ *
+ * Only built against OpenSSL 1.0. Newer libraries have no way to hand a handshake a pre-generated key.
+ */
+class EphemeralKeyPool {
+private:
+	struct Entry {
+		DH* dh;
+		EC_KEY* ec;
+		int uses;
+	};
+
+	struct KeyQueue {
+		const char* name;
+		std::deque<Entry> keys;
+		unsigned long hits;
+		unsigned long misses;
+		unsigned long depletions;
+		size_t lowWater;
+	};
+
+	int poolSize;
+	int reuse;
+	bool running;
+	boost::thread* refillThread;
+	boost::mutex poolMutex; // Guards everything below
+	boost::condition_variable refillCond;
+	KeyQueue dhQueue;
+	KeyQueue ecQueue;
+
+	static int ctxIndex;
+	static int dhIndex;
+	static int ecIndex;
+
+private:
+	void refillLoop();
+	Entry take(KeyQueue& q, bool isDH);
+	void printQueueStats(KeyQueue& q);
+
+	static Entry generate(bool isDH);
+	static void freeEntry(Entry& e);
+	static DH* tmpDHCallback(SSL* ssl, int isExport, int keyLength);
+	static EC_KEY* tmpECDHCallback(SSL* ssl, int isExport, int keyLength);
+	static void exFreeDH(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+	static void exFreeEC(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+
+public:
+	EphemeralKeyPool(int size, int reuseCount);
+	~EphemeralKeyPool();
+
+	bool start();
+	void stop();
+	bool attach(SSL_CTX* ctx);
+	void printStats();
+};
+
+#endif
+
+#endif
@@ -0,0 +1,586 @@
+/**
+   ssltests
+   KeylessClient.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "KeylessClient.h"
+
+#include <algorithm>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <openssl/rand.h>
+#include <openssl/ecdsa.h>
+
+int KeylessClient::rsaExIndex = -1;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+int KeylessClient::ecExIndex = -1;
+#endif
+
+KeylessClient::KeylessClient(std::string socketPath, int numChannels) {
+	path = socketPath;
+	running = false;
+	nextChannel = 0;
+	requests = 0;
+	failures = 0;
+	batches = 0;
+	batchedRequests = 0;
+
+	if(numChannels < 1)
+		numChannels = 1;
+	for(int i = 0; i < numChannels; i++) {
+		Channel* ch = new Channel();
+		ch->fd = -1;
+		ch->generation = 0;
+		ch->nextId = 1;
+		ch->sendCount = 0;
+		ch->writer = NULL;
+		ch->reader = NULL;
+		channels.push_back(ch);
+	}
+
+	if(rsaExIndex < 0)
+		rsaExIndex = RSA_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+	// Public key operations stay local, private ones go to the key server. NO_CHECK because there is no private half to check
+	const RSA_METHOD* def = RSA_get_default_method();
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	rsaMethod = RSA_meth_dup(def);
+	RSA_meth_set1_name(rsaMethod, "ssltests keyless");
+	RSA_meth_set_priv_enc(rsaMethod, rsaPrivEnc);
+	RSA_meth_set_priv_dec(rsaMethod, rsaPrivDec);
+	RSA_meth_set_flags(rsaMethod, RSA_meth_get_flags(def) | RSA_METHOD_FLAG_NO_CHECK);
+
+	if(ecExIndex < 0)
+		ecExIndex = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+
+	int (*defSign)(int, const unsigned char*, int, unsigned char*, unsigned int*, const BIGNUM*, const BIGNUM*, EC_KEY*) = NULL;
+	int (*defSetup)(EC_KEY*, BN_CTX*, BIGNUM**, BIGNUM**) = NULL;
+	ECDSA_SIG* (*defSignSig)(const unsigned char*, int, const BIGNUM*, const BIGNUM*, EC_KEY*) = NULL;
+	ecMethod = EC_KEY_METHOD_new(EC_KEY_get_default_method());
+	EC_KEY_METHOD_get_sign(EC_KEY_get_default_method(), &defSign, &defSetup, &defSignSig);
+	EC_KEY_METHOD_set_sign(ecMethod, ecdsaSign, defSetup, ecdsaSignSig);
+#else
+	rsaMethod = *def;
+	rsaMethod.name = "ssltests keyless";
+	rsaMethod.rsa_priv_enc = rsaPrivEnc;
+	rsaMethod.rsa_priv_dec = rsaPrivDec;
+	rsaMethod.flags |= RSA_METHOD_FLAG_NO_CHECK;
+#endif
+}
+
+KeylessClient::~KeylessClient() {
+	stop();
+
+	std::vector<Channel*>::iterator it;
+	for(it = channels.begin(); it != channels.end(); it++)
+		delete *it;
+	channels.clear();
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	RSA_meth_free(rsaMethod);
+	EC_KEY_METHOD_free(ecMethod);
+#endif
+}
+
+/**
+ * Start
+ * Connect every channel to the key server and spawn their reader and writer threads
+ *
+ * @return True if all channels connected
+ */
+bool KeylessClient::start() {
+	stateMutex.lock();
+	running = true;
+	stateMutex.unlock();
+
+	std::vector<Channel*>::iterator it;
+	for(it = channels.begin(); it != channels.end(); it++) {
+		Channel* ch = *it;
+		if(!connectChannel(ch)) {
+			printf("KeylessClient: Could not connect to key server at %s\n", path.c_str());
+			stop();
+			return false;
+		}
+		ch->writer = new boost::thread(boost::bind(&KeylessClient::writerLoop, this, ch));
+		ch->reader = new boost::thread(boost::bind(&KeylessClient::readerLoop, this, ch));
+	}
+
+	printf("KeylessClient: %u channels to key server at %s\n", (unsigned int)channels.size(), path.c_str());
+	return true;
+}
+
+/**
+ * Stop
+ * Close all channels, fail anything still outstanding and join the channel threads
+ */
+void KeylessClient::stop() {
+	stateMutex.lock();
+	if(!running) {
+		stateMutex.unlock();
+		return;
+	}
+	running = false;
+	stateMutex.unlock();
+
+	std::vector<Channel*>::iterator it;
+	for(it = channels.begin(); it != channels.end(); it++) {
+		Channel* ch = *it;
+
+		// Wake the reader out of read() and the writer out of its wait
+		ch->mutex.lock();
+		if(ch->fd >= 0)
+			shutdown(ch->fd, SHUT_RDWR);
+		ch->sendCond.notify_all();
+		ch->mutex.unlock();
+
+		if(ch->writer) {
+			ch->writer->join();
+			delete ch->writer;
+			ch->writer = NULL;
+		}
+		if(ch->reader) {
+			ch->reader->join();
+			delete ch->reader;
+			ch->reader = NULL;
+		}
+
+		ch->mutex.lock();
+		if(ch->fd >= 0)
+			close(ch->fd);
+		ch->fd = -1;
+		failPending(ch);
+		ch->mutex.unlock();
+	}
+
+	printStats();
+}
+
+/**
+ * Attach
+ * Route the private key operations of a public-only RSA key to the key server
+ *
+ * @param rsa Key holding the public half of the key server's key. The key must outlive this object
+ * @return True on success
+ */
+bool KeylessClient::attach(RSA* rsa) {
+	if(!RSA_set_ex_data(rsa, rsaExIndex, this))
+		return false;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	return RSA_set_method(rsa, rsaMethod) > 0;
+#else
+	return RSA_set_method(rsa, &rsaMethod) > 0;
+#endif
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+/**
+ * Attach
+ * Route ECDSA signing for a public-only EC key to the key server
+ *
+ * @param ec Key holding the public half of the key server's key. The key must outlive this object
+ * @return True on success
+ */
+bool KeylessClient::attach(EC_KEY* ec) {
+	if(!EC_KEY_set_ex_data(ec, ecExIndex, this))
+		return false;
+	return EC_KEY_set_method(ec, ecMethod) > 0;
+}
+#endif
+
+/**
+ * Print Stats
+ * Dump request counts and how well requests are being coalesced into batches
+ */
+void KeylessClient::printStats() {
+	stateMutex.lock();
+	double avgBatch = (batches > 0) ? ((double)batchedRequests / (double)batches) : 0;
+	printf("KeylessClient: %lu requests, %lu failed, %lu batches written (avg %.2f requests per batch)\n", requests, failures, batches, avgBatch);
+	stateMutex.unlock();
+}
+
+bool KeylessClient::isRunning() {
+	boost::lock_guard<boost::mutex> lock(stateMutex);
+	return running;
+}
+
+/**
+ * Connect Channel
+ * Open the Unix domain socket for a channel. Caller must not hold ch->mutex
+ *
+ * @return True if connected
+ */
+bool KeylessClient::connectChannel(Channel* ch) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		return false;
+	if(connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		close(fd);
+		return false;
+	}
+
+#ifdef SO_PEERCRED
+	// Premaster secrets go to whoever listens, only hand them to a key server of this user (or root)
+	struct ucred cred;
+	socklen_t credLen = sizeof(cred);
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) < 0 || ((cred.uid != geteuid()) && (cred.uid != 0))) {
+		printf("KeylessClient: %s isn't served by a key server of this user, not using it\n", path.c_str());
+		close(fd);
+		return false;
+	}
+#endif
+
+	ch->mutex.lock();
+	ch->fd = fd;
+	ch->generation++;
+	ch->mutex.unlock();
+	return true;
+}
+
+/**
+ * Fail Pending
+ * Complete every outstanding request on a channel with an error. Caller must hold ch->mutex
+ */
+void KeylessClient::failPending(Channel* ch) {
+	std::map<uint32_t, Request*>::iterator it;
+	for(it = ch->pending.begin(); it != ch->pending.end(); it++) {
+		Request* req = it->second;
+		boost::lock_guard<boost::mutex> lock(req->doneMutex);
+		req->result = -1;
+		req->done = true;
+		req->doneCond.notify_one();
+	}
+	ch->pending.clear();
+	ch->sendBuf.clear();
+	ch->sendCount = 0;
+}
+
+/**
+ * Call
+ * Send one request to the key server and wait for its response
+ *
+ * @param op KEYOP_* operation
+ * @param arg Operation argument (RSA padding)
+ * @param from Request payload
+ * @param flen Length of from
+ * @param to Buffer that receives the response payload
+ * @param toMax Size of to
+ * @return Length of the response payload, -1 on failure
+ */
+int KeylessClient::call(uint8_t op, uint8_t arg, const unsigned char* from, unsigned int flen, unsigned char* to, unsigned int toMax) {
+	if(flen > KEYPROTO_MAX_PAYLOAD)
+		return -1;
+
+	Request req;
+	req.out = from;
+	req.outLen = flen;
+	req.in = to;
+	req.inMax = toMax;
+	req.result = -1;
+	req.done = false;
+
+	stateMutex.lock();
+	Channel* ch = channels[nextChannel++ % channels.size()];
+	requests++;
+	stateMutex.unlock();
+
+	// Queue the frame for the channel's writer
+	ch->mutex.lock();
+	if(ch->fd < 0) {
+		ch->mutex.unlock();
+		stateMutex.lock();
+		failures++;
+		stateMutex.unlock();
+		return -1;
+	}
+	req.id = ch->nextId++;
+	ch->pending[req.id] = &req;
+	size_t off = ch->sendBuf.size();
+	ch->sendBuf.resize(off + KEYPROTO_HEADER_LEN + flen);
+	keyproto_pack_header(&ch->sendBuf[off], req.id, op, arg, (uint16_t)flen);
+	if(flen > 0)
+		memcpy(&ch->sendBuf[off + KEYPROTO_HEADER_LEN], from, flen);
+	ch->sendCount++;
+	ch->sendCond.notify_one();
+	ch->mutex.unlock();
+
+	boost::unique_lock<boost::mutex> lock(req.doneMutex);
+	boost::system_time deadline = boost::get_system_time() + boost::posix_time::milliseconds(KEYLESS_TIMEOUT_MS);
+	while(!req.done) {
+		if(!req.doneCond.timed_wait(lock, deadline) && !req.done) {
+			// Timed out. If the request is still pending we own it again, otherwise the reader is mid-delivery
+			lock.unlock();
+			ch->mutex.lock();
+			bool removed = (ch->pending.erase(req.id) > 0);
+			ch->mutex.unlock();
+			lock.lock();
+			if(removed) {
+				req.result = -1;
+				break;
+			}
+			while(!req.done)
+				req.doneCond.wait(lock);
+		}
+	}
+
+	if(req.result < 0) {
+		stateMutex.lock();
+		failures++;
+		stateMutex.unlock();
+	}
+	return req.result;
+}
+
+/**
+ * Writer Loop
+ * Flush everything queued on a channel in one write, then go back to waiting
+ */
+void KeylessClient::writerLoop(Channel* ch) {
+	std::vector<unsigned char> batch;
+	while(true) {
+		int fd = -1;
+		unsigned long generation = 0;
+		unsigned int count = 0;
+		{
+			boost::unique_lock<boost::mutex> lock(ch->mutex);
+			while(isRunning() && (ch->sendBuf.empty() || (ch->fd < 0)))
+				ch->sendCond.wait(lock);
+			if(!isRunning())
+				return;
+
+			batch.clear();
+			batch.swap(ch->sendBuf);
+			count = ch->sendCount;
+			ch->sendCount = 0;
+			fd = ch->fd;
+			generation = ch->generation;
+		}
+
+		stateMutex.lock();
+		batches++;
+		batchedRequests += count;
+		stateMutex.unlock();
+
+		// The reader only closes fd while holding writeMutex, so if the channel is still on the connection the batch
+		// was taken from, fd stays that socket until the batch is out. Otherwise the batch's requests have already
+		// been failed and fd may now be a different socket that must not see them
+		boost::lock_guard<boost::mutex> wlock(ch->writeMutex);
+		ch->mutex.lock();
+		bool current = (ch->generation == generation);
+		ch->mutex.unlock();
+		if(!current)
+			continue;
+
+		size_t sent = 0;
+		while(sent < batch.size()) {
+			ssize_t w = write(fd, &batch[sent], batch.size() - sent);
+			if(w < 0 && errno == EINTR)
+				continue;
+			if(w <= 0) {
+				// Let the reader notice the broken channel and fail everything outstanding
+				shutdown(fd, SHUT_RDWR);
+				break;
+			}
+			sent += w;
+		}
+	}
+}
+
+/**
+ * Reader Loop
+ * Read responses off a channel and hand each one to the caller waiting on its id. Owns reconnecting the channel
+ */
+void KeylessClient::readerLoop(Channel* ch) {
+	std::vector<unsigned char> rbuf;
+	unsigned char tmp[16384];
+
+	while(isRunning()) {
+		ch->mutex.lock();
+		int fd = ch->fd;
+		ch->mutex.unlock();
+
+		if(fd < 0) {
+			boost::this_thread::sleep(boost::posix_time::milliseconds(KEYLESS_RECONNECT_MS));
+			if(isRunning() && connectChannel(ch))
+				printf("KeylessClient: Reconnected to key server\n");
+			continue;
+		}
+
+		ssize_t r = read(fd, tmp, sizeof(tmp));
+		if(r < 0 && errno == EINTR)
+			continue;
+		if(r <= 0) {
+			if(!isRunning())
+				break;
+
+			printf("KeylessClient: Lost connection to key server\n");
+			ch->mutex.lock();
+			ch->fd = -1;
+			ch->generation++;
+			failPending(ch);
+			ch->mutex.unlock();
+
+			ch->writeMutex.lock();
+			close(fd);
+			ch->writeMutex.unlock();
+			rbuf.clear();
+			continue;
+		}
+		rbuf.insert(rbuf.end(), tmp, tmp + r);
+
+		// Dispatch every complete frame in the buffer
+		size_t off = 0;
+		int flen = 0;
+		while((flen = keyproto_frame_length(&rbuf[0] + off, rbuf.size() - off)) > 0) {
+			uint32_t id;
+			uint8_t status, arg;
+			uint16_t len;
+			keyproto_unpack_header(&rbuf[off], &id, &status, &arg, &len);
+
+			Request* req = NULL;
+			ch->mutex.lock();
+			std::map<uint32_t, Request*>::iterator it = ch->pending.find(id);
+			if(it != ch->pending.end()) {
+				req = it->second;
+				ch->pending.erase(it);
+			}
+			ch->mutex.unlock();
+
+			// Requests that timed out are no longer pending, just drop their response
+			if(req) {
+				boost::lock_guard<boost::mutex> lock(req->doneMutex);
+				if((status == KEYSTATUS_OK) && (len <= req->inMax)) {
+					memcpy(req->in, &rbuf[off + KEYPROTO_HEADER_LEN], len);
+					req->result = len;
+				} else {
+					req->result = -1;
+				}
+				req->done = true;
+				req->doneCond.notify_one();
+			}
+
+			off += flen;
+		}
+		rbuf.erase(rbuf.begin(), rbuf.begin() + off);
+
+		// Not a response frame, the stream can't be trusted past it. The next read() sees the connection lost
+		if(flen < 0)
+			shutdown(fd, SHUT_RDWR);
+	}
+}
+
+int KeylessClient::rsaPrivEnc(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding) {
+	KeylessClient* kc = (KeylessClient*)RSA_get_ex_data(rsa, rsaExIndex);
+	return kc->call(KEYOP_RSA_SIGN, (uint8_t)padding, from, flen, to, RSA_size(rsa));
+}
+
+int KeylessClient::rsaPrivDec(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding) {
+	KeylessClient* kc = (KeylessClient*)RSA_get_ex_data(rsa, rsaExIndex);
+	return kc->call(KEYOP_RSA_DECRYPT, (uint8_t)padding, from, flen, to, RSA_size(rsa));
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+int KeylessClient::ecdsaSign(int type, const unsigned char *dgst, int dlen, unsigned char *sig, unsigned int *siglen,
+	const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey)
+{
+	KeylessClient* kc = (KeylessClient*)EC_KEY_get_ex_data(eckey, ecExIndex);
+	int len = kc->call(KEYOP_ECDSA_SIGN, 0, dgst, dlen, sig, ECDSA_size(eckey));
+	if(len <= 0)
+		return 0;
+	*siglen = len;
+	return 1;
+}
+
+ECDSA_SIG* KeylessClient::ecdsaSignSig(const unsigned char *dgst, int dlen, const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey) {
+	KeylessClient* kc = (KeylessClient*)EC_KEY_get_ex_data(eckey, ecExIndex);
+	std::vector<unsigned char> der(ECDSA_size(eckey));
+	int len = kc->call(KEYOP_ECDSA_SIGN, 0, dgst, dlen, &der[0], der.size());
+	if(len <= 0)
+		return NULL;
+	const unsigned char* p = &der[0];
+	return d2i_ECDSA_SIG(NULL, &p, len);
+}
+#endif
+
+/**
+ * Benchmark
+ * Push ops RSA signatures through the key server from the given number of threads and report throughput,
+ * latency percentiles and the achieved batching
+ *
+ * @param rsa Public key matching the key server's key
+ * @param ops Total number of signatures
+ * @param threads Concurrent requesters
+ * @return True if every operation succeeded
+ */
+bool KeylessClient::benchmark(RSA* rsa, int ops, int threads) {
+	if(!attach(rsa))
+		return false;
+	if(threads < 1)
+		threads = 1;
+
+	std::vector<std::vector<long> > lat(threads);
+	std::vector<boost::thread*> workers;
+	stateMutex.lock();
+	unsigned long failedBefore = failures;
+	unsigned long batchesBefore = batches, batchedBefore = batchedRequests;
+	stateMutex.unlock();
+
+	printf("KeylessClient: Benchmarking %i signatures from %i threads...\n", ops, threads);
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	for(int t = 0; t < threads; t++)
+		workers.push_back(new boost::thread(boost::bind(&KeylessClient::benchmarkWorker, this, rsa, ops / threads + ((t < ops % threads) ? 1 : 0), &lat[t])));
+	for(int t = 0; t < threads; t++) {
+		workers[t]->join();
+		delete workers[t];
+	}
+	double secs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+
+	std::vector<long> all;
+	for(int t = 0; t < threads; t++)
+		all.insert(all.end(), lat[t].begin(), lat[t].end());
+	std::sort(all.begin(), all.end());
+	if(all.empty())
+		return false;
+
+	stateMutex.lock();
+	unsigned long failed = failures - failedBefore;
+	unsigned long nBatches = batches - batchesBefore;
+	double avgBatch = (nBatches > 0) ? ((double)(batchedRequests - batchedBefore) / nBatches) : 0;
+	stateMutex.unlock();
+
+	printf("KeylessClient: %.0f ops/sec, latency p50 %ld us, p99 %ld us, max %ld us, avg batch %.2f, %lu failed\n",
+		all.size() / secs, all[all.size() / 2], all[(all.size() * 99) / 100], all.back(), avgBatch, failed);
+	return failed == 0;
+}
+
+void KeylessClient::benchmarkWorker(RSA* rsa, int ops, std::vector<long>* lat) {
+	unsigned char dgst[36];
+	std::vector<unsigned char> sig(RSA_size(rsa));
+	for(int i = 0; i < ops; i++) {
+		RAND_bytes(dgst, sizeof(dgst));
+		boost::posix_time::ptime t0 = boost::posix_time::microsec_clock::universal_time();
+		RSA_private_encrypt(sizeof(dgst), dgst, &sig[0], rsa, RSA_PKCS1_PADDING);
+		lat->push_back((boost::posix_time::microsec_clock::universal_time() - t0).total_microseconds());
+	}
+}
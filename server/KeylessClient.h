@@ -0,0 +1,132 @@
+/**
+   ssltests
+   KeylessClient.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _keylessclient_h_
+#define _keylessclient_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time_types.hpp>
+
+#include <openssl/rsa.h>
+#include <openssl/ec.h>
+
+#include "../common/KeyProtocol.h"
+
+#define KEYLESS_TIMEOUT_MS 2000 // Give up on a key server request after this long
+#define KEYLESS_RECONNECT_MS 1000 // Delay between attempts to re-establish a dropped channel
+
+/**
+ * Keyless Client
+ * Performs private key operations for keys that live in a separate key server process (see keyserver/).
+ * attach() installs a method on a public-only key so that OpenSSL's private operations become requests on one
+ * of a small set of Unix domain socket channels. Each channel has a writer thread that flushes every request
+ * queued since its last write in a single batch, and a reader thread that matches responses to their waiting
+ * callers by id, so any number of handshakes can have operations in flight on the same socket.
+ */
+class KeylessClient {
+private:
+	struct Request {
+		uint32_t id;
+		const unsigned char* out;
+		unsigned int outLen;
+		unsigned char* in;
+		unsigned int inMax;
+
+		int result;
+		bool done;
+		boost::mutex doneMutex;
+		boost::condition_variable doneCond;
+	};
+
+	struct Channel {
+		int fd;
+		unsigned long generation; // Bumped whenever fd changes, a closed fd's number can come back on the reconnect
+		uint32_t nextId;
+		boost::mutex mutex; // Guards everything below and fd changes
+		boost::mutex writeMutex; // Held while the writer uses fd so the reader can't close it underneath
+		std::vector<unsigned char> sendBuf;
+		unsigned int sendCount;
+		boost::condition_variable sendCond;
+		std::map<uint32_t, Request*> pending;
+
+		boost::thread* writer;
+		boost::thread* reader;
+	};
+
+	std::string path;
+	bool running;
+	std::vector<Channel*> channels;
+	unsigned int nextChannel;
+	boost::mutex stateMutex; // Guards running and the statistics
+
+	// Statistics
+	unsigned long requests;
+	unsigned long failures;
+	unsigned long batches;
+	unsigned long batchedRequests;
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	RSA_METHOD* rsaMethod;
+	EC_KEY_METHOD* ecMethod;
+#else
+	RSA_METHOD rsaMethod;
+#endif
+
+	static int rsaExIndex;
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	static int ecExIndex;
+#endif
+
+private:
+	bool isRunning();
+	bool connectChannel(Channel* ch);
+	void failPending(Channel* ch);
+	void writerLoop(Channel* ch);
+	void readerLoop(Channel* ch);
+	void benchmarkWorker(RSA* rsa, int ops, std::vector<long>* lat);
+	int call(uint8_t op, uint8_t arg, const unsigned char* from, unsigned int flen, unsigned char* to, unsigned int toMax);
+
+	static int rsaPrivEnc(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+	static int rsaPrivDec(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	static int ecdsaSign(int type, const unsigned char *dgst, int dlen, unsigned char *sig, unsigned int *siglen,
+		const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey);
+	static ECDSA_SIG* ecdsaSignSig(const unsigned char *dgst, int dlen, const BIGNUM *kinv, const BIGNUM *r, EC_KEY *eckey);
+#endif
+
+public:
+	KeylessClient(std::string socketPath, int numChannels);
+	~KeylessClient();
+
+	bool start();
+	void stop();
+	bool attach(RSA* rsa);
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	bool attach(EC_KEY* ec);
+#endif
+	void printStats();
+	bool benchmark(RSA* rsa, int ops, int threads);
+};
+
+#endif
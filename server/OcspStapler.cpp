@@ -0,0 +1,420 @@
+/**
+   ssltests
+   OcspStapler.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "OcspStapler.h"
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <boost/date_time/posix_time/conversion.hpp>
+
+#include <openssl/pem.h>
+#include <openssl/err.h>
+
+OcspStapler::OcspStapler(std::string cert, std::string file, std::string url, std::string issuer) {
+	certFile = cert;
+	responseFile = file;
+	responderUrl = url;
+	issuerFile = issuer;
+	serverCert = NULL;
+	issuerCert = NULL;
+	certId = NULL;
+
+	running = false;
+	refreshThread = NULL;
+	nextUpdate = 0;
+	refreshAt = 0;
+
+	stapled = 0;
+	missing = 0;
+	refreshes = 0;
+	refreshFailures = 0;
+}
+
+OcspStapler::~OcspStapler() {
+	stop();
+	if(certId)
+		OCSP_CERTID_free(certId);
+	if(serverCert)
+		X509_free(serverCert);
+	if(issuerCert)
+		X509_free(issuerCert);
+}
+
+/**
+ * Start
+ * Fetch the first response and spawn the refresh thread. A failed first fetch is not fatal, the server just
+ * doesn't staple until a refresh succeeds
+ *
+ * @return True if the stapler is running
+ */
+bool OcspStapler::start() {
+	if(responseFile.empty() && responderUrl.empty())
+		return false;
+	if(issuerFile.empty()) {
+		printf("OcspStapler: Checking OCSP responses requires the issuer certificate\n");
+		return false;
+	}
+
+	serverCert = loadCert(certFile);
+	issuerCert = loadCert(issuerFile);
+	certId = (serverCert && issuerCert) ? OCSP_cert_to_id(NULL, serverCert, issuerCert) : NULL;
+	if(!certId) {
+		printf("OcspStapler: Could not load the certificate or its issuer\n");
+		return false;
+	}
+
+	if(!refresh())
+		printf("OcspStapler: No OCSP response available yet, will retry in %i seconds\n", OCSP_RETRY_INTERVAL);
+
+	mutex.lock();
+	running = true;
+	mutex.unlock();
+	refreshThread = new boost::thread(boost::bind(&OcspStapler::refreshLoop, this));
+
+	return true;
+}
+
+/**
+ * Stop
+ * Stop refreshing. The last response keeps being stapled until it expires
+ */
+void OcspStapler::stop() {
+	mutex.lock();
+	if(!running) {
+		mutex.unlock();
+		return;
+	}
+	running = false;
+	stopCond.notify_all();
+	mutex.unlock();
+
+	refreshThread->join();
+	delete refreshThread;
+	refreshThread = NULL;
+
+	printStats();
+}
+
+/**
+ * Attach
+ * Staple responses on handshakes accepted through ctx
+ *
+ * @param ctx Context to attach to. The stapler must outlive it
+ * @return True on success
+ */
+bool OcspStapler::attach(SSL_CTX* ctx) {
+	SSL_CTX_set_tlsext_status_cb(ctx, statusCallback);
+	SSL_CTX_set_tlsext_status_arg(ctx, this);
+	return true;
+}
+
+/**
+ * Print Stats
+ * Dump how many handshakes got a staple, and how refreshes went
+ */
+void OcspStapler::printStats() {
+	mutex.lock();
+	printf("OcspStapler: %lu responses stapled, %lu requests without a valid response, %lu refreshes (%lu failed)\n",
+		stapled, missing, refreshes, refreshFailures);
+	mutex.unlock();
+}
+
+/**
+ * Refresh
+ * Fetch a new response and, if it is a successful, current answer about our certificate from a responder the
+ * issuer vouches for, swap it in for future handshakes
+ *
+ * @return True if a new response was installed
+ */
+bool OcspStapler::refresh() {
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	std::vector<unsigned char> der;
+	bool fetched = responseFile.empty() ? fetchFromResponder(der) : fetchFromFile(der);
+
+	// Check the response is about our certificate and signed by someone allowed to, and pull out its validity window
+	OCSP_RESPONSE* resp = NULL;
+	OCSP_BASICRESP* basic = NULL;
+	ASN1_GENERALIZEDTIME *thisUpd = NULL, *nextUpd = NULL;
+	int status = -1, reason = 0;
+	if(fetched && !der.empty()) {
+		const unsigned char* p = &der[0];
+		resp = d2i_OCSP_RESPONSE(NULL, &p, der.size());
+	}
+	if(resp && (OCSP_response_status(resp) == OCSP_RESPONSE_STATUS_SUCCESSFUL))
+		basic = OCSP_response_get1_basic(resp);
+	if(basic && verifyResponse(basic) &&
+		OCSP_resp_find_status(basic, certId, &status, &reason, NULL, &thisUpd, &nextUpd) &&
+		!OCSP_check_validity(thisUpd, nextUpd, OCSP_CLOCK_SKEW, -1))
+		status = -1;
+	time_t next = nextUpd ? asn1TimeToUnix(nextUpd) : 0;
+	bool ok = (status >= 0) && ((next == 0) || (next > time(NULL)));
+
+	if(basic)
+		OCSP_BASICRESP_free(basic);
+	if(resp)
+		OCSP_RESPONSE_free(resp);
+	ERR_clear_error();
+
+	long ms = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+	time_t now = time(NULL);
+	boost::lock_guard<boost::mutex> lock(mutex);
+	refreshes++;
+	if(!ok) {
+		refreshFailures++;
+		refreshAt = now + OCSP_RETRY_INTERVAL;
+		printf("OcspStapler: Refresh failed after %li ms\n", ms);
+		return false;
+	}
+
+	response.reset(new std::vector<unsigned char>(der));
+	nextUpdate = next;
+	refreshAt = (next > 0) ? (next - OCSP_REFRESH_MARGIN) : (now + OCSP_REFRESH_INTERVAL);
+	if(refreshAt <= now)
+		refreshAt = now + OCSP_RETRY_INTERVAL;
+
+	printf("OcspStapler: Installed %u byte response (cert status: %s) in %li ms, next refresh in %li seconds\n",
+		(unsigned int)der.size(), OCSP_cert_status_str(status), ms, (long)(refreshAt - now));
+	return true;
+}
+
+/**
+ * Verify Response
+ * Check the response's signature. It must come from the issuer itself, or from a responder certificate the issuer
+ * signed for OCSP signing
+ *
+ * @return True if the signature checks out
+ */
+bool OcspStapler::verifyResponse(OCSP_BASICRESP* basic) {
+	STACK_OF(X509)* certs = sk_X509_new_null();
+	X509_STORE* store = X509_STORE_new();
+	bool ok = false;
+	if(certs && store && sk_X509_push(certs, issuerCert) && X509_STORE_add_cert(store, issuerCert)) {
+#ifdef X509_V_FLAG_PARTIAL_CHAIN
+		// The issuer is usually an intermediate, a delegated responder only has to chain up to it
+		X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+#endif
+		// TRUSTOTHER: a response signed by the issuer itself needs no chain built
+		ok = OCSP_basic_verify(basic, certs, store, OCSP_TRUSTOTHER) > 0;
+	}
+	if(!ok)
+		printf("OcspStapler: Response signature could not be verified against the issuer\n");
+
+	// The stack doesn't own issuerCert
+	if(certs)
+		sk_X509_free(certs);
+	if(store)
+		X509_STORE_free(store);
+	return ok;
+}
+
+/**
+ * Fetch From File
+ * Read a DER encoded OCSP response that some other process keeps up to date
+ */
+bool OcspStapler::fetchFromFile(std::vector<unsigned char>& der) {
+	FILE* f = fopen(responseFile.c_str(), "rb");
+	if(!f)
+		return false;
+
+	unsigned char buf[4096];
+	size_t n;
+	while((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		der.insert(der.end(), buf, buf + n);
+	fclose(f);
+
+	return !der.empty();
+}
+
+/**
+ * Fetch From Responder
+ * Ask the OCSP responder at responderUrl about the server certificate. The connect and the exchange are
+ * non-blocking and abandoned after OCSP_FETCH_TIMEOUT seconds, so a stalled responder can't hold up stop().
+ * Resolving the responder's host name is not covered by the deadline
+ */
+bool OcspStapler::fetchFromResponder(std::vector<unsigned char>& der) {
+	char *host = NULL, *port = NULL, *path = NULL;
+	int useSSL = 0;
+	OCSP_REQUEST* req = NULL;
+	OCSP_CERTID* id = NULL;
+	OCSP_REQ_CTX* rctx = NULL;
+	OCSP_RESPONSE* resp = NULL;
+	BIO* cbio = NULL;
+	boost::posix_time::ptime deadline = boost::posix_time::microsec_clock::universal_time() +
+		boost::posix_time::seconds(OCSP_FETCH_TIMEOUT);
+	int r;
+
+	std::vector<char> url(responderUrl.begin(), responderUrl.end());
+	url.push_back('\0');
+	if(!OCSP_parse_url(&url[0], &host, &port, &path, &useSSL) || useSSL) {
+		printf("OcspStapler: Bad responder URL (only http:// responders are supported)\n");
+		goto done;
+	}
+
+	req = OCSP_REQUEST_new();
+	id = OCSP_CERTID_dup(certId);
+	if(!req || !id || !OCSP_request_add0_id(req, id)) {
+		if(id)
+			OCSP_CERTID_free(id);
+		goto done;
+	}
+
+	cbio = BIO_new_connect(host);
+	if(!cbio)
+		goto done;
+	BIO_set_conn_port(cbio, port);
+	BIO_set_nbio(cbio, 1);
+	while((r = BIO_do_connect(cbio)) <= 0) {
+		if(!BIO_should_retry(cbio) || !waitForBio(cbio, deadline))
+			goto done;
+	}
+
+	rctx = OCSP_sendreq_new(cbio, path, NULL, 0);
+	if(!rctx || !OCSP_REQ_CTX_add1_header(rctx, "Host", host) || !OCSP_REQ_CTX_set1_req(rctx, req))
+		goto done;
+	while((r = OCSP_sendreq_nbio(&resp, rctx)) == -1) {
+		if(!waitForBio(cbio, deadline))
+			goto done;
+	}
+	if((r == 1) && resp) {
+		int len = i2d_OCSP_RESPONSE(resp, NULL);
+		if(len > 0) {
+			der.resize(len);
+			unsigned char* p = &der[0];
+			i2d_OCSP_RESPONSE(resp, &p);
+		}
+	}
+
+done:
+	if(der.empty() && (boost::posix_time::microsec_clock::universal_time() >= deadline))
+		printf("OcspStapler: Responder did not answer within %i seconds\n", OCSP_FETCH_TIMEOUT);
+	if(rctx)
+		OCSP_REQ_CTX_free(rctx);
+	if(cbio)
+		BIO_free_all(cbio);
+	if(resp)
+		OCSP_RESPONSE_free(resp);
+	if(req)
+		OCSP_REQUEST_free(req);
+	if(host)
+		OPENSSL_free(host);
+	if(port)
+		OPENSSL_free(port);
+	if(path)
+		OPENSSL_free(path);
+	return !der.empty();
+}
+
+/**
+ * Wait For BIO
+ * Wait until a non-blocking BIO that asked to be retried is ready for what it was doing. A pending connect
+ * waits for writability
+ *
+ * @return False once the deadline has passed
+ */
+bool OcspStapler::waitForBio(BIO* bio, boost::posix_time::ptime deadline) {
+	long remainingMs = (long)((deadline - boost::posix_time::microsec_clock::universal_time()).total_milliseconds());
+	if(remainingMs <= 0)
+		return false;
+
+	struct pollfd pfd = { (int)BIO_get_fd(bio, NULL), (short)(BIO_should_read(bio) ? POLLIN : POLLOUT), 0 };
+	if(pfd.fd < 0)
+		return false;
+	if((poll(&pfd, 1, (int)remainingMs) < 0) && (errno != EINTR))
+		return false;
+	return true;
+}
+
+/**
+ * Refresh Loop
+ * Sleep until the current response is due for replacement (or a retry is due), then refresh
+ */
+void OcspStapler::refreshLoop() {
+	while(true) {
+		{
+			boost::unique_lock<boost::mutex> lock(mutex);
+			boost::system_time wakeAt = boost::posix_time::from_time_t(refreshAt);
+			while(running && (time(NULL) < refreshAt))
+				stopCond.timed_wait(lock, wakeAt);
+			if(!running)
+				return;
+		}
+
+		refresh();
+	}
+}
+
+X509* OcspStapler::loadCert(const std::string& file) {
+	BIO* bio = BIO_new_file(file.c_str(), "r");
+	if(!bio)
+		return NULL;
+	X509* cert = PEM_read_bio_X509(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	return cert;
+}
+
+/**
+ * ASN1 Time To Unix
+ * Convert a GeneralizedTime (YYYYMMDDHHMMSS[.fff]Z) to a UTC time_t
+ *
+ * @return The time, 0 if it couldn't be parsed
+ */
+time_t OcspStapler::asn1TimeToUnix(ASN1_GENERALIZEDTIME* t) {
+	const char* s = (const char*)ASN1_STRING_data(t);
+	if(!s || (ASN1_STRING_length(t) < 14))
+		return 0;
+
+	struct tm tm;
+	memset(&tm, 0, sizeof(tm));
+	if(sscanf(s, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return 0;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return timegm(&tm);
+}
+
+/**
+ * Status Callback
+ * Called during the handshake when the client sent status_request. Only copies the cached response
+ */
+int OcspStapler::statusCallback(SSL* ssl, void* arg) {
+	OcspStapler* stapler = (OcspStapler*)arg;
+
+	ResponsePtr resp;
+	stapler->mutex.lock();
+	if(stapler->response && ((stapler->nextUpdate == 0) || (stapler->nextUpdate > time(NULL)))) {
+		resp = stapler->response;
+		stapler->stapled++;
+	} else {
+		stapler->missing++;
+	}
+	stapler->mutex.unlock();
+
+	if(!resp)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	// OpenSSL takes ownership of the buffer
+	unsigned char* buf = (unsigned char*)OPENSSL_malloc(resp->size());
+	if(!buf)
+		return SSL_TLSEXT_ERR_NOACK;
+	memcpy(buf, &(*resp)[0], resp->size());
+	SSL_set_tlsext_status_ocsp_resp(ssl, buf, resp->size());
+
+	return SSL_TLSEXT_ERR_OK;
+}
@@ -0,0 +1,97 @@
+/**
+   ssltests
+   OcspStapler.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _ocspstapler_h_
+#define _ocspstapler_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <time.h>
+
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <openssl/ssl.h>
+#include <openssl/ocsp.h>
+
+#define OCSP_REFRESH_MARGIN 300 // Seconds before a response's nextUpdate to fetch its replacement
+#define OCSP_REFRESH_INTERVAL 3600 // Refresh period for responses without a nextUpdate
+#define OCSP_RETRY_INTERVAL 60 // Seconds between attempts after a failed fetch
+#define OCSP_FETCH_TIMEOUT 10 // Seconds a responder gets to connect and answer before the fetch is abandoned
+#define OCSP_CLOCK_SKEW 300 // Seconds of clock difference tolerated in a response's thisUpdate and nextUpdate
+
+/**
+ * OCSP Stapler
+ * Staples an OCSP response for the server certificate to handshakes that ask for one (status_request).
+ * The DER response lives in memory and the status callback only copies it, so the handshake never waits on
+ * the network or disk. A background thread replaces it ahead of its nextUpdate, either by re-reading a file
+ * maintained by something else or by querying an OCSP responder directly. Only responses about our certificate,
+ * signed by its issuer or a responder the issuer delegated to, are installed. A response that expires without a
+ * replacement is dropped rather than stapled stale.
+ */
+class OcspStapler {
+private:
+	typedef boost::shared_ptr<std::vector<unsigned char> > ResponsePtr;
+
+	std::string certFile;
+	std::string responseFile; // Used when set, otherwise responderUrl
+	std::string responderUrl;
+	std::string issuerFile;
+	X509* serverCert;
+	X509* issuerCert;
+	OCSP_CERTID* certId; // What a response must be about to be stapled
+
+	bool running;
+	boost::thread* refreshThread;
+	boost::mutex mutex; // Guards everything below
+	boost::condition_variable stopCond;
+	ResponsePtr response;
+	time_t nextUpdate; // 0 if the response has none
+	time_t refreshAt;
+
+	// Statistics
+	unsigned long stapled;
+	unsigned long missing;
+	unsigned long refreshes;
+	unsigned long refreshFailures;
+
+private:
+	bool refresh();
+	bool fetchFromFile(std::vector<unsigned char>& der);
+	bool fetchFromResponder(std::vector<unsigned char>& der);
+	bool verifyResponse(OCSP_BASICRESP* basic);
+	void refreshLoop();
+
+	static X509* loadCert(const std::string& file);
+	static time_t asn1TimeToUnix(ASN1_GENERALIZEDTIME* t);
+	static bool waitForBio(BIO* bio, boost::posix_time::ptime deadline);
+	static int statusCallback(SSL* ssl, void* arg);
+
+public:
+	OcspStapler(std::string cert, std::string file, std::string url, std::string issuer);
+	~OcspStapler();
+
+	bool start();
+	void stop();
+	bool attach(SSL_CTX* ctx);
+	void printStats();
+};
+
+#endif
@@ -0,0 +1,205 @@
+/**
+   ssltests
+   RenegotiationGuard.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "RenegotiationGuard.h"
+
+int RenegotiationGuard::ctxExIndex = -1;
+int RenegotiationGuard::sslExIndex = -1;
+
+RenegotiationGuard::RenegotiationGuard(int maxPerConnection, int window, int maxGlobalPerSec, bool rejectAll) {
+	perConnection = (maxPerConnection < 0) ? 0 : maxPerConnection;
+	windowSecs = (window < 1) ? 1 : window;
+	globalPerSec = (maxGlobalPerSec < 0) ? 0 : maxGlobalPerSec;
+	reject = rejectAll;
+
+	rateSecond = 0;
+	rateCount = 0;
+
+	handshakes = 0;
+	allowed = 0;
+	refusedReject = 0;
+	refusedConnection = 0;
+	refusedGlobal = 0;
+
+	// The context's ex_data slot maps it back to the guard, the SSL's slot holds the connection's ConnState
+	if(ctxExIndex < 0)
+		ctxExIndex = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+	if(sslExIndex < 0)
+		sslExIndex = SSL_get_ex_new_index(0, NULL, NULL, NULL, freeState);
+}
+
+RenegotiationGuard::~RenegotiationGuard() {
+	printStats();
+}
+
+/**
+ * Attach
+ * Watch handshakes on connections made through ctx
+ *
+ * @param ctx Context to attach to. The guard must outlive it
+ * @return True on success
+ */
+bool RenegotiationGuard::attach(SSL_CTX* ctx) {
+	if(!SSL_CTX_set_ex_data(ctx, ctxExIndex, this))
+		return false;
+	SSL_CTX_set_info_callback(ctx, infoCallback);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	SSL_CTX_set_client_hello_cb(ctx, clientHelloCallback, this);
+#endif
+
+	// OpenSSL 3.0 refuses client renegotiation unless told otherwise, the guard's limits apply instead
+#ifdef SSL_OP_ALLOW_CLIENT_RENEGOTIATION
+	if(!reject && (perConnection > 0))
+		SSL_CTX_set_options(ctx, SSL_OP_ALLOW_CLIENT_RENEGOTIATION);
+#endif
+	return true;
+}
+
+/**
+ * Print Stats
+ * Dump how many renegotiations were let through or refused, and why
+ */
+void RenegotiationGuard::printStats() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	printf("RenegotiationGuard: %lu handshakes, %lu renegotiations allowed, refused %lu (rejecting all), %lu (connection limit), %lu (global limit)\n",
+		handshakes, allowed, refusedReject, refusedConnection, refusedGlobal);
+}
+
+/**
+ * Refused
+ * Whether the connection asked for a renegotiation it wasn't allowed. The Connection drops it if so
+ */
+bool RenegotiationGuard::refused(const SSL* ssl) {
+	ConnState* state = (sslExIndex < 0) ? NULL : (ConnState*)SSL_get_ex_data(ssl, sslExIndex);
+	return state && state->refused;
+}
+
+/**
+ * Admit
+ * Decide on a renegotiation and count the outcome
+ *
+ * @return True if it may go ahead
+ */
+bool RenegotiationGuard::admit(ConnState* state) {
+	time_t now = time(NULL);
+
+	boost::lock_guard<boost::mutex> lock(mutex);
+	if(reject) {
+		refusedReject++;
+		return false;
+	}
+
+	if(now - state->windowStart >= windowSecs) {
+		state->windowStart = now;
+		state->windowCount = 0;
+	}
+	if(state->windowCount >= perConnection) {
+		refusedConnection++;
+		return false;
+	}
+
+	if(globalPerSec > 0) {
+		if(now != rateSecond) {
+			rateSecond = now;
+			rateCount = 0;
+		}
+		if(rateCount >= globalPerSec) {
+			refusedGlobal++;
+			return false;
+		}
+		rateCount++;
+	}
+
+	state->windowCount++;
+	allowed++;
+	return true;
+}
+
+/**
+ * Get State
+ * The connection's ConnState, created on its first handshake
+ */
+RenegotiationGuard::ConnState* RenegotiationGuard::getState(const SSL* ssl) {
+	ConnState* state = (ConnState*)SSL_get_ex_data(ssl, sslExIndex);
+	if(!state) {
+		state = new ConnState();
+		state->handshakes = 0;
+		state->windowCount = 0;
+		state->windowStart = 0;
+		state->refused = false;
+		if(!SSL_set_ex_data((SSL*)ssl, sslExIndex, state)) {
+			delete state;
+			return NULL;
+		}
+	}
+	return state;
+}
+
+/**
+ * Info Callback
+ * Called on handshake state changes. A handshake starting after one has completed is a renegotiation
+ */
+void RenegotiationGuard::infoCallback(const SSL* ssl, int where, int ret) {
+	if(!(where & (SSL_CB_HANDSHAKE_START | SSL_CB_HANDSHAKE_DONE)))
+		return;
+
+	RenegotiationGuard* guard = (RenegotiationGuard*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctxExIndex);
+	ConnState* state = getState(ssl);
+	if(!guard || !state)
+		return;
+
+	if(where & SSL_CB_HANDSHAKE_DONE) {
+		if(state->handshakes++ == 0) {
+			guard->mutex.lock();
+			guard->handshakes++;
+			guard->mutex.unlock();
+		}
+		return;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	// TLS 1.3 has no renegotiation, 1.1.1 reports session tickets and key updates as handshake starts
+	if(SSL_version(ssl) >= TLS1_3_VERSION)
+		return;
+#endif
+	if((state->handshakes > 0) && !state->refused && !guard->admit(state))
+		state->refused = true;
+}
+
+/**
+ * Free State
+ * ex_data free function, called as the SSL is freed
+ */
+void RenegotiationGuard::freeState(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp) {
+	delete (ConnState*)ptr;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+/**
+ * Client Hello Callback
+ * Runs after the info callback has judged the handshake, and fails a refused renegotiation before the server
+ * does any work for it
+ */
+int RenegotiationGuard::clientHelloCallback(SSL* ssl, int* al, void* arg) {
+	if(refused(ssl)) {
+		*al = SSL_AD_NO_RENEGOTIATION;
+		return SSL_CLIENT_HELLO_ERROR;
+	}
+	return SSL_CLIENT_HELLO_SUCCESS;
+}
+#endif
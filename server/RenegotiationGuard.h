@@ -0,0 +1,92 @@
+/**
+   ssltests
+   RenegotiationGuard.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _renegotiationguard_h_
+#define _renegotiationguard_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <time.h>
+
+#include <boost/thread.hpp>
+
+#include <openssl/ssl.h>
+
+/**
+ * Renegotiation Guard
+ * Limits client initiated renegotiation (TLS 1.2 and older), each of which costs the server a full handshake
+ * including a private key operation on the Connection thread. The info callback sees every handshake start;
+ * any after the first on a connection is a renegotiation, and is allowed only while the connection is within
+ * perConnection renegotiations per windowSecs and all connections together are within globalPerSec. With reject
+ * set every renegotiation is refused.
+ *
+ * A refused renegotiation gets a fatal no_renegotiation alert from the ClientHello callback before any key
+ * operation on OpenSSL 1.1.1 and newer. OpenSSL 1.0 has no such callback, there the Connection drops the
+ * client once the SSL_read() that carried the ClientHello returns, so a client past its limit gets at most one
+ * more key operation out of the server.
+ */
+class RenegotiationGuard {
+private:
+	// Per connection state, kept in the SSL's ex_data and freed with it
+	struct ConnState {
+		unsigned int handshakes; // Completed, the initial one included
+		int windowCount; // Renegotiations allowed since windowStart
+		time_t windowStart;
+		bool refused;
+	};
+
+	int perConnection;
+	int windowSecs;
+	int globalPerSec; // 0 = no global limit
+	bool reject;
+
+	boost::mutex mutex; // Guards everything below
+	time_t rateSecond;
+	int rateCount;
+
+	// Statistics
+	unsigned long handshakes;
+	unsigned long allowed;
+	unsigned long refusedReject;
+	unsigned long refusedConnection;
+	unsigned long refusedGlobal;
+
+	static int ctxExIndex;
+	static int sslExIndex;
+
+private:
+	bool admit(ConnState* state);
+
+	static ConnState* getState(const SSL* ssl);
+	static void infoCallback(const SSL* ssl, int where, int ret);
+	static void freeState(void* parent, void* ptr, CRYPTO_EX_DATA* ad, int idx, long argl, void* argp);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	static int clientHelloCallback(SSL* ssl, int* al, void* arg);
+#endif
+
+public:
+	RenegotiationGuard(int maxPerConnection, int window, int maxGlobalPerSec, bool rejectAll);
+	~RenegotiationGuard();
+
+	bool attach(SSL_CTX* ctx);
+	void printStats();
+
+	static bool refused(const SSL* ssl);
+};
+
+#endif
@@ -18,63 +18,173 @@
 
 #include "SSLServer.h"
 
+#include <algorithm>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <boost/bind.hpp>
+
+
 SSLServer::SSLServer() {
 	// SSL variables
 	sslMethod = NULL;
 	listenBIO = NULL;
-	serverCTX = NULL;
+	nextCTX = 0;
+	ctxReplicas = CTX_REPLICAS;
+	minVersion = SERVER_MIN_VERSION;
+	maxVersion = SERVER_MAX_VERSION;
+
+	cryptoThreads = CRYPTO_POOL_THREADS;
+	cryptoPool = NULL;
+
+	keylessSocket = "";
+	keylessChannels = KEYLESS_CHANNELS;
+	keyless = NULL;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	ephemeralPoolSize = EPHEMERAL_POOL_SIZE;
+	ephemeralReuse = EPHEMERAL_REUSE;
+	ephemeralPool = NULL;
+#endif
+
+	ocspFile = "";
+	ocspUrl = "";
+	ocspIssuer = "";
+	ocspStapler = NULL;
+
+	vhostFile = "";
+	vhostCacheSize = VHOST_CACHE_SIZE;
+	vhosts = NULL;
+
+	ktls = SERVER_KTLS;
+	earlyDataMax = EARLY_DATA_MAX;
+	replayWindow = ANTIREPLAY_WINDOW;
+	antiReplay = NULL;
+
+	clientCA = "";
+	clientCrl = "";
+	clientAuthRequired = false;
+	clientAuth = NULL;
+
+	renegPerConnection = RENEG_PER_CONNECTION;
+	renegWindow = RENEG_WINDOW;
+	renegGlobalRate = RENEG_GLOBAL_RATE;
+	renegReject = RENEG_REJECT;
+	renegGuard = NULL;
+
+	ticketKeys = NULL;
+	ticketRotateSecs = TICKET_KEY_ROTATE;
+
+	reloadThread = NULL;
+	reloadPending = false;
+	reloadRunning = false;
+	reloads = 0;
 
 	cons = new list<Connection*>();
 }
 
 SSLServer::~SSLServer() {
+	stopReloader();
 	disconnectAll();
-	if(serverCTX)
-		SSL_CTX_free(serverCTX);
+	if(vhosts)
+		delete vhosts;
+	freeContexts(serverCTXs);
 	if(listenBIO)
 		BIO_free(listenBIO);
+	if(cryptoPool)
+		delete cryptoPool;
+	if(keyless)
+		delete keyless;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	if(ephemeralPool)
+		delete ephemeralPool;
+#endif
+	if(ocspStapler)
+		delete ocspStapler;
+	if(antiReplay)
+		delete antiReplay;
+	if(clientAuth)
+		delete clientAuth;
+	if(renegGuard)
+		delete renegGuard;
+	if(ticketKeys)
+		delete ticketKeys;
+	if(ktls)
+		Connection::printOffloadStats();
 
 	delete cons;
 }
 
 bool SSLServer::init() {
-	// Create a CTX structure with a method indicating that we only understand TLSv1
-	sslMethod = TLSv1_server_method();
-	serverCTX = SSL_CTX_new(sslMethod);
-	if(!serverCTX) {
-		printf("Could not create serverCTX\n");
-		return false;
+	// Create contexts with the version flexible method, createContext() narrows them to [minVersion, maxVersion]
+	sslMethod = tls_server_method();
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	// Serve DHE/ECDHE key exchanges from pre-generated keys
+	if(ephemeralPoolSize > 0) {
+		ephemeralPool = new EphemeralKeyPool(ephemeralPoolSize, ephemeralReuse);
+		if(!ephemeralPool->start()) {
+			printf("Could not set up ephemeral key pool\n");
+			return false;
+		}
 	}
+#endif
 
-	// Set default password for key files
-	SSL_CTX_set_default_passwd_cb(serverCTX, passwordCallback);
+	// Kernel TLS is best effort, connections fall back to user space encryption
+#ifndef SSL_OP_ENABLE_KTLS
+	if(ktls)
+		printf("This OpenSSL can't offload to kernel TLS (needs 3.0 built with enable-ktls), encrypting in user space\n");
+#endif
 
-	// Load the server certificate into the serverCTX
-	if(SSL_CTX_use_certificate_file(serverCTX, SERVER_CERTFILE, SSL_FILETYPE_PEM) <= 0) {
-		printf("Couldn't load certificate file\n");
+	// Accept 0-RTT data, guarded against replays
+	if(earlyDataMax > 0) {
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+		antiReplay = new AntiReplayCache(replayWindow);
+#else
+		printf("Early data needs OpenSSL 1.1.1 or newer (make SYSTEM_OPENSSL=1)\n");
 		return false;
+#endif
 	}
 
-	// Load the corresponding private key into the serverCTX
-	if(SSL_CTX_use_PrivateKey_file(serverCTX, SERVER_PVKFILE, SSL_FILETYPE_PEM) <= 0) {
-		printf("Could not load private key file\n");
-		return false;
+	// Ask clients for a certificate and verify it against clientCA
+	if(!clientCA.empty()) {
+		clientAuth = new ClientAuth(clientCA, clientCrl, clientAuthRequired, CLIENT_AUTH_CACHE_SIZE, CLIENT_AUTH_CACHE_TTL);
+		if(!clientAuth->loadCrl())
+			return false;
 	}
 
-	// Make sure private key and certificate correspond
-	if(!SSL_CTX_check_private_key(serverCTX)) {
-		printf("Private Key and Certificate do NOT match\n");
+	// Every renegotiation is a full handshake on the Connection thread, keep clients from asking for too many
+	renegGuard = new RenegotiationGuard(renegPerConnection, renegWindow, renegGlobalRate, renegReject);
+
+	ticketKeys = new TicketKeys();
+	if(!ticketKeys->rotate())
 		return false;
+
+	// Staple OCSP responses from a file or responder, refreshed in the background
+	if(!ocspFile.empty() || !ocspUrl.empty()) {
+		ocspStapler = new OcspStapler(SERVER_CERTFILE, ocspFile, ocspUrl, ocspIssuer);
+		if(!ocspStapler->start()) {
+			printf("Could not set up OCSP stapling\n");
+			return false;
+		}
 	}
 
-	// Proxy will not verify the client (request for the client's certificate won't be sent)
-	SSL_CTX_set_verify(serverCTX, SSL_VERIFY_NONE, NULL);
+	// Switch to per host contexts based on SNI
+	if(!vhostFile.empty()) {
+		vhosts = new VirtualHosts(boost::bind(&SSLServer::createVirtualHostContext, this, _1, _2), vhostCacheSize);
+		if(!vhosts->load(vhostFile)) {
+			printf("Could not set up virtual hosts\n");
+			return false;
+		}
+	}
 
-	// Enable all cipher suites
-	if(SSL_CTX_set_cipher_list(serverCTX, "ALL") <= 0) {
-		printf("Could not select any ciphers\n");
+	// Default contexts, used when the client doesn't ask for a virtual host
+	if(ctxReplicas < 1)
+		ctxReplicas = max(1, (int)boost::thread::hardware_concurrency());
+	if(!createDefaultContexts(serverCTXs))
 		return false;
-	}
 
 	// Setup the accepting BIO
 	listenBIO = BIO_new(BIO_s_accept());
@@ -101,11 +211,482 @@ bool SSLServer::init() {
 		return false;
 	}
 
-	printf("SSLServer ready on port %i\n", SERVER_PORT);
+	// Certificates and keys are reloaded on request (SIGHUP) from a thread of their own
+	reloadRunning = true;
+	reloadThread = new boost::thread(boost::bind(&SSLServer::reloadLoop, this));
+
+	printf("SSLServer ready on port %i (%s to %s, %i default context%s)\n", SERVER_PORT, minVersion ? tls_version_name(minVersion) : "any",
+		maxVersion ? tls_version_name(maxVersion) : "newest", ctxReplicas, (ctxReplicas == 1) ? "" : "s");
+
+	return true;
+}
+
+/**
+ * Create Default Contexts
+ * Build ctxReplicas identical default contexts. Each SSL_new() and session cache lookup locks the context it
+ * works on, with replicas handed out round robin concurrent handshakes spread over as many locks. Session
+ * tickets resume on any replica since they share ticketKeys, session IDs only on the replica that issued them
+ *
+ * @param ctxs Filled with the new contexts, left empty on failure
+ * @return True on success
+ */
+bool SSLServer::createDefaultContexts(vector<SSL_CTX*>& ctxs) {
+	for(int i = 0; i < ctxReplicas; i++) {
+		SSL_CTX* ctx = createContext(SERVER_CERTFILE, SERVER_PVKFILE, !keylessSocket.empty());
+		if(ctx && ocspStapler && !ocspStapler->attach(ctx)) {
+			printf("Could not set up OCSP stapling\n");
+			SSL_CTX_free(ctx);
+			ctx = NULL;
+		}
+		if(ctx && vhosts && !vhosts->attach(ctx)) {
+			printf("Could not set up virtual hosts\n");
+			SSL_CTX_free(ctx);
+			ctx = NULL;
+		}
+		if(!ctx) {
+			freeContexts(ctxs);
+			return false;
+		}
+		ctxs.push_back(ctx);
+	}
+	return true;
+}
+
+void SSLServer::freeContexts(vector<SSL_CTX*>& ctxs) {
+	for(unsigned int i = 0; i < ctxs.size(); i++)
+		SSL_CTX_free(ctxs[i]);
+	ctxs.clear();
+}
+
+/**
+ * Create Context
+ * Build a server context for a certificate and its key with the settings shared by every context
+ *
+ * @param certFile PEM certificate
+ * @param keyFile PEM private key
+ * @param useKeyless Ignore keyFile and have the key server perform private key operations
+ * @return The context, NULL on failure
+ */
+SSL_CTX* SSLServer::createContext(const string& certFile, const string& keyFile, bool useKeyless) {
+	SSL_CTX* ctx = SSL_CTX_new(sslMethod);
+	if(!ctx) {
+		printf("Could not create SSL context\n");
+		return NULL;
+	}
+
+	if(!tls_set_version_range(ctx, minVersion, maxVersion)) {
+		printf("No supported protocol version between %s and %s\n", minVersion ? tls_version_name(minVersion) : "any",
+			maxVersion ? tls_version_name(maxVersion) : "any");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	// Set default password for key files
+	SSL_CTX_set_default_passwd_cb(ctx, passwordCallback);
+
+	// Load the server certificate into the context
+	if(SSL_CTX_use_certificate_file(ctx, certFile.c_str(), SSL_FILETYPE_PEM) <= 0) {
+		printf("Couldn't load certificate file %s\n", certFile.c_str());
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	// Load the corresponding private key into the context
+	EVP_PKEY* pkey = useKeyless ? loadKeylessKey(certFile) : loadPrivateKeyFile(keyFile);
+	if(!pkey || (SSL_CTX_use_PrivateKey(ctx, pkey) <= 0)) {
+		printf("Could not load private key for %s\n", certFile.c_str());
+		if(pkey)
+			EVP_PKEY_free(pkey);
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+	EVP_PKEY_free(pkey);
+
+	// Make sure private key and certificate correspond
+	if(!SSL_CTX_check_private_key(ctx)) {
+		printf("Private Key and Certificate do NOT match\n");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	// Without a client CA the proxy will not verify the client (request for the client's certificate won't be sent)
+	if(clientAuth) {
+		if(!clientAuth->attach(ctx)) {
+			SSL_CTX_free(ctx);
+			return NULL;
+		}
+	} else {
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+	}
+
+	// The library's cipher suites, all of them if older versions were asked for
+	if(SSL_CTX_set_cipher_list(ctx, tls_cipher_list(minVersion)) <= 0) {
+		printf("Could not select any ciphers\n");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+	if(ticketKeys && !ticketKeys->attach(ctx)) {
+		printf("Could not set the session ticket keys\n");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	// The library generates a fresh DHE/ECDHE key per handshake, it only needs to pick DH groups
+	SSL_CTX_set_dh_auto(ctx, 1);
+#else
+	if(ephemeralPool)
+		ephemeralPool->attach(ctx);
+#endif
+
+	if(renegGuard && !renegGuard->attach(ctx)) {
+		printf("Could not attach the renegotiation guard\n");
+		SSL_CTX_free(ctx);
+		return NULL;
+	}
+
+#ifdef SSL_OP_ENABLE_KTLS
+	if(ktls)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+	// Clients offering MUX_ALPN get multiplexed streams instead of a plain echo (see Connection)
+#if OPENSSL_VERSION_NUMBER >= 0x10002000L
+	SSL_CTX_set_alpn_select_cb(ctx, mux_alpn_select, NULL);
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+	if(antiReplay) {
+		// OpenSSL's own replay protection would switch to single use tickets held in the session cache, the
+		// anti replay cache lets tickets stay stateless instead
+		SSL_CTX_set_options(ctx, SSL_OP_NO_ANTI_REPLAY);
+		SSL_CTX_set_max_early_data(ctx, earlyDataMax);
+		antiReplay->attach(ctx);
+	}
+#endif
+
+	return ctx;
+}
+
+/**
+ * Create Virtual Host Context
+ * Context factory handed to VirtualHosts. Virtual hosts always use local keys, the key server only holds
+ * the default certificate's key
+ */
+SSL_CTX* SSLServer::createVirtualHostContext(const string& certFile, const string& keyFile) {
+	return createContext(certFile, keyFile, false);
+}
+
+/**
+ * Load Private Key File
+ * Load a PEM private key. When a crypto pool is configured, the key's private operations are routed
+ * through it so handshakes don't burn CPU on the Connection threads
+ *
+ * @param keyFile PEM private key, encrypted with SERVER_CERTPWD if at all
+ * @return The key (caller frees), NULL on failure
+ */
+EVP_PKEY* SSLServer::loadPrivateKeyFile(const string& keyFile) {
+	BIO* kbio = BIO_new_file(keyFile.c_str(), "r");
+	if(!kbio)
+		return NULL;
+	EVP_PKEY* pkey = PEM_read_bio_PrivateKey(kbio, NULL, passwordCallback, NULL);
+	BIO_free(kbio);
+	if(!pkey || (cryptoThreads <= 0))
+		return pkey;
+
+	// Keys can be loaded from the reload thread and from handshakes picking a virtual host
+	{
+		boost::lock_guard<boost::mutex> lock(keyMutex);
+		if(!cryptoPool) {
+			cryptoPool = new CryptoPool(cryptoThreads);
+			cryptoPool->start();
+		}
+	}
+
+	// Only RSA keys are offloaded, anything else is used as is
+	RSA* rsa = EVP_PKEY_get1_RSA(pkey);
+	if(!rsa)
+		return pkey;
+	EVP_PKEY_free(pkey);
+
+	pkey = EVP_PKEY_new();
+	if(!cryptoPool->attach(rsa) || !EVP_PKEY_assign_RSA(pkey, rsa)) {
+		RSA_free(rsa);
+		EVP_PKEY_free(pkey);
+		return NULL;
+	}
+	return pkey;
+}
+
+/**
+ * Load Keyless Key
+ * Build a key that holds only the public half of a certificate's key. Its private operations
+ * are performed by the key server, so this process never sees the private key
+ *
+ * @param certFile PEM certificate whose key the key server holds
+ * @return The key (caller frees), NULL on failure
+ */
+EVP_PKEY* SSLServer::loadKeylessKey(const string& certFile) {
+	if(!startKeyless())
+		return NULL;
+
+	EVP_PKEY* pub = loadCertPublicKey(certFile);
+	if(!pub)
+		return NULL;
+
+	EVP_PKEY* pkey = NULL;
+	RSA* rsa = EVP_PKEY_get1_RSA(pub);
+	if(rsa) {
+		pkey = EVP_PKEY_new();
+		if(!keyless->attach(rsa) || !EVP_PKEY_assign_RSA(pkey, rsa)) {
+			RSA_free(rsa);
+			EVP_PKEY_free(pkey);
+			pkey = NULL;
+		}
+	}
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	EC_KEY* ec = rsa ? NULL : EVP_PKEY_get1_EC_KEY(pub);
+	if(ec) {
+		pkey = EVP_PKEY_new();
+		if(!keyless->attach(ec) || !EVP_PKEY_assign_EC_KEY(pkey, ec)) {
+			EC_KEY_free(ec);
+			EVP_PKEY_free(pkey);
+			pkey = NULL;
+		}
+	}
+#endif
+	EVP_PKEY_free(pub);
+
+	return pkey;
+}
+
+/**
+ * Start Keyless
+ * Connect to the key server if that hasn't happened yet
+ *
+ * @return True if the key server is reachable
+ */
+bool SSLServer::startKeyless() {
+	if(keyless)
+		return true;
 
+	keyless = new KeylessClient(keylessSocket, keylessChannels);
+	if(!keyless->start()) {
+		delete keyless;
+		keyless = NULL;
+		return false;
+	}
 	return true;
 }
 
+/**
+ * Load Cert Public Key
+ * Read the public key out of a certificate
+ *
+ * @param certFile PEM certificate
+ * @return The public key (caller frees), NULL on failure
+ */
+EVP_PKEY* SSLServer::loadCertPublicKey(const string& certFile) {
+	BIO* cbio = BIO_new_file(certFile.c_str(), "r");
+	if(!cbio)
+		return NULL;
+	X509* cert = PEM_read_bio_X509(cbio, NULL, NULL, NULL);
+	BIO_free(cbio);
+	if(!cert)
+		return NULL;
+
+	EVP_PKEY* pub = X509_get_pubkey(cert);
+	X509_free(cert);
+	return pub;
+}
+
+/**
+ * Benchmark Keyless
+ * Measure latency and throughput of the key server pipeline without any TLS on top
+ *
+ * @param ops Total number of RSA signatures
+ * @param threads Number of concurrent requesters
+ * @return True if the benchmark ran and every operation succeeded
+ */
+bool SSLServer::benchmarkKeyless(int ops, int threads) {
+	if(keylessSocket.empty()) {
+		printf("Keyless benchmark requires a key server socket\n");
+		return false;
+	}
+	if(!startKeyless())
+		return false;
+
+	EVP_PKEY* pub = loadCertPublicKey(SERVER_CERTFILE);
+	RSA* rsa = pub ? EVP_PKEY_get1_RSA(pub) : NULL;
+	if(pub)
+		EVP_PKEY_free(pub);
+	if(!rsa) {
+		printf("Keyless benchmark requires an RSA certificate\n");
+		return false;
+	}
+
+	bool ok = keyless->benchmark(rsa, ops, threads);
+	RSA_free(rsa);
+	return ok;
+}
+
+/**
+ * Benchmark Contexts
+ * Measure how the accept path (SSL_new() and SSL_free()) and session ID resumption, which looks the session
+ * up in the context's cache, scale from 1 to maxThreads threads when every thread shares one context versus
+ * when each has a replica of its own. Resumption is TLS 1.2 without tickets so it goes through the cache and
+ * costs little besides the cache and context locks
+ *
+ * @param ops Operations per thread for each measurement
+ * @param maxThreads Most threads to run at once
+ * @return True if the benchmark ran and every operation succeeded
+ */
+bool SSLServer::benchmarkContexts(int ops, int maxThreads) {
+	if(maxThreads < 1)
+		maxThreads = 1;
+
+	sslMethod = tls_server_method();
+	if(!ticketKeys)
+		ticketKeys = new TicketKeys();
+	if(!ticketKeys->rotate())
+		return false;
+
+	vector<SSL_CTX*> replicas;
+	for(int i = 0; i < maxThreads; i++) {
+		SSL_CTX* ctx = createContext(SERVER_CERTFILE, SERVER_PVKFILE, false);
+		if(!ctx) {
+			freeContexts(replicas);
+			return false;
+		}
+		replicas.push_back(ctx);
+	}
+
+	printf("Benchmarking %i operations per thread, one shared context vs one context per thread...\n", ops);
+	printf("threads  accept shared  accept replicas  resume shared  resume replicas (ops/sec)\n");
+	bool ok = true;
+	for(int threads = 1; ; threads = min(threads * 2, maxThreads)) {
+		double rate[4];
+		for(int run = 0; run < 4; run++) {
+			bool resume = (run >= 2);
+			bool replicated = (run % 2 == 1);
+			vector<int> failed(threads, 0);
+			boost::thread_group workers;
+			boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+			for(int t = 0; t < threads; t++)
+				workers.create_thread(boost::bind(&SSLServer::ctxBenchWorker, replicated ? replicas[t] : replicas[0], resume, ops, &failed[t]));
+			workers.join_all();
+			double secs = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds() / 1000000.0;
+
+			int failures = 0;
+			for(int t = 0; t < threads; t++)
+				failures += failed[t];
+			if(failures > 0) {
+				printf("%i operations failed\n", failures);
+				ok = false;
+			}
+			rate[run] = (threads * ops) / secs;
+		}
+		printf("%7i  %13.0f  %15.0f  %13.0f  %15.0f\n", threads, rate[0], rate[1], rate[2], rate[3]);
+		if(threads == maxThreads)
+			break;
+	}
+
+	freeContexts(replicas);
+	return ok;
+}
+
+/**
+ * Context Bench Worker
+ * ops SSL_new()/SSL_free() pairs on sctx, or ops resumptions of one session it issued over memory BIOs
+ */
+void SSLServer::ctxBenchWorker(SSL_CTX* sctx, bool resume, int ops, int* failed) {
+	if(!resume) {
+		for(int i = 0; i < ops; i++) {
+			SSL* ssl = SSL_new(sctx);
+			if(ssl)
+				SSL_free(ssl);
+			else
+				(*failed)++;
+		}
+		return;
+	}
+
+	// TLS 1.2 session IDs, so the server side resumes out of its session cache
+	SSL_CTX* cctx = SSL_CTX_new(tls_client_method());
+	if(!cctx || !tls_set_version_range(cctx, 0, TLS1_2_VERSION)) {
+		(*failed) += ops;
+		if(cctx)
+			SSL_CTX_free(cctx);
+		return;
+	}
+	SSL_CTX_set_options(cctx, SSL_OP_NO_TICKET);
+	SSL_CTX_set_cipher_list(cctx, tls_cipher_list(0));
+	SSL_CTX_set_verify(cctx, SSL_VERIFY_NONE, NULL);
+
+	SSL_SESSION* session = NULL;
+	if(!memoryHandshake(sctx, cctx, NULL, &session)) {
+		(*failed) += ops;
+		SSL_CTX_free(cctx);
+		return;
+	}
+	for(int i = 0; i < ops; i++) {
+		if(!memoryHandshake(sctx, cctx, session, NULL))
+			(*failed)++;
+	}
+	SSL_SESSION_free(session);
+	SSL_CTX_free(cctx);
+}
+
+/**
+ * Memory Handshake
+ * Run a complete handshake between a client on cctx and a server on sctx over a BIO pair
+ *
+ * @param resume Session for the client to offer, NULL for a full handshake
+ * @param session If not NULL, set to the client's session afterwards (caller frees)
+ * @return True if the handshake finished, and resumed resume if one was given
+ */
+bool SSLServer::memoryHandshake(SSL_CTX* sctx, SSL_CTX* cctx, SSL_SESSION* resume, SSL_SESSION** session) {
+	SSL* server = SSL_new(sctx);
+	SSL* client = SSL_new(cctx);
+	BIO* sbio = NULL;
+	BIO* cbio = NULL;
+	if(!server || !client || !BIO_new_bio_pair(&sbio, 0, &cbio, 0)) {
+		if(server)
+			SSL_free(server);
+		if(client)
+			SSL_free(client);
+		return false;
+	}
+	SSL_set_bio(server, sbio, sbio);
+	SSL_set_bio(client, cbio, cbio);
+	SSL_set_accept_state(server);
+	SSL_set_connect_state(client);
+	if(resume)
+		SSL_set_session(client, resume);
+
+	// Each side runs until it needs the other's next flight, a few rounds finish any handshake
+	bool done = false;
+	for(int round = 0; (round < 16) && !done; round++) {
+		int c = SSL_do_handshake(client);
+		int s = SSL_do_handshake(server);
+		done = (c == 1) && (s == 1);
+		if(((c <= 0) && (SSL_get_error(client, c) != SSL_ERROR_WANT_READ)) || ((s <= 0) && (SSL_get_error(server, s) != SSL_ERROR_WANT_READ)))
+			break;
+	}
+
+	bool ok = done && (!resume || SSL_session_reused(client));
+	if(ok && session)
+		*session = SSL_get1_session(client);
+
+	// Freeing an SSL that wasn't shut down drops its session from the cache
+	SSL_set_shutdown(client, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_set_shutdown(server, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
+	SSL_free(client);
+	SSL_free(server);
+	return ok;
+}
+
 /*
  * Run
  * Accept's new connections (if any)
@@ -121,7 +702,16 @@ void SSLServer::run() {
  */
 void SSLServer::acceptConnection() {
 	BIO* cbio = BIO_pop(listenBIO);
-	SSL* nssl = SSL_new(serverCTX);
+
+	// Handshake flights and short echoes shouldn't sit behind Nagle waiting for a delayed ACK
+	int one = 1, fd = -1;
+	if(BIO_get_fd(cbio, &fd) >= 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	// The SSL holds its own reference to the context, so a reload can swap serverCTXs right after this
+	ctxMutex.lock();
+	SSL* nssl = SSL_new(serverCTXs[nextCTX++ % serverCTXs.size()]);
+	ctxMutex.unlock();
 	if(!nssl) {
 		printf("Couldn't spawn SSL context for new client\n");
 		BIO_free(cbio);
@@ -140,16 +730,125 @@ void SSLServer::acceptConnection() {
 	printf("New client connected\n");
 }
 
+/**
+ * Request Reload
+ * Ask the reload thread to load the certificate and key again. Returns immediately, safe to call from the
+ * accept loop
+ */
+void SSLServer::requestReload() {
+	boost::lock_guard<boost::mutex> lock(reloadMutex);
+	reloadPending = true;
+	reloadCond.notify_one();
+}
+
+/**
+ * Reload
+ * Build a complete new default context from the files on disk and swap it in for new connections. Existing
+ * connections keep the context they were accepted with until they close. On failure the current context stays
+ *
+ * @return True if the new context was installed
+ */
+bool SSLServer::reload() {
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+	// A CRL that fails to load leaves the previous revocation list in place. Either way the contexts built below
+	// refuse to resume client sessions from before the reload
+	if(clientAuth)
+		clientAuth->loadCrl();
+
+	// New tickets under a fresh key, the ones issued so far still resume once more. A failure keeps the old keys
+	if(ticketKeys)
+		ticketKeys->rotate();
+
+	vector<SSL_CTX*> ctxs;
+	bool built = createDefaultContexts(ctxs);
+	long buildMs = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+	if(!built) {
+		printf("Reload failed after %li ms, still serving the previous certificate\n", buildMs);
+		return false;
+	}
+
+	ctxMutex.lock();
+	serverCTXs.swap(ctxs);
+	ctxMutex.unlock();
+	freeContexts(ctxs);
+
+	// Virtual hosts load their files again on their next handshake
+	if(vhosts)
+		vhosts->flush();
+
+	// The new contexts read the CA bundle again and the CRLs were reloaded above, verify every client afresh
+	if(clientAuth)
+		clientAuth->flushCache();
+
+	long totalMs = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+	reloads++;
+	printf("Reload %lu: %i new context%s built in %li ms, installed in %li ms total\n", reloads, ctxReplicas,
+		(ctxReplicas == 1) ? "" : "s", buildMs, totalMs);
+	return true;
+}
+
+/**
+ * Reload Loop
+ * Wait for reload requests. Requests that arrive while a reload is in progress are folded into one more reload.
+ * Every ticketRotateSecs without a reload the session ticket keys are rotated on their own
+ */
+void SSLServer::reloadLoop() {
+	boost::posix_time::ptime rotateAt = boost::posix_time::microsec_clock::universal_time() +
+		boost::posix_time::seconds(ticketRotateSecs);
+	while(true) {
+		bool rotate = false;
+		{
+			boost::unique_lock<boost::mutex> lock(reloadMutex);
+			while(reloadRunning && !reloadPending && !rotate) {
+				if(ticketRotateSecs <= 0)
+					reloadCond.wait(lock);
+				else if(!reloadCond.timed_wait(lock, rotateAt))
+					rotate = true;
+			}
+			if(!reloadRunning)
+				return;
+			if(reloadPending)
+				rotate = false;
+			reloadPending = false;
+		}
+
+		if(rotate) {
+			if(ticketKeys && ticketKeys->rotate())
+				printf("Session ticket keys rotated\n");
+		} else {
+			reload();
+		}
+		rotateAt = boost::posix_time::microsec_clock::universal_time() + boost::posix_time::seconds(ticketRotateSecs);
+	}
+}
+
+void SSLServer::stopReloader() {
+	if(!reloadThread)
+		return;
+
+	reloadMutex.lock();
+	reloadRunning = false;
+	reloadCond.notify_all();
+	reloadMutex.unlock();
+
+	reloadThread->join();
+	delete reloadThread;
+	reloadThread = NULL;
+}
+
 /**
  * Disconnect All
  * Notify's all running Connection threads to stop. Once stopped, Connection objects are deleted and the map is cleared
  */
 void SSLServer::disconnectAll() {
-	// Stop all threads and wait for them to finish their current cycle, then delete the object
+	// Stop all threads first so they wind down together, then wait for each to finish before deleting the object
     list<Connection*>::const_iterator it;
+    for (it = cons->begin(); it != cons->end(); it++)
+		(*it)->stop();
     for (it = cons->begin(); it != cons->end(); it++) {
         Connection *con = *it;
-		con->stop();
+		con->join();
 		delete con;
     }
 
@@ -21,19 +21,52 @@
 
 #include <iostream>
 #include <list>
+#include <vector>
 
 #include <boost/thread.hpp>
 
 #include <openssl/crypto.h>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/pem.h>
 
 #include "Connection.h"
+#include "CryptoPool.h"
+#include "KeylessClient.h"
+#include "EphemeralKeyPool.h"
+#include "OcspStapler.h"
+#include "VirtualHosts.h"
+#include "AntiReplay.h"
+#include "ClientAuth.h"
+#include "RenegotiationGuard.h"
+#include "TicketKeys.h"
+#include "../common/TlsVersion.h"
+#include "../common/StreamFrame.h"
 
 #define SERVER_PORT 443
 #define SERVER_CERTPWD "1234"
 #define SERVER_CERTFILE "../certs/s_ssl.crt"
 #define SERVER_PVKFILE "../certs/s_ssl.pvk"
+#define SERVER_MIN_VERSION 0 // Oldest protocol version accepted (0 = library default)
+#define SERVER_MAX_VERSION 0 // Newest protocol version offered (0 = newest the library supports)
+#define CRYPTO_POOL_THREADS 0 // Worker threads for private key operations (0 = run them inline on the Connection thread, -cryptothreads turns the pool on)
+#define KEYLESS_CHANNELS 2 // Sockets to the key server in keyless mode
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EPHEMERAL_POOL_SIZE 32 // Pre-generated DHE/ECDHE keys of each type (0 = no DHE/ECDHE)
+#define EPHEMERAL_REUSE 1 // Handshakes served by each ephemeral key before it is retired
+#endif
+#define VHOST_CACHE_SIZE 1024 // Virtual host contexts kept loaded at once
+#define EARLY_DATA_MAX 0 // Most TLS 1.3 early data (0-RTT) bytes accepted per connection (0 = refuse early data)
+#define ANTIREPLAY_WINDOW 10 // Seconds a ClientHello offering early data is remembered
+#define SERVER_KTLS false // Hand record encryption to the kernel after the handshake where possible
+#define CLIENT_AUTH_CACHE_SIZE 4096 // Verified client certificate chains remembered
+#define CLIENT_AUTH_CACHE_TTL 3600 // Seconds a verified client certificate chain is trusted without verifying it again
+#define CTX_REPLICAS 1 // Identical default contexts handed out round robin to new connections (0 = one per core)
+#define RENEG_REJECT true // Refuse every client initiated renegotiation, -reneglimit allows it within limits instead
+#define RENEG_PER_CONNECTION 3 // Renegotiations a connection may start within RENEG_WINDOW
+#define RENEG_WINDOW 60 // Seconds over which RENEG_PER_CONNECTION applies
+#define RENEG_GLOBAL_RATE 100 // Renegotiations per second allowed across all connections (0 = no limit)
+#define TICKET_KEY_ROTATE 3600 // Seconds between session ticket key rotations, on top of the one at every reload (0 = only on reload)
 
 using namespace std;
 
@@ -41,12 +74,79 @@ class SSLServer {
 private:
 	BIO* listenBIO;
 	const SSL_METHOD* sslMethod;
-	SSL_CTX* serverCTX;
+	vector<SSL_CTX*> serverCTXs; // Default context replicas, all with the same certificate, settings and ticket keys
+	unsigned int nextCTX;
+	int ctxReplicas;
+	TicketKeys* ticketKeys; // Shared by every context, so tickets resume on any replica and across reloads
+	int ticketRotateSecs; // Seconds between ticket key rotations besides the one at every reload (0 = only on reload)
+	int minVersion;
+	int maxVersion;
 
 	list<Connection*> *cons;
 
+	int cryptoThreads;
+	CryptoPool* cryptoPool;
+
+	string keylessSocket; // Empty unless running keyless
+	int keylessChannels;
+	KeylessClient* keyless;
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	int ephemeralPoolSize;
+	int ephemeralReuse;
+	EphemeralKeyPool* ephemeralPool;
+#endif
+
+	string ocspFile;
+	string ocspUrl;
+	string ocspIssuer;
+	OcspStapler* ocspStapler;
+
+	string vhostFile; // Empty unless serving virtual hosts
+	int vhostCacheSize;
+	VirtualHosts* vhosts;
+
+	bool ktls;
+	int earlyDataMax;
+	int replayWindow;
+	AntiReplayCache* antiReplay;
+
+	string clientCA; // Empty unless verifying client certificates
+	string clientCrl;
+	bool clientAuthRequired;
+	ClientAuth* clientAuth;
+
+	int renegPerConnection;
+	int renegWindow;
+	int renegGlobalRate;
+	bool renegReject;
+	RenegotiationGuard* renegGuard;
+
+	boost::mutex ctxMutex; // Guards serverCTXs and nextCTX once running
+	boost::mutex keyMutex; // Guards lazy creation of cryptoPool
+	boost::thread* reloadThread;
+	boost::mutex reloadMutex; // Guards reloadPending and reloadRunning
+	boost::condition_variable reloadCond;
+	bool reloadPending;
+	bool reloadRunning;
+	unsigned long reloads;
+
 private:
 	void acceptConnection();
+	bool reload();
+	void reloadLoop();
+	void stopReloader();
+	bool createDefaultContexts(vector<SSL_CTX*>& ctxs);
+	SSL_CTX* createContext(const string& certFile, const string& keyFile, bool useKeyless);
+	SSL_CTX* createVirtualHostContext(const string& certFile, const string& keyFile);
+	EVP_PKEY* loadPrivateKeyFile(const string& keyFile);
+	EVP_PKEY* loadKeylessKey(const string& certFile);
+	bool startKeyless();
+	EVP_PKEY* loadCertPublicKey(const string& certFile);
+
+	static void ctxBenchWorker(SSL_CTX* sctx, bool resume, int ops, int* failed);
+	static bool memoryHandshake(SSL_CTX* sctx, SSL_CTX* cctx, SSL_SESSION* resume, SSL_SESSION** session);
+	static void freeContexts(vector<SSL_CTX*>& ctxs);
 
 	static int passwordCallback(char *buf, int size, int rwflag, void *password) {
 		strncpy(buf, (char *)(SERVER_CERTPWD), size);
@@ -60,6 +160,71 @@ public:
 	bool init();
 	void run();
 	void disconnectAll();
+	void requestReload();
+	bool benchmarkKeyless(int ops, int threads);
+	bool benchmarkContexts(int ops, int maxThreads);
+
+	void setVersionRange(int minV, int maxV) {
+		minVersion = minV;
+		maxVersion = maxV;
+	}
+
+	void setContextReplicas(int n) {
+		ctxReplicas = n;
+	}
+
+	void setTicketRotation(int secs) {
+		ticketRotateSecs = secs;
+	}
+
+	void setCryptoThreads(int n) {
+		cryptoThreads = n;
+	}
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	void setEphemeralPool(int size, int reuse) {
+		ephemeralPoolSize = size;
+		ephemeralReuse = reuse;
+	}
+#endif
+
+	void setOcsp(string responseFile, string responderUrl, string issuerFile) {
+		ocspFile = responseFile;
+		ocspUrl = responderUrl;
+		ocspIssuer = issuerFile;
+	}
+
+	void setKeyless(string socketPath, int channels) {
+		keylessSocket = socketPath;
+		keylessChannels = channels;
+	}
+
+	void setKtls(bool enable) {
+		ktls = enable;
+	}
+
+	void setEarlyData(int maxBytes, int window) {
+		earlyDataMax = maxBytes;
+		replayWindow = window;
+	}
+
+	void setVirtualHosts(string indexFile, int cacheSize) {
+		vhostFile = indexFile;
+		vhostCacheSize = cacheSize;
+	}
+
+	void setClientAuth(string caFile, string crlFile, bool required) {
+		clientCA = caFile;
+		clientCrl = crlFile;
+		clientAuthRequired = required;
+	}
+
+	void setRenegotiation(int perConnection, int windowSecs, int globalPerSec, bool reject) {
+		renegPerConnection = perConnection;
+		renegWindow = windowSecs;
+		renegGlobalRate = globalPerSec;
+		renegReject = reject;
+	}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,127 @@
+/**
+   ssltests
+   TicketKeys.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "TicketKeys.h"
+
+int TicketKeys::ctxExIndex = -1;
+
+TicketKeys::TicketKeys() {
+	memset(&current, 0, sizeof(current));
+	memset(&previous, 0, sizeof(previous));
+	hasPrevious = false;
+	rotations = 0;
+
+	// The context's ex_data slot maps it back to the keys
+	if(ctxExIndex < 0)
+		ctxExIndex = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+}
+
+TicketKeys::~TicketKeys() {
+	// Key material shouldn't outlive its use in freed memory
+	OPENSSL_cleanse(&current, sizeof(current));
+	OPENSSL_cleanse(&previous, sizeof(previous));
+}
+
+/**
+ * Rotate
+ * Seal new tickets with a fresh key from now on and keep the current one for decrypting. The first call only
+ * creates the current key
+ *
+ * @return False if no random key could be made, the keys are unchanged then
+ */
+bool TicketKeys::rotate() {
+	Key k;
+	if(!generate(&k)) {
+		printf("Could not create session ticket keys\n");
+		return false;
+	}
+
+	boost::lock_guard<boost::mutex> lock(mutex);
+	if(rotations > 0) {
+		previous = current;
+		hasPrevious = true;
+	}
+	current = k;
+	rotations++;
+	OPENSSL_cleanse(&k, sizeof(k));
+	return true;
+}
+
+/**
+ * Attach
+ * Issue and open session tickets on connections made through ctx with these keys
+ *
+ * @param ctx Context to attach to. The keys must outlive it
+ * @return True on success
+ */
+bool TicketKeys::attach(SSL_CTX* ctx) {
+	if(!SSL_CTX_set_ex_data(ctx, ctxExIndex, this))
+		return false;
+	return SSL_CTX_set_tlsext_ticket_key_cb(ctx, ticketKeyCallback) == 1;
+}
+
+/**
+ * Generate
+ * Random key name, AES and HMAC keys
+ */
+bool TicketKeys::generate(Key* k) {
+	return (RAND_bytes(k->name, sizeof(k->name)) > 0) && (RAND_bytes(k->aesKey, sizeof(k->aesKey)) > 0) &&
+		(RAND_bytes(k->hmacKey, sizeof(k->hmacKey)) > 0);
+}
+
+/**
+ * Ticket Key Callback
+ * Called by OpenSSL to seal a new ticket (enc) or to open one a client presented, picked by its key name
+ *
+ * @return For sealing 1, for opening 1 (current key), 2 (previous key, issue a new ticket) or 0 (unknown key,
+ * full handshake). -1 on error
+ */
+int TicketKeys::ticketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* cctx,
+	HMAC_CTX* hctx, int enc) {
+	TicketKeys* keys = (TicketKeys*)SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctxExIndex);
+	if(!keys)
+		return -1;
+
+	boost::lock_guard<boost::mutex> lock(keys->mutex);
+	if(enc) {
+		const Key& k = keys->current;
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) <= 0)
+			return -1;
+		memcpy(keyName, k.name, sizeof(k.name));
+		if(!EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k.aesKey, iv) ||
+			!HMAC_Init_ex(hctx, k.hmacKey, sizeof(k.hmacKey), EVP_sha256(), NULL))
+			return -1;
+		return 1;
+	}
+
+	const Key* k = NULL;
+	int found = 1;
+	if(memcmp(keyName, keys->current.name, sizeof(keys->current.name)) == 0) {
+		k = &keys->current;
+	} else if(keys->hasPrevious && (memcmp(keyName, keys->previous.name, sizeof(keys->previous.name)) == 0)) {
+		k = &keys->previous;
+		found = 2;
+	}
+	if(!k)
+		return 0;
+
+	if(!HMAC_Init_ex(hctx, k->hmacKey, sizeof(k->hmacKey), EVP_sha256(), NULL) ||
+		!EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, k->aesKey, iv))
+		return -1;
+	return found;
+}
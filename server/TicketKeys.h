@@ -0,0 +1,76 @@
+/**
+   ssltests
+   TicketKeys.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _ticketkeys_h_
+#define _ticketkeys_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string.h>
+
+#include <boost/thread.hpp>
+
+#include <openssl/ssl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+
+/**
+ * Ticket Keys
+ * Session ticket keys shared by every context of the server, so tickets resume on any context replica and across
+ * reloads. New tickets are sealed with the current key; rotate() makes a fresh current key and keeps the one
+ * before it for decrypting only, so tickets issued just before a rotation still resume (and are replaced by one
+ * under the new key) while anything older than two rotations can no longer be opened. Rotating bounds how much
+ * recorded traffic a stolen key exposes. The keys are read by the ticket callback at every handshake, rotation
+ * doesn't need the contexts rebuilt. Safe to share between threads.
+ */
+class TicketKeys {
+private:
+	struct Key {
+		unsigned char name[16];
+		unsigned char aesKey[32];
+		unsigned char hmacKey[32];
+	};
+
+	boost::mutex mutex; // Guards everything below
+	Key current;
+	Key previous;
+	bool hasPrevious;
+	unsigned long rotations;
+
+	static int ctxExIndex;
+
+private:
+	static bool generate(Key* k);
+	static int ticketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* cctx,
+		HMAC_CTX* hctx, int enc);
+
+public:
+	TicketKeys();
+	~TicketKeys();
+
+	bool rotate();
+	bool attach(SSL_CTX* ctx);
+
+	unsigned long getRotations() {
+		boost::lock_guard<boost::mutex> lock(mutex);
+		return rotations;
+	}
+};
+
+#endif
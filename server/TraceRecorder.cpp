@@ -0,0 +1,168 @@
+/**
+   ssltests
+   TraceRecorder.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "TraceRecorder.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+TraceRecorder::TraceRecorder() {
+	file = NULL;
+	payload = false;
+	connections = 0;
+	records = 0;
+	failed = false;
+}
+
+TraceRecorder::~TraceRecorder() {
+	close();
+}
+
+/**
+ * Open
+ * Create (or overwrite) the trace file, readable by this user only since it may hold plaintext. Times in it
+ * count from now
+ *
+ * @param withPayload Keep the plaintext of every message, not just its size
+ * @return True if the file could be created
+ */
+bool TraceRecorder::open(std::string path, bool withPayload) {
+	close();
+
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	file = (fd >= 0) ? fdopen(fd, "wb") : NULL;
+	if(!file) {
+		if(fd >= 0)
+			::close(fd);
+		printf("TraceRecorder: Could not create %s\n", path.c_str());
+		return false;
+	}
+	setvbuf(file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	payload = withPayload;
+	connections = 0;
+	records = 0;
+	failed = false;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// Counts are filled in by close()
+	unsigned char header[TRACE_FILE_HEADER_SIZE];
+	trace_encode_file_header(header, payload ? TRACE_FLAG_PAYLOAD : 0, 0, 0);
+	if(fwrite(header, TRACE_FILE_HEADER_SIZE, 1, file) != 1) {
+		printf("TraceRecorder: Could not write to %s\n", path.c_str());
+		fclose(file);
+		file = NULL;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Close
+ * Write the counts into the header and close the file. Call once no connection records any more
+ */
+void TraceRecorder::close() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	if(!file)
+		return;
+
+	unsigned char header[TRACE_FILE_HEADER_SIZE];
+	trace_encode_file_header(header, payload ? TRACE_FLAG_PAYLOAD : 0, connections, records);
+	if((fseek(file, 0, SEEK_SET) != 0) || (fwrite(header, TRACE_FILE_HEADER_SIZE, 1, file) != 1))
+		failed = true;
+	if(fclose(file) != 0)
+		failed = true;
+	file = NULL;
+
+	printf("TraceRecorder: %u connections, %llu records%s\n", connections, records, failed ? ", writing failed, the trace is incomplete" : "");
+}
+
+/**
+ * Open Connection
+ * Number a connection that completed its handshake and record its start
+ *
+ * @return The number its later records go under, 0 if nothing is recorded
+ */
+unsigned int TraceRecorder::openConnection() {
+	unsigned int id;
+	{
+		boost::lock_guard<boost::mutex> lock(mutex);
+		if(!file)
+			return 0;
+		id = ++connections;
+	}
+	write(id, TRACE_OPEN, NULL, 0);
+	return id;
+}
+
+/**
+ * Message
+ * Record len bytes received from (fromClient) or sent to the client of a connection from openConnection()
+ */
+void TraceRecorder::message(unsigned int connection, bool fromClient, const char* data, unsigned int len) {
+	if(connection && len)
+		write(connection, fromClient ? TRACE_CLIENT : TRACE_SERVER, data, len);
+}
+
+/**
+ * Close Connection
+ * Record the end of a connection from openConnection()
+ */
+void TraceRecorder::closeConnection(unsigned int connection) {
+	if(!connection)
+		return;
+	write(connection, TRACE_CLOSE, NULL, 0);
+
+	// Whole connections reach the file even if the server never gets to close()
+	boost::lock_guard<boost::mutex> lock(mutex);
+	if(file)
+		fflush(file);
+}
+
+/**
+ * Write
+ * Append one record stamped with the time since open(). The stamp is taken under the mutex, so times in the file
+ * never go backwards
+ */
+void TraceRecorder::write(unsigned int connection, unsigned char type, const char* data, unsigned int len) {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	if(!file || failed)
+		return;
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	TraceRecordHeader h;
+	h.time = (now.tv_sec - start.tv_sec) * 1000000ULL + now.tv_nsec / 1000 - start.tv_nsec / 1000;
+	h.connection = connection;
+	h.length = len;
+	h.type = type;
+
+	unsigned char header[TRACE_RECORD_HEADER_SIZE];
+	trace_encode_record(header, h);
+	bool ok = fwrite(header, TRACE_RECORD_HEADER_SIZE, 1, file) == 1;
+	if(ok && trace_has_payload(payload ? TRACE_FLAG_PAYLOAD : 0, type))
+		ok = fwrite(data, len, 1, file) == 1;
+	if(!ok) {
+		printf("TraceRecorder: Write failed, recording stopped\n");
+		failed = true;
+		return;
+	}
+	records++;
+}
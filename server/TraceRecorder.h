@@ -0,0 +1,66 @@
+/**
+   ssltests
+   TraceRecorder.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _tracerecorder_h_
+#define _tracerecorder_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <time.h>
+
+#include <boost/thread.hpp>
+
+#include "../common/TraceFormat.h"
+
+#define TRACE_BUFFER_SIZE (1024 * 1024) // stdio buffer of the trace file, records reach the disk in chunks this big
+
+/**
+ * Trace Recorder
+ * Writes the application messages of every connection to a trace file (see TraceFormat.h) for the client to
+ * replay: when each connection opened and closed, and the time and size of every message each way. A message is
+ * what one read of the connection returned, so messages sent back to back may be merged. Plaintext is kept only
+ * when asked for, since a trace of real traffic holds whatever the clients sent. Records go through one buffered
+ * stream under a mutex, so recording costs a memcpy per message. Safe to share between threads.
+ */
+class TraceRecorder {
+private:
+	FILE* file;
+	bool payload;
+	struct timespec start;
+
+	boost::mutex mutex; // Guards everything below
+	unsigned int connections;
+	unsigned long long records;
+	bool failed;
+
+private:
+	void write(unsigned int connection, unsigned char type, const char* data, unsigned int len);
+
+public:
+	TraceRecorder();
+	~TraceRecorder();
+
+	bool open(std::string path, bool withPayload);
+	void close();
+	unsigned int openConnection();
+	void message(unsigned int connection, bool fromClient, const char* data, unsigned int len);
+	void closeConnection(unsigned int connection);
+};
+
+#endif
@@ -0,0 +1,288 @@
+/**
+   ssltests
+   VirtualHosts.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "VirtualHosts.h"
+
+#include <ctype.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+VirtualHosts::VirtualHosts(ContextFactory ctxFactory, int maxLoadedContexts) {
+	factory = ctxFactory;
+	maxLoaded = (maxLoadedContexts < 1) ? 1 : maxLoadedContexts;
+
+	lookups = 0;
+	exactHits = 0;
+	wildcardHits = 0;
+	misses = 0;
+	loads = 0;
+	loadFailures = 0;
+	evictions = 0;
+	totalLoadUs = 0;
+	maxLoadUs = 0;
+}
+
+VirtualHosts::~VirtualHosts() {
+	printStats();
+	flush();
+
+	HostMap::iterator it;
+	for(it = exact.begin(); it != exact.end(); it++)
+		delete it->second;
+	for(it = wildcards.begin(); it != wildcards.end(); it++)
+		delete it->second;
+}
+
+/**
+ * Load
+ * Read the host index. Certificates aren't touched until a client asks for their host
+ *
+ * @param indexFile Lines of "hostname certfile keyfile", blank lines and lines starting with # are skipped
+ * @return True if the index was read and named at least one host
+ */
+bool VirtualHosts::load(const std::string& indexFile) {
+	FILE* f = fopen(indexFile.c_str(), "r");
+	if(!f) {
+		printf("VirtualHosts: Could not open %s\n", indexFile.c_str());
+		return false;
+	}
+
+	boost::lock_guard<boost::mutex> lock(mutex);
+	char line[2048], name[256], cert[896], key[896];
+	int lineNum = 0, bad = 0;
+	while(fgets(line, sizeof(line), f)) {
+		lineNum++;
+		if(sscanf(line, " %255s", name) != 1 || name[0] == '#')
+			continue;
+		if(sscanf(line, " %255s %895s %895s", name, cert, key) != 3) {
+			printf("VirtualHosts: %s:%i: expected \"hostname certfile keyfile\"\n", indexFile.c_str(), lineNum);
+			bad++;
+			continue;
+		}
+
+		// Host names are case insensitive, store them lowercase so lookups stay a single probe
+		for(char* c = name; *c; c++)
+			*c = tolower(*c);
+
+		Host* host = new Host();
+		host->certFile = cert;
+		host->keyFile = key;
+		host->ctx = NULL;
+		host->failed = false;
+
+		HostMap* map = &exact;
+		host->name = name;
+		if(host->name.compare(0, 2, "*.") == 0) {
+			map = &wildcards;
+			host->name = host->name.substr(2);
+		}
+
+		HostMap::iterator it = map->find(host->name);
+		if(it != map->end()) {
+			printf("VirtualHosts: %s:%i: %s listed again, replacing the earlier entry\n", indexFile.c_str(), lineNum, name);
+			delete it->second;
+			it->second = host;
+		} else {
+			(*map)[host->name] = host;
+		}
+	}
+	fclose(f);
+
+	printf("VirtualHosts: %u hosts and %u wildcards indexed from %s (%i bad lines), up to %u kept loaded\n",
+		(unsigned int)exact.size(), (unsigned int)wildcards.size(), indexFile.c_str(), bad, (unsigned int)maxLoaded);
+	return !exact.empty() || !wildcards.empty();
+}
+
+/**
+ * Attach
+ * Select virtual hosts for handshakes accepted through ctx
+ *
+ * @param ctx Default context. This object must outlive it
+ * @return True on success
+ */
+bool VirtualHosts::attach(SSL_CTX* ctx) {
+	SSL_CTX_set_tlsext_servername_callback(ctx, servernameCallback);
+	SSL_CTX_set_tlsext_servername_arg(ctx, this);
+	return true;
+}
+
+/**
+ * Flush
+ * Drop every loaded context so the next handshake for each host loads its files again. Connections that
+ * already use a context keep it alive until they close
+ */
+void VirtualHosts::flush() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	std::list<Host*>::iterator it;
+	for(it = loaded.begin(); it != loaded.end(); it++) {
+		SSL_CTX_free((*it)->ctx);
+		(*it)->ctx = NULL;
+	}
+	loaded.clear();
+
+	HostMap::iterator hit;
+	for(hit = exact.begin(); hit != exact.end(); hit++)
+		hit->second->failed = false;
+	for(hit = wildcards.begin(); hit != wildcards.end(); hit++)
+		hit->second->failed = false;
+}
+
+/**
+ * Print Stats
+ * Dump how lookups resolved and how much loading the cache did
+ */
+void VirtualHosts::printStats() {
+	boost::lock_guard<boost::mutex> lock(mutex);
+	printf("VirtualHosts: %lu lookups (%lu exact, %lu wildcard, %lu unknown), %lu loads (%lu failed, avg %li us, max %li us), %lu evictions, %u loaded\n",
+		lookups, exactHits, wildcardHits, misses, loads, loadFailures, (loads > 0) ? (totalLoadUs / (long)loads) : 0L,
+		maxLoadUs, evictions, (unsigned int)loaded.size());
+}
+
+/**
+ * Find
+ * Resolve a lowercase server name to its host, trying the exact name then the wildcard for its parent domain.
+ * Must be called with mutex held
+ *
+ * @return The host, NULL if neither is indexed
+ */
+VirtualHosts::Host* VirtualHosts::find(const std::string& name) {
+	lookups++;
+
+	HostMap::iterator it = exact.find(name);
+	if(it != exact.end()) {
+		exactHits++;
+		return it->second;
+	}
+
+	// A wildcard only covers the leftmost label
+	size_t dot = name.find('.');
+	if(dot != std::string::npos && dot > 0) {
+		it = wildcards.find(name.substr(dot + 1));
+		if(it != wildcards.end()) {
+			wildcardHits++;
+			return it->second;
+		}
+	}
+
+	misses++;
+	return NULL;
+}
+
+/**
+ * Get Context
+ * Return the host's context, loading it first if it isn't cached. The files are read outside the lock so a slow
+ * load doesn't hold up handshakes for other hosts. If two handshakes race to load the same host the loser's
+ * context is thrown away.
+ *
+ * @return The context with a reference owned by the caller, NULL if the host's files couldn't be loaded
+ */
+SSL_CTX* VirtualHosts::getContext(Host* host) {
+	boost::unique_lock<boost::mutex> lock(mutex);
+	if(host->ctx) {
+		loaded.splice(loaded.begin(), loaded, host->lruPos);
+		upRef(host->ctx);
+		return host->ctx;
+	}
+	if(host->failed)
+		return NULL;
+	std::string certFile = host->certFile, keyFile = host->keyFile;
+	lock.unlock();
+
+	boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+	SSL_CTX* ctx = factory(certFile, keyFile);
+	long us = (boost::posix_time::microsec_clock::universal_time() - start).total_microseconds();
+
+	lock.lock();
+	loads++;
+	totalLoadUs += us;
+	if(us > maxLoadUs)
+		maxLoadUs = us;
+	if(!ctx) {
+		loadFailures++;
+		host->failed = true;
+		printf("VirtualHosts: Could not load %s / %s\n", certFile.c_str(), keyFile.c_str());
+		return NULL;
+	}
+
+	if(host->ctx) {
+		SSL_CTX_free(ctx);
+		ctx = host->ctx;
+		loaded.splice(loaded.begin(), loaded, host->lruPos);
+	} else {
+		host->ctx = ctx;
+		loaded.push_front(host);
+		host->lruPos = loaded.begin();
+		evict();
+	}
+	upRef(ctx);
+	return ctx;
+}
+
+/**
+ * Evict
+ * Free least recently used contexts until the cache is back within maxLoaded. Must be called with mutex held
+ */
+void VirtualHosts::evict() {
+	while(loaded.size() > maxLoaded) {
+		Host* victim = loaded.back();
+		loaded.pop_back();
+		SSL_CTX_free(victim->ctx);
+		victim->ctx = NULL;
+		evictions++;
+	}
+}
+
+void VirtualHosts::upRef(SSL_CTX* ctx) {
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+	SSL_CTX_up_ref(ctx);
+#else
+	CRYPTO_add(&ctx->references, 1, CRYPTO_LOCK_SSL_CTX);
+#endif
+}
+
+/**
+ * Servername Callback
+ * Called when the ClientHello carries SNI. Moves the connection over to the named host's context
+ */
+int VirtualHosts::servernameCallback(SSL* ssl, int* ad, void* arg) {
+	VirtualHosts* vhosts = (VirtualHosts*)arg;
+
+	const char* servername = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+	if(!servername)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	std::string name(servername);
+	for(size_t i = 0; i < name.size(); i++)
+		name[i] = tolower(name[i]);
+
+	vhosts->mutex.lock();
+	Host* host = vhosts->find(name);
+	vhosts->mutex.unlock();
+	if(!host)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	SSL_CTX* ctx = vhosts->getContext(host);
+	if(!ctx)
+		return SSL_TLSEXT_ERR_NOACK;
+
+	// The SSL takes its own reference, so an eviction right after this can't pull the context out from under it
+	SSL_set_SSL_CTX(ssl, ctx);
+	SSL_CTX_free(ctx);
+
+	return SSL_TLSEXT_ERR_OK;
+}
@@ -0,0 +1,94 @@
+/**
+   ssltests
+   VirtualHosts.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _virtualhosts_h_
+#define _virtualhosts_h_
+
+#include <iostream>
+#include <stdio.h>
+#include <string>
+#include <list>
+
+#include <boost/thread.hpp>
+#include <boost/function.hpp>
+#include <boost/unordered_map.hpp>
+
+#include <openssl/ssl.h>
+
+/**
+ * Virtual Hosts
+ * Switches a handshake to a per host SSL_CTX based on the SNI server name. Hosts come from an index file with one
+ * "hostname certfile keyfile" line each, where hostname may be a "*.example.com" wildcard covering one label.
+ * Lookups are a hash probe for the exact name followed by one for its wildcard parent, so the cost doesn't grow
+ * with the number of hosts. Only the index is read at startup; a host's certificate and key are loaded on its
+ * first handshake, and at most maxLoaded contexts are kept, least recently used first out. Handshakes without
+ * SNI, or for unknown hosts, stay on the default context.
+ */
+class VirtualHosts {
+public:
+	typedef boost::function<SSL_CTX* (const std::string&, const std::string&)> ContextFactory;
+
+private:
+	struct Host {
+		std::string name;
+		std::string certFile;
+		std::string keyFile;
+		SSL_CTX* ctx; // NULL until loaded
+		bool failed; // Don't retry a host whose files didn't load
+		std::list<Host*>::iterator lruPos;
+	};
+	typedef boost::unordered_map<std::string, Host*> HostMap;
+
+	ContextFactory factory;
+	size_t maxLoaded;
+
+	boost::mutex mutex; // Guards everything below
+	HostMap exact;
+	HostMap wildcards; // Keyed by the part after "*."
+	std::list<Host*> loaded; // Most recently used at the front
+
+	// Statistics
+	unsigned long lookups;
+	unsigned long exactHits;
+	unsigned long wildcardHits;
+	unsigned long misses;
+	unsigned long loads;
+	unsigned long loadFailures;
+	unsigned long evictions;
+	long totalLoadUs;
+	long maxLoadUs;
+
+private:
+	Host* find(const std::string& name);
+	SSL_CTX* getContext(Host* host);
+	void evict();
+
+	static void upRef(SSL_CTX* ctx);
+	static int servernameCallback(SSL* ssl, int* ad, void* arg);
+
+public:
+	VirtualHosts(ContextFactory ctxFactory, int maxLoadedContexts);
+	~VirtualHosts();
+
+	bool load(const std::string& indexFile);
+	bool attach(SSL_CTX* ctx);
+	void flush();
+	void printStats();
+};
+
+#endif
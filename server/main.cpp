@@ -17,26 +17,50 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <signal.h>
 
 #include <openssl/ssl.h>
 #include <openssl/rand.h>
 
 #include "SSLServer.h"
+#include "../common/CryptoLocks.h"
+
+// The ephemeral key pool only exists against OpenSSL 1.0 (see EphemeralKeyPool.h)
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+#define EPHEMERAL_USAGE " [-ephemeralpool n] [-ephemeralreuse n]"
+#else
+#define EPHEMERAL_USAGE ""
+#endif
 
 bool canRun;
+volatile sig_atomic_t reloadRequested = 0;
 
 // Handles an unix terminiation signals (Ctrl C)
 void sighandler(int sig) {
 	canRun = false;
 }
 
+// SIGHUP: reload the certificate and key without dropping connections
+void reloadhandler(int sig) {
+	reloadRequested = 1;
+}
+
 int main (int argc, const char * argv[])
 {
 	// Register sighandler for terminiation signals:
 	signal(SIGABRT, &sighandler);
 	signal(SIGINT, &sighandler);
 	signal(SIGTERM, &sighandler);
+	signal(SIGPIPE, SIG_IGN);
+
+	// No SA_RESTART, so a blocked accept returns and the loop below notices the request
+	struct sigaction hup;
+	memset(&hup, 0, sizeof(hup));
+	hup.sa_handler = &reloadhandler;
+	sigemptyset(&hup.sa_mask);
+	sigaction(SIGHUP, &hup, NULL);
 
 	// Init SSL
 	if(!SSL_library_init()) {
@@ -49,10 +73,185 @@ int main (int argc, const char * argv[])
 
 	// Init and run the server
 	SSLServer* svr = new SSLServer();
+	string keylessSocket = "";
+	int keylessChannels = KEYLESS_CHANNELS, benchOps = 0, benchThreads = 1;
+	int ctxBenchOps = 0, ctxBenchThreads = 1;
+	int lockKind = CRYPTO_LOCKS_MUTEX;
+	bool lockStats = false;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	int ephemeralPoolSize = EPHEMERAL_POOL_SIZE, ephemeralReuse = EPHEMERAL_REUSE;
+#endif
+	string ocspFile = "", ocspUrl = "", ocspIssuer = "";
+	string vhostFile = "";
+	int vhostCacheSize = VHOST_CACHE_SIZE;
+	string clientCA = "", clientCrl = "";
+	bool clientAuthRequired = false;
+	int renegPerConnection = RENEG_PER_CONNECTION, renegWindow = RENEG_WINDOW, renegGlobalRate = RENEG_GLOBAL_RATE;
+	bool renegReject = RENEG_REJECT;
+	int minVersion = SERVER_MIN_VERSION, maxVersion = SERVER_MAX_VERSION;
+	int earlyDataMax = EARLY_DATA_MAX, replayWindow = ANTIREPLAY_WINDOW;
+	string traceFile = "";
+	bool tracePayload = false;
+	for(int i = 1; i < argc; i++) {
+		if(((strcmp(argv[i], "-minversion") == 0) || (strcmp(argv[i], "-maxversion") == 0)) && (i+1 < argc)) {
+			int v = tls_version_from_name(argv[i+1]);
+			if(v < 0) {
+				printf("Unknown protocol version %s, expected one of: %s\n", argv[i+1], TLSVERSION_NAMES);
+				delete svr;
+				return -1;
+			}
+			if(strcmp(argv[i], "-minversion") == 0)
+				minVersion = v;
+			else
+				maxVersion = v;
+			i++;
+		} else if(strcmp(argv[i], "-quiet") == 0) {
+			Connection::setVerbose(false);
+		} else if((strcmp(argv[i], "-cryptolocks") == 0) && (i+1 < argc)) {
+			lockKind = CryptoLocks::kindFromName(argv[++i]);
+			if(lockKind < 0) {
+				printf("Unknown lock kind %s, expected one of: %s\n", argv[i], CRYPTO_LOCKS_NAMES);
+				delete svr;
+				return -1;
+			}
+		} else if(strcmp(argv[i], "-lockstats") == 0) {
+			lockStats = true;
+		} else if(strcmp(argv[i], "-ktls") == 0) {
+			svr->setKtls(true);
+		} else if((strcmp(argv[i], "-earlydata") == 0) && (i+1 < argc)) {
+			earlyDataMax = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-trace") == 0) && (i+1 < argc)) {
+			traceFile = argv[++i];
+		} else if(strcmp(argv[i], "-tracepayload") == 0) {
+			tracePayload = true;
+		} else if((strcmp(argv[i], "-replaywindow") == 0) && (i+1 < argc)) {
+			replayWindow = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-cryptothreads") == 0) && (i+1 < argc)) {
+			svr->setCryptoThreads(atoi(argv[++i]));
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+		} else if((strcmp(argv[i], "-ephemeralpool") == 0) && (i+1 < argc)) {
+			ephemeralPoolSize = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-ephemeralreuse") == 0) && (i+1 < argc)) {
+			ephemeralReuse = atoi(argv[++i]);
+#endif
+		} else if((strcmp(argv[i], "-ocspfile") == 0) && (i+1 < argc)) {
+			ocspFile = argv[++i];
+		} else if((strcmp(argv[i], "-ocspurl") == 0) && (i+1 < argc)) {
+			ocspUrl = argv[++i];
+		} else if((strcmp(argv[i], "-ocspissuer") == 0) && (i+1 < argc)) {
+			ocspIssuer = argv[++i];
+		} else if((strcmp(argv[i], "-vhosts") == 0) && (i+1 < argc)) {
+			vhostFile = argv[++i];
+		} else if((strcmp(argv[i], "-vhostcache") == 0) && (i+1 < argc)) {
+			vhostCacheSize = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-clientca") == 0) && (i+1 < argc)) {
+			clientCA = argv[++i];
+		} else if((strcmp(argv[i], "-clientcrl") == 0) && (i+1 < argc)) {
+			clientCrl = argv[++i];
+		} else if((strcmp(argv[i], "-clientauth") == 0) && (i+1 < argc) && ((strcmp(argv[i+1], "optional") == 0) || (strcmp(argv[i+1], "required") == 0))) {
+			clientAuthRequired = (strcmp(argv[++i], "required") == 0);
+		} else if(strcmp(argv[i], "-noreneg") == 0) {
+			renegReject = true;
+		} else if((strcmp(argv[i], "-reneglimit") == 0) && (i+2 < argc)) {
+			renegPerConnection = atoi(argv[++i]);
+			renegWindow = atoi(argv[++i]);
+			renegReject = false;
+		} else if((strcmp(argv[i], "-renegrate") == 0) && (i+1 < argc)) {
+			renegGlobalRate = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-keyless") == 0) && (i+1 < argc)) {
+			keylessSocket = argv[++i];
+		} else if((strcmp(argv[i], "-keylesschannels") == 0) && (i+1 < argc)) {
+			keylessChannels = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-ctxreplicas") == 0) && (i+1 < argc)) {
+			svr->setContextReplicas(atoi(argv[++i]));
+		} else if((strcmp(argv[i], "-ticketrotate") == 0) && (i+1 < argc)) {
+			svr->setTicketRotation(atoi(argv[++i]));
+		} else if((strcmp(argv[i], "-ctxbench") == 0) && (i+2 < argc)) {
+			ctxBenchOps = atoi(argv[++i]);
+			ctxBenchThreads = atoi(argv[++i]);
+		} else if((strcmp(argv[i], "-keylessbench") == 0) && (i+2 < argc)) {
+			benchOps = atoi(argv[++i]);
+			benchThreads = atoi(argv[++i]);
+		} else {
+			printf("Unknown option: %s\n", argv[i]);
+			printf("Usage: %s [-minversion v] [-maxversion v] [-quiet] [-ktls] [-earlydata bytes] [-replaywindow secs]\n"
+				"\t[-cryptolocks kind] [-lockstats] [-cryptothreads n]" EPHEMERAL_USAGE "\n"
+				"\t[-ocspfile file | -ocspurl url] [-ocspissuer file] [-vhosts indexfile] [-vhostcache n]\n"
+				"\t[-clientca file] [-clientcrl file] [-clientauth optional|required]\n"
+				"\t[-noreneg] [-reneglimit n secs] [-renegrate n]\n"
+				"\t[-keyless socket] [-keylesschannels n] [-keylessbench ops threads]\n"
+				"\t[-ctxreplicas n] [-ctxbench ops threads] [-ticketrotate secs] [-trace file [-tracepayload]]\n", argv[0]);
+			delete svr;
+			return -1;
+		}
+	}
+	svr->setVersionRange(minVersion, maxVersion);
+
+	// OpenSSL 1.0 needs locking callbacks before any of the server's threads use it
+	if(!CryptoLocks::install(lockKind, lockStats)) {
+		delete svr;
+		return -1;
+	}
+	svr->setEarlyData(earlyDataMax, replayWindow);
+	svr->setRenegotiation(renegPerConnection, renegWindow, renegGlobalRate, renegReject);
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	svr->setEphemeralPool(ephemeralPoolSize, ephemeralReuse);
+#endif
+	svr->setOcsp(ocspFile, ocspUrl, ocspIssuer);
+	if(!vhostFile.empty())
+		svr->setVirtualHosts(vhostFile, vhostCacheSize);
+	if(!clientCA.empty())
+		svr->setClientAuth(clientCA, clientCrl, clientAuthRequired);
+	else if(!clientCrl.empty() || clientAuthRequired)
+		printf("-clientcrl and -clientauth need -clientca, not verifying clients\n");
+	if(!keylessSocket.empty())
+		svr->setKeyless(keylessSocket, keylessChannels);
+
+	// Benchmark the key server pipeline instead of serving
+	if(benchOps > 0) {
+		bool ok = svr->benchmarkKeyless(benchOps, benchThreads);
+		delete svr;
+		CryptoLocks::printStats();
+		return ok ? 0 : -1;
+	}
+
+	// Benchmark context lock contention instead of serving
+	if(ctxBenchOps > 0) {
+		bool ok = svr->benchmarkContexts(ctxBenchOps, ctxBenchThreads);
+		delete svr;
+		CryptoLocks::printStats();
+		return ok ? 0 : -1;
+	}
+
+	// Record every connection's messages for the client's -replay
+	TraceRecorder* trace = NULL;
+	if(!traceFile.empty()) {
+		trace = new TraceRecorder();
+		if(!trace->open(traceFile, tracePayload)) {
+			delete trace;
+			delete svr;
+			return -1;
+		}
+		Connection::setTrace(trace);
+	}
+
 	canRun = svr->init();
-	while(canRun)
+	while(canRun) {
+		if(reloadRequested) {
+			reloadRequested = 0;
+			svr->requestReload();
+		}
 		svr->run();
+	}
+	// Deleting the server joins every Connection thread, nothing records into the trace after that
 	delete svr;
+	if(trace) {
+		Connection::setTrace(NULL);
+		trace->close();
+		delete trace;
+	}
+	CryptoLocks::printStats();
+	CryptoLocks::uninstall();
 
 	return 0;
 }
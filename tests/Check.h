@@ -0,0 +1,41 @@
+/**
+   ssltests
+   Check.h
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#ifndef _check_h_
+#define _check_h_
+
+#include <stdio.h>
+
+/**
+ * Check
+ * Minimal assertions for the standalone tests: a failed CHECK prints where and what, and the test's main()
+ * returns CHECK_RESULT() so "make check" stops on the first test program with a failure
+ */
+
+static int checkFailures = 0;
+
+#define CHECK(cond) do { \
+	if(!(cond)) { \
+		printf("%s:%i: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		checkFailures++; \
+	} \
+} while(0)
+
+#define CHECK_RESULT(name) (printf("%s: %s\n", name, checkFailures ? "FAILED" : "passed"), checkFailures ? 1 : 0)
+
+#endif
@@ -0,0 +1,126 @@
+/**
+   ssltests
+   KeyProtocolTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <string.h>
+
+#include <vector>
+
+#include "Check.h"
+#include "../common/KeyProtocol.h"
+
+// Header fields land big endian where the format says and come back unchanged
+static void testHeader() {
+	unsigned char buf[KEYPROTO_HEADER_LEN];
+	keyproto_pack_header(buf, 0x01020304, KEYOP_RSA_SIGN, 1, 0x0203);
+	const unsigned char expect[KEYPROTO_HEADER_LEN] = { 0x01, 0x02, 0x03, 0x04, KEYOP_RSA_SIGN, 1, 0x02, 0x03 };
+	CHECK(memcmp(buf, expect, KEYPROTO_HEADER_LEN) == 0);
+
+	uint32_t id;
+	uint8_t op, arg;
+	uint16_t len;
+	keyproto_unpack_header(buf, &id, &op, &arg, &len);
+	CHECK(id == 0x01020304);
+	CHECK(op == KEYOP_RSA_SIGN);
+	CHECK(arg == 1);
+	CHECK(len == 0x0203);
+
+	// Largest values each field holds, no sign extension on the way back
+	keyproto_pack_header(buf, 0xffffffff, 0xff, 0xff, 0xffff);
+	keyproto_unpack_header(buf, &id, &op, &arg, &len);
+	CHECK(id == 0xffffffff);
+	CHECK(op == 0xff);
+	CHECK(arg == 0xff);
+	CHECK(len == 0xffff);
+}
+
+// Append a request frame the way KeylessClient queues one
+static void appendFrame(std::vector<unsigned char>& out, uint32_t id, uint8_t op, const unsigned char* payload, uint16_t len) {
+	size_t off = out.size();
+	out.resize(off + KEYPROTO_HEADER_LEN + len);
+	keyproto_pack_header(&out[off], id, op, 0, len);
+	if(len)
+		memcpy(&out[off + KEYPROTO_HEADER_LEN], payload, len);
+}
+
+// Pipelined frames split out of a buffer one by one, payloads intact
+static void testRoundTrip() {
+	unsigned char payload[KEYPROTO_MAX_PAYLOAD];
+	for(unsigned int i = 0; i < sizeof(payload); i++)
+		payload[i] = (unsigned char)i;
+
+	std::vector<unsigned char> buf;
+	appendFrame(buf, 1, KEYOP_RSA_DECRYPT, payload, 256);
+	appendFrame(buf, 2, KEYOP_ECDSA_SIGN, payload, 0);
+	appendFrame(buf, 3, KEYOP_RSA_SIGN, payload, KEYPROTO_MAX_PAYLOAD);
+
+	const uint32_t ids[] = { 1, 2, 3 };
+	const uint16_t lens[] = { 256, 0, KEYPROTO_MAX_PAYLOAD };
+	size_t off = 0;
+	for(int i = 0; i < 3; i++) {
+		int flen = keyproto_frame_length(&buf[0] + off, buf.size() - off);
+		CHECK(flen == KEYPROTO_HEADER_LEN + lens[i]);
+		if(flen <= 0)
+			return;
+
+		uint32_t id;
+		uint8_t op, arg;
+		uint16_t len;
+		keyproto_unpack_header(&buf[off], &id, &op, &arg, &len);
+		CHECK(id == ids[i]);
+		CHECK(len == lens[i]);
+		CHECK(memcmp(&buf[off + KEYPROTO_HEADER_LEN], payload, len) == 0);
+		off += flen;
+	}
+	CHECK(off == buf.size());
+	CHECK(keyproto_frame_length(&buf[0] + off, 0) == 0);
+}
+
+// A frame cut anywhere, in the header or the payload, waits for more bytes
+static void testTruncated() {
+	unsigned char payload[300];
+	memset(payload, 0x5a, sizeof(payload));
+	std::vector<unsigned char> buf;
+	appendFrame(buf, 9, KEYOP_RSA_DECRYPT, payload, sizeof(payload));
+
+	for(size_t avail = 0; avail < buf.size(); avail++)
+		CHECK(keyproto_frame_length(&buf[0], avail) == 0);
+	CHECK(keyproto_frame_length(&buf[0], buf.size()) == (int)buf.size());
+
+	// Bytes of the next frame behind it don't change its length
+	buf.push_back(0);
+	CHECK(keyproto_frame_length(&buf[0], buf.size()) == (int)buf.size() - 1);
+}
+
+// A header announcing more than KEYPROTO_MAX_PAYLOAD is refused as soon as the header is in
+static void testOversized() {
+	unsigned char buf[KEYPROTO_HEADER_LEN];
+	keyproto_pack_header(buf, 1, KEYOP_RSA_SIGN, 0, KEYPROTO_MAX_PAYLOAD + 1);
+	CHECK(keyproto_frame_length(buf, KEYPROTO_HEADER_LEN - 1) == 0);
+	CHECK(keyproto_frame_length(buf, KEYPROTO_HEADER_LEN) == -1);
+
+	keyproto_pack_header(buf, 1, KEYOP_RSA_SIGN, 0, 0xffff);
+	CHECK(keyproto_frame_length(buf, KEYPROTO_HEADER_LEN) == -1);
+}
+
+int main(int argc, char** argv) {
+	testHeader();
+	testRoundTrip();
+	testTruncated();
+	testOversized();
+	return CHECK_RESULT("KeyProtocolTest");
+}
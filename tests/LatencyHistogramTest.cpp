@@ -0,0 +1,148 @@
+/**
+   ssltests
+   LatencyHistogramTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "Check.h"
+#include "../client/LatencyHistogram.h"
+
+// Whether a reported value is within the histogram's precision (1/128) of the exact one
+static bool withinPrecision(long long reported, long long exact) {
+	return (reported >= exact) && (reported - exact <= exact / 128 + 1);
+}
+
+static void testEmpty() {
+	LatencyHistogram h;
+	CHECK(h.count() == 0);
+	CHECK(h.min() == 0);
+	CHECK(h.max() == 0);
+	CHECK(h.mean() == 0);
+	CHECK(h.valueAtPercentile(50) == 0);
+}
+
+// Values below 2^HISTOGRAM_SUB_BITS are kept exactly
+static void testExact() {
+	LatencyHistogram h;
+	for(long long v = 1; v <= 100; v++)
+		h.record(v);
+	CHECK(h.count() == 100);
+	CHECK(h.min() == 1);
+	CHECK(h.max() == 100);
+	CHECK(h.mean() == 50.5);
+	CHECK(h.valueAtPercentile(0) == 1);
+	CHECK(h.valueAtPercentile(50) == 50);
+	CHECK(h.valueAtPercentile(99) == 99);
+	CHECK(h.valueAtPercentile(100) == 100);
+}
+
+// Larger values to within the stated relative error, never reported below the true percentile
+static void testPrecision() {
+	LatencyHistogram h;
+	for(long long v = 1; v <= 1000000; v++)
+		h.record(v);
+	CHECK(withinPrecision(h.valueAtPercentile(50), 500000));
+	CHECK(withinPrecision(h.valueAtPercentile(90), 900000));
+	CHECK(withinPrecision(h.valueAtPercentile(99.9), 999000));
+	CHECK(h.valueAtPercentile(100) == 1000000);
+
+	for(long long v = 1000; v < (1LL << 36); v = v * 3 + 1) {
+		LatencyHistogram one;
+		one.record(v);
+		CHECK(withinPrecision(one.valueAtPercentile(50), v));
+	}
+}
+
+// Out of range values are clamped rather than lost
+static void testClamp() {
+	LatencyHistogram h;
+	h.record(-5);
+	h.record(1LL << 50);
+	CHECK(h.count() == 2);
+	CHECK(h.min() == 0);
+	CHECK(h.max() == (1LL << HISTOGRAM_MAX_BITS) - 1);
+	CHECK(h.valueAtPercentile(50) == 0);
+	CHECK(h.valueAtPercentile(100) == (1LL << HISTOGRAM_MAX_BITS) - 1);
+}
+
+// Merging per thread histograms gives the same answers as recording everything in one
+static void testAdd() {
+	LatencyHistogram a, b, all;
+	for(long long v = 1; v <= 5000; v++) {
+		((v % 2) ? a : b).record(v * 7);
+		all.record(v * 7);
+	}
+	LatencyHistogram empty;
+	a.add(empty);
+	a.add(b);
+	CHECK(a.count() == all.count());
+	CHECK(a.min() == all.min());
+	CHECK(a.max() == all.max());
+	CHECK(a.mean() == all.mean());
+	for(double p = 0; p <= 100; p += 12.5)
+		CHECK(a.valueAtPercentile(p) == all.valueAtPercentile(p));
+
+	// Into an empty one, min comes from the other side
+	LatencyHistogram fresh;
+	fresh.add(b);
+	CHECK(fresh.min() == b.min());
+}
+
+// The distribution log ends on the 100% line with the max and the total
+static void testWriteDistribution() {
+	LatencyHistogram h;
+	for(long long v = 1; v <= 1000; v++)
+		h.record(v * 1000);
+
+	char path[] = "/tmp/histogramtestXXXXXX";
+	int fd = mkstemp(path);
+	CHECK(fd >= 0);
+	if(fd < 0)
+		return;
+	close(fd);
+	CHECK(h.writeDistribution(path));
+
+	FILE* f = fopen(path, "r");
+	CHECK(f != NULL);
+	if(f) {
+		char line[256];
+		bool sawEnd = false;
+		while(fgets(line, sizeof(line), f)) {
+			double value, percentile;
+			unsigned long long count;
+			if((sscanf(line, "%lf %lf %llu", &value, &percentile, &count) == 3) && (percentile == 1.0)) {
+				CHECK(value == 1000.0);
+				CHECK(count == 1000);
+				sawEnd = true;
+			}
+		}
+		CHECK(sawEnd);
+		fclose(f);
+	}
+	unlink(path);
+}
+
+int main(int argc, char** argv) {
+	testEmpty();
+	testExact();
+	testPrecision();
+	testClamp();
+	testAdd();
+	testWriteDistribution();
+	return CHECK_RESULT("LatencyHistogramTest");
+}
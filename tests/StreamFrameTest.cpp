@@ -0,0 +1,118 @@
+/**
+   ssltests
+   StreamFrameTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include <deque>
+#include <vector>
+
+#include "Check.h"
+#include "../common/StreamFrame.h"
+
+// Header fields land big endian where the format says and come back unchanged
+static void testHeader() {
+	unsigned char buf[MUX_HEADER_SIZE];
+	mux_encode_header(buf, 0x01020304, MUX_FLAG_FIN, 0x050607);
+	const unsigned char expect[MUX_HEADER_SIZE] = { 0x01, 0x02, 0x03, 0x04, MUX_FLAG_FIN, 0x05, 0x06, 0x07 };
+	CHECK(memcmp(buf, expect, MUX_HEADER_SIZE) == 0);
+
+	MuxFrameHeader h;
+	mux_decode_header(buf, &h);
+	CHECK(h.stream == 0x01020304);
+	CHECK(h.flags == MUX_FLAG_FIN);
+	CHECK(h.length == 0x050607);
+
+	// Largest values each field holds, no sign extension on the way back
+	mux_encode_header(buf, 0xffffffff, 0xff, 0xffffff);
+	mux_decode_header(buf, &h);
+	CHECK(h.stream == 0xffffffff);
+	CHECK(h.flags == 0xff);
+	CHECK(h.length == 0xffffff);
+
+	// A window update's credit goes in the length field
+	mux_encode_header(buf, 7, MUX_FLAG_WINDOW, MUX_INITIAL_WINDOW);
+	mux_decode_header(buf, &h);
+	CHECK(h.stream == 7);
+	CHECK(h.flags == MUX_FLAG_WINDOW);
+	CHECK(h.length == MUX_INITIAL_WINDOW);
+}
+
+// Frames appended to either buffer type the client and server use decode back to what went in
+template <class Buffer>
+static void testAppend() {
+	Buffer out;
+	const char payload[] = "hello";
+	mux_append_frame(out, 3, 0, payload, 5);
+	mux_append_frame(out, 5, MUX_FLAG_FIN, NULL, 0);
+	CHECK(out.size() == MUX_HEADER_SIZE * 2 + 5);
+
+	std::vector<unsigned char> bytes(out.begin(), out.end());
+	MuxFrameHeader h;
+	mux_decode_header(&bytes[0], &h);
+	CHECK(h.stream == 3);
+	CHECK(h.flags == 0);
+	CHECK(h.length == 5);
+	CHECK(memcmp(&bytes[MUX_HEADER_SIZE], payload, 5) == 0);
+
+	mux_decode_header(&bytes[MUX_HEADER_SIZE + 5], &h);
+	CHECK(h.stream == 5);
+	CHECK(h.flags == MUX_FLAG_FIN);
+	CHECK(h.length == 0);
+}
+
+// Select MUX_ALPN from a wire format protocol list
+static int select(const unsigned char* in, unsigned int inlen, const unsigned char** out, unsigned char* outlen) {
+	return mux_alpn_select(NULL, out, outlen, in, inlen, NULL);
+}
+
+static void testAlpn() {
+	const unsigned char* out = NULL;
+	unsigned char outlen = 0;
+	unsigned int len = strlen(MUX_ALPN);
+
+	// Offered after another protocol
+	std::vector<unsigned char> list;
+	list.push_back(8);
+	list.insert(list.end(), "http/1.1", "http/1.1" + 8);
+	list.push_back(len);
+	list.insert(list.end(), MUX_ALPN, MUX_ALPN + len);
+	CHECK(select(&list[0], list.size(), &out, &outlen) == SSL_TLSEXT_ERR_OK);
+	CHECK(outlen == len);
+	CHECK(out == &list[10]);
+	CHECK(memcmp(out, MUX_ALPN, len) == 0);
+
+	// Not offered
+	std::vector<unsigned char> plain(list.begin(), list.begin() + 9);
+	CHECK(select(&plain[0], plain.size(), &out, &outlen) == SSL_TLSEXT_ERR_NOACK);
+
+	// Offered, but the list ends before the name does
+	std::vector<unsigned char> cut(list.begin(), list.end() - 1);
+	CHECK(select(&cut[0], cut.size(), &out, &outlen) == SSL_TLSEXT_ERR_NOACK);
+
+	// A prefix of the name is a different protocol
+	std::vector<unsigned char> prefix;
+	prefix.push_back(len - 2);
+	prefix.insert(prefix.end(), MUX_ALPN, MUX_ALPN + len - 2);
+	CHECK(select(&prefix[0], prefix.size(), &out, &outlen) == SSL_TLSEXT_ERR_NOACK);
+}
+
+int main(int argc, char** argv) {
+	testHeader();
+	testAppend<std::vector<char> >();
+	testAppend<std::deque<char> >();
+	testAlpn();
+	return CHECK_RESULT("StreamFrameTest");
+}
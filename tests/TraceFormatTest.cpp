@@ -0,0 +1,76 @@
+/**
+   ssltests
+   TraceFormatTest.cpp
+   Copyright 2011 Ramsey Kant
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+*/
+
+#include "Check.h"
+#include "../common/TraceFormat.h"
+
+// File header: magic, then flags, connections and the 64 bit record count, big endian
+static void testFileHeader() {
+	unsigned char buf[TRACE_FILE_HEADER_SIZE];
+	trace_encode_file_header(buf, TRACE_FLAG_PAYLOAD, 0x0a0b0c0d, 0x0102030405060708ULL);
+	const unsigned char expect[TRACE_FILE_HEADER_SIZE] = {
+		'S', 'S', 'L', 'T', 'R', 'C', '0', '1',
+		0, 0, 0, TRACE_FLAG_PAYLOAD,
+		0x0a, 0x0b, 0x0c, 0x0d,
+		0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08
+	};
+	CHECK(memcmp(buf, expect, TRACE_FILE_HEADER_SIZE) == 0);
+	CHECK(trace_get32(buf + 12) == 0x0a0b0c0d);
+}
+
+// Records come back unchanged, including times past 32 bits, and the reserved bytes are zeroed
+static void testRecord() {
+	unsigned char buf[TRACE_RECORD_HEADER_SIZE];
+	memset(buf, 0xee, sizeof(buf));
+
+	TraceRecordHeader in;
+	in.time = 0x123456789aULL;
+	in.connection = 0xfffffffe;
+	in.length = 16384;
+	in.type = TRACE_SERVER;
+	trace_encode_record(buf, in);
+	CHECK(buf[0] == 0x00);
+	CHECK(buf[3] == 0x12);
+	CHECK(buf[7] == 0x9a);
+	CHECK(buf[16] == TRACE_SERVER);
+	CHECK((buf[17] == 0) && (buf[18] == 0) && (buf[19] == 0));
+
+	TraceRecordHeader out;
+	trace_decode_record(buf, &out);
+	CHECK(out.time == in.time);
+	CHECK(out.connection == in.connection);
+	CHECK(out.length == in.length);
+	CHECK(out.type == in.type);
+}
+
+// Only message records of payload files carry bytes after the header
+static void testHasPayload() {
+	CHECK(trace_has_payload(TRACE_FLAG_PAYLOAD, TRACE_CLIENT));
+	CHECK(trace_has_payload(TRACE_FLAG_PAYLOAD, TRACE_SERVER));
+	CHECK(!trace_has_payload(TRACE_FLAG_PAYLOAD, TRACE_OPEN));
+	CHECK(!trace_has_payload(TRACE_FLAG_PAYLOAD, TRACE_CLOSE));
+	CHECK(!trace_has_payload(0, TRACE_CLIENT));
+	CHECK(!trace_has_payload(0, TRACE_SERVER));
+}
+
+int main(int argc, char** argv) {
+	testFileHeader();
+	testRecord();
+	testHasPayload();
+	return CHECK_RESULT("TraceFormatTest");
+}